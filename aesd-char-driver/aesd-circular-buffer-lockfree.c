@@ -0,0 +1,119 @@
+/**
+ * @file aesd-circular-buffer-lockfree.c
+ * @brief Lock-free single and multi producer variant of the circular buffer
+ *
+ * SPSC mode needs no more than the two indices: the producer publishes an entry by advancing
+ * tail with release ordering after filling the slot, and the consumer frees a slot by advancing
+ * head after reading it. MPSC mode uses a sequence number per slot, as in Dmitry Vyukov's
+ * bounded queue: producers claim a position by compare and swap on tail, and the slot's seq
+ * tells the consumer when the claimed slot has been filled.
+ */
+
+#include <string.h>
+#include "aesd-circular-buffer-lockfree.h"
+
+#define CAPACITY AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
+
+/**
+* Initializes @param buffer to an empty buffer for the producers and consumer described by @param mode.
+* Must not race with any other call on the buffer.
+*/
+void aesd_lockfree_buffer_init(struct aesd_lockfree_buffer *buffer, enum aesd_lockfree_mode mode)
+{
+    memset(buffer, 0, sizeof(struct aesd_lockfree_buffer));
+    buffer->mode = mode;
+    atomic_init(&buffer->head, 0);
+    atomic_init(&buffer->tail, 0);
+    for (size_t i = 0; i < CAPACITY; i++) {
+        atomic_init(&buffer->slot[i].seq, i);
+    }
+}
+
+static bool push_spsc(struct aesd_lockfree_buffer *buffer, const struct aesd_buffer_entry *add_entry)
+{
+    size_t tail = atomic_load_explicit(&buffer->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&buffer->head, memory_order_acquire);
+    if (tail - head == CAPACITY) {
+        return false;
+    }
+    buffer->slot[tail % CAPACITY].entry = *add_entry;
+    atomic_store_explicit(&buffer->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+static bool push_mpsc(struct aesd_lockfree_buffer *buffer, const struct aesd_buffer_entry *add_entry)
+{
+    size_t pos = atomic_load_explicit(&buffer->tail, memory_order_relaxed);
+    struct aesd_lockfree_slot *slot;
+    while (1) {
+        slot = &buffer->slot[pos % CAPACITY];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        ptrdiff_t diff = (ptrdiff_t)(seq - pos);
+        if (diff == 0) {
+            // The slot is free: claim its position, or retry from wherever tail moved to.
+            if (atomic_compare_exchange_weak_explicit(&buffer->tail, &pos, pos + 1,
+                        memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // Still holds the entry from a lap ago, which the consumer has not taken.
+            return false;
+        } else {
+            pos = atomic_load_explicit(&buffer->tail, memory_order_relaxed);
+        }
+    }
+    slot->entry = *add_entry;
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+    return true;
+}
+
+/**
+* Adds a copy of @param add_entry to the newest end of @param buffer. Safe to call from one producer
+* thread at a time in AESD_LOCKFREE_SPSC mode and from any number in AESD_LOCKFREE_MPSC mode.
+* @return true if the entry was added, false if the buffer is full
+*/
+bool aesd_lockfree_buffer_push(struct aesd_lockfree_buffer *buffer, const struct aesd_buffer_entry *add_entry)
+{
+    if (buffer->mode == AESD_LOCKFREE_SPSC) {
+        return push_spsc(buffer, add_entry);
+    }
+    return push_mpsc(buffer, add_entry);
+}
+
+/**
+* Removes the oldest entry of @param buffer into @param entry. Must only be called from the consumer
+* thread.
+* @return true if an entry was removed, false if the buffer is empty. An MPSC producer that claimed
+* the oldest position but has not filled it yet makes the buffer look empty until it does.
+*/
+bool aesd_lockfree_buffer_pop(struct aesd_lockfree_buffer *buffer, struct aesd_buffer_entry *entry)
+{
+    size_t head = atomic_load_explicit(&buffer->head, memory_order_relaxed);
+    struct aesd_lockfree_slot *slot = &buffer->slot[head % CAPACITY];
+    if (buffer->mode == AESD_LOCKFREE_SPSC) {
+        if (atomic_load_explicit(&buffer->tail, memory_order_acquire) == head) {
+            return false;
+        }
+        *entry = slot->entry;
+    } else {
+        if (atomic_load_explicit(&slot->seq, memory_order_acquire) != head + 1) {
+            return false;
+        }
+        *entry = slot->entry;
+        // Hand the slot to the producer of the position one lap ahead.
+        atomic_store_explicit(&slot->seq, head + CAPACITY, memory_order_release);
+    }
+    atomic_store_explicit(&buffer->head, head + 1, memory_order_release);
+    return true;
+}
+
+/**
+* @return the number of entries in @param buffer. Exact from the consumer thread when no producer is
+* running; otherwise a snapshot that may already be out of date.
+*/
+size_t aesd_lockfree_buffer_count(struct aesd_lockfree_buffer *buffer)
+{
+    size_t head = atomic_load_explicit(&buffer->head, memory_order_acquire);
+    size_t tail = atomic_load_explicit(&buffer->tail, memory_order_acquire);
+    return tail > head ? tail - head : 0;
+}
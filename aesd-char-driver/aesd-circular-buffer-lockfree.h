@@ -0,0 +1,73 @@
+/*
+ * aesd-circular-buffer-lockfree.h
+ *
+ * User space variant of aesd-circular-buffer usable as an in-process queue
+ * without a lock, e.g. from connection handler threads to one device writer.
+ */
+
+#ifndef AESD_CIRCULAR_BUFFER_LOCKFREE_H
+#define AESD_CIRCULAR_BUFFER_LOCKFREE_H
+
+#ifdef __KERNEL__
+#error "aesd-circular-buffer-lockfree is user space only, the driver uses aesd-circular-buffer"
+#endif
+
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "aesd-circular-buffer.h"
+
+/**
+ * Size of a cache line. The producer and consumer indices each get a line of their own, so
+ * updating one does not invalidate the other in the other thread's cache.
+ */
+#define AESD_CACHE_LINE 64
+
+enum aesd_lockfree_mode {
+    /** One producer thread and one consumer thread */
+    AESD_LOCKFREE_SPSC,
+    /** Any number of producer threads and one consumer thread */
+    AESD_LOCKFREE_MPSC,
+};
+
+struct aesd_lockfree_slot
+{
+    /**
+     * MPSC only: equal to the slot's position when it is free to fill, position + 1 once filled
+     * and position + capacity once the consumer took it.
+     */
+    atomic_size_t seq;
+    struct aesd_buffer_entry entry;
+};
+
+/**
+ * Holds up to AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED entries in the order they were pushed,
+ * like aesd_circular_buffer. Unlike it, a full buffer refuses new entries instead of evicting
+ * the oldest: with no lock there is no safe moment to free an entry the consumer may be
+ * reading. Entries are moved in and out, so the consumer owns what it pops.
+ * head and tail count entries popped and pushed since init and never wrap in practice.
+ */
+struct aesd_lockfree_buffer
+{
+    /**
+     * Position of the next entry to pop. Written by the consumer only.
+     */
+    alignas(AESD_CACHE_LINE) atomic_size_t head;
+    /**
+     * Position of the next entry to push. Claimed by producers.
+     */
+    alignas(AESD_CACHE_LINE) atomic_size_t tail;
+    alignas(AESD_CACHE_LINE) enum aesd_lockfree_mode mode;
+    struct aesd_lockfree_slot slot[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+};
+
+extern void aesd_lockfree_buffer_init(struct aesd_lockfree_buffer *buffer, enum aesd_lockfree_mode mode);
+
+extern bool aesd_lockfree_buffer_push(struct aesd_lockfree_buffer *buffer,
+            const struct aesd_buffer_entry *add_entry);
+extern bool aesd_lockfree_buffer_pop(struct aesd_lockfree_buffer *buffer, struct aesd_buffer_entry *entry);
+
+extern size_t aesd_lockfree_buffer_count(struct aesd_lockfree_buffer *buffer);
+
+#endif /* AESD_CIRCULAR_BUFFER_LOCKFREE_H */
@@ -0,0 +1,169 @@
+/*
+ * aesd-circular-buffer-pow2.h
+ *
+ * Circular buffer specialized at compile time for a power of two capacity.
+ */
+
+#ifndef AESD_CIRCULAR_BUFFER_POW2_H
+#define AESD_CIRCULAR_BUFFER_POW2_H
+
+#ifdef __KERNEL__
+#include <linux/string.h>
+#else
+#include <string.h>
+#endif
+#include "aesd-circular-buffer.h"
+
+/**
+ * Defines struct name, a circular buffer of @param capacity entries with the semantics of
+ * aesd_circular_buffer, and its functions name_init(), name_add_entry(), name_count(), name_len(),
+ * name_find_entry_offset_for_fpos(), name_entry_at() and name_copy_out().
+ *
+ * The capacity must be a power of two, checked at compile time; aesd_circular_buffer handles any
+ * other. That turns every wraparound into a mask. head and tail are free-running counts of the
+ * entries evicted and added since init, so their difference is the number of entries without a
+ * separate full flag, and unsigned overflow of both keeps it right. Entries are stored as separate
+ * arrays of pointers and sizes, so length and offset scans read only sizes, contiguously, and
+ * name_len() sums at most two runs of the size array, which the compiler vectorizes (GCC at -O3
+ * or with -ftree-vectorize).
+ *
+ * Any necessary locking must be performed by the caller, as for aesd_circular_buffer.
+ * Example:
+ * AESD_CIRCULAR_BUFFER_POW2_DEFINE(ring64, 64)
+ * struct ring64 ring;
+ * ring64_init(&ring);
+ */
+#define AESD_CIRCULAR_BUFFER_POW2_DEFINE(name, capacity)                                            \
+_Static_assert((capacity) > 0 && ((capacity) & ((capacity) - 1)) == 0,                              \
+               #name ": capacity must be a power of two, use aesd_circular_buffer otherwise");     \
+_Static_assert((capacity) <= (1u << 31), #name ": capacity must fit the 32 bit counters");          \
+                                                                                                    \
+struct name                                                                                         \
+{                                                                                                   \
+    const char *buffptr[capacity];                                                                  \
+    size_t size[capacity];                                                                          \
+    size_t compressed_size[capacity];                                                               \
+    /** Entries evicted since init; the oldest entry is at head & (capacity - 1) */                 \
+    uint32_t head;                                                                                  \
+    /** Entries added since init; the next one goes to tail & (capacity - 1) */                    \
+    uint32_t tail;                                                                                  \
+};                                                                                                  \
+                                                                                                    \
+static inline void name##_init(struct name *buffer)                                                 \
+{                                                                                                   \
+    memset(buffer, 0, sizeof(struct name));                                                         \
+}                                                                                                   \
+                                                                                                    \
+static inline size_t name##_count(const struct name *buffer)                                        \
+{                                                                                                   \
+    return (uint32_t)(buffer->tail - buffer->head);                                                 \
+}                                                                                                   \
+                                                                                                    \
+/**                                                                                                 \
+ * Adds @param add_entry, overwriting the oldest entry if the buffer is full.                       \
+ * @return the buffptr of the overwritten entry, or NULL if none was                                \
+ */                                                                                                 \
+static inline const char *name##_add_entry(struct name *buffer,                                     \
+            const struct aesd_buffer_entry *add_entry)                                              \
+{                                                                                                   \
+    uint32_t slot = buffer->tail & ((capacity) - 1);                                                \
+    const char *evicted = NULL;                                                                     \
+    if (name##_count(buffer) == (capacity)) {                                                       \
+        evicted = buffer->buffptr[slot];                                                            \
+        buffer->head++;                                                                             \
+    }                                                                                               \
+    buffer->buffptr[slot] = add_entry->buffptr;                                                     \
+    buffer->size[slot] = add_entry->size;                                                           \
+    buffer->compressed_size[slot] = add_entry->compressed_size;                                     \
+    buffer->tail++;                                                                                 \
+    return evicted;                                                                                 \
+}                                                                                                   \
+                                                                                                    \
+static inline size_t name##_sum_sizes(const struct name *buffer, uint32_t from, uint32_t to)        \
+{                                                                                                   \
+    size_t len = 0;                                                                                 \
+    for (uint32_t i = from; i < to; i++) {                                                          \
+        len += buffer->size[i];                                                                     \
+    }                                                                                               \
+    return len;                                                                                     \
+}                                                                                                   \
+                                                                                                    \
+static inline size_t name##_len(const struct name *buffer)                                          \
+{                                                                                                   \
+    uint32_t first = buffer->head & ((capacity) - 1);                                               \
+    uint32_t end = first + name##_count(buffer);                                                    \
+    if (end - first == (capacity)) {                                                                \
+        /* Full, the usual case: one run with a fixed trip count */                                 \
+        return name##_sum_sizes(buffer, 0, (capacity));                                             \
+    }                                                                                               \
+    if (end <= (capacity)) {                                                                        \
+        return name##_sum_sizes(buffer, first, end);                                                \
+    }                                                                                               \
+    return name##_sum_sizes(buffer, first, (capacity)) +                                            \
+           name##_sum_sizes(buffer, 0, end - (capacity));                                           \
+}                                                                                                   \
+                                                                                                    \
+/**                                                                                                 \
+ * @return the index, counted from the oldest entry, of the entry holding byte @param char_offset   \
+ * of the concatenated contents, setting @param entry_offset_byte_rtn to the byte within it, or     \
+ * -1 if the position is past the end                                                               \
+ */                                                                                                 \
+static inline long name##_find_entry_offset_for_fpos(const struct name *buffer,                     \
+            size_t char_offset, size_t *entry_offset_byte_rtn)                                      \
+{                                                                                                   \
+    for (uint32_t i = buffer->head; i != buffer->tail; i++) {                                       \
+        size_t size = buffer->size[i & ((capacity) - 1)];                                           \
+        if (char_offset < size) {                                                                   \
+            *entry_offset_byte_rtn = char_offset;                                                   \
+            return (uint32_t)(i - buffer->head);                                                    \
+        }                                                                                           \
+        char_offset -= size;                                                                        \
+    }                                                                                               \
+    return -1;                                                                                      \
+}                                                                                                   \
+                                                                                                    \
+/**                                                                                                 \
+ * Copies entry @param entry_index, counted from the oldest, to @param entry.                       \
+ * @return false if there are not that many entries                                                 \
+ */                                                                                                 \
+static inline bool name##_entry_at(const struct name *buffer, size_t entry_index,                   \
+            struct aesd_buffer_entry *entry)                                                        \
+{                                                                                                   \
+    if (entry_index >= name##_count(buffer)) {                                                      \
+        return false;                                                                               \
+    }                                                                                               \
+    uint32_t slot = (buffer->head + (uint32_t)entry_index) & ((capacity) - 1);                      \
+    entry->buffptr = buffer->buffptr[slot];                                                         \
+    entry->size = buffer->size[slot];                                                               \
+    entry->compressed_size = buffer->compressed_size[slot];                                         \
+    return true;                                                                                    \
+}                                                                                                   \
+                                                                                                    \
+/**                                                                                                 \
+ * Copies up to @param count bytes of the contents starting at @param char_offset to @param dest,   \
+ * like aesd_circular_buffer_copy_out(). Entries must not be compressed.                            \
+ * @return the number of bytes copied                                                               \
+ */                                                                                                 \
+static inline size_t name##_copy_out(const struct name *buffer, size_t char_offset,                 \
+            char *dest, size_t count)                                                               \
+{                                                                                                   \
+    size_t copied = 0;                                                                              \
+    for (uint32_t i = buffer->head; i != buffer->tail && copied < count; i++) {                     \
+        uint32_t slot = i & ((capacity) - 1);                                                       \
+        size_t size = buffer->size[slot];                                                           \
+        if (char_offset >= size) {                                                                  \
+            char_offset -= size;                                                                    \
+            continue;                                                                               \
+        }                                                                                           \
+        size_t len = size - char_offset;                                                            \
+        if (len > count - copied) {                                                                 \
+            len = count - copied;                                                                   \
+        }                                                                                           \
+        memcpy(dest + copied, buffer->buffptr[slot] + char_offset, len);                            \
+        copied += len;                                                                              \
+        char_offset = 0;                                                                            \
+    }                                                                                               \
+    return copied;                                                                                  \
+}
+
+#endif /* AESD_CIRCULAR_BUFFER_POW2_H */
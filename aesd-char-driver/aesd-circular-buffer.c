@@ -100,7 +100,6 @@ void aesd_circular_buffer_destroy(struct aesd_circular_buffer *buffer)
     BUFFER_EACH(buffer, entry, {
         kfree(entry->buffptr);
     })
-    kfree(buffer);
 }
 #endif
 
@@ -133,3 +132,95 @@ long long aesd_circular_buffer_find_fpos_for_entry_offset(struct aesd_circular_b
     })
     return fpos;
 }
+
+/**
+ * @return the entry @param entry_index entries after the oldest one in @param buffer, or NULL if the
+ * buffer holds fewer entries. Any necessary locking must be performed by caller.
+ */
+struct aesd_buffer_entry *aesd_circular_buffer_entry_at(struct aesd_circular_buffer *buffer,
+            size_t entry_index)
+{
+    size_t count;
+    if (buffer->full) {
+        count = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    } else {
+        count = (buffer->in_offs + AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - buffer->out_offs) %
+                AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    }
+    if (entry_index >= count) {
+        return NULL;
+    }
+    return &buffer->entry[(buffer->out_offs + entry_index) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+}
+
+/**
+ * Describes the buffer contents starting at @param char_offset as a list of pointers into the entries,
+ * walking the buffer once across the wraparound, e.g. for writev() or copying out one run per entry.
+ * Any necessary locking must be performed by caller, and the entries must not be freed while @param vec
+ * is in use. Entries must not be compressed.
+ * @param vec the array to fill, one element per entry, skipping empty ones
+ * @param vec_count on entry the number of elements in vec, on return the number filled
+ * @param max_bytes the most bytes to describe
+ * @return the number of bytes described by vec, 0 if char_offset is at or past the end of the buffer
+ */
+size_t aesd_circular_buffer_fill_iovec(struct aesd_circular_buffer *buffer, size_t char_offset,
+            struct aesd_iovec *vec, size_t *vec_count, size_t max_bytes)
+{
+    size_t max_vecs = *vec_count;
+    size_t char_len = 0;
+    size_t bytes = 0;
+    *vec_count = 0;
+    if (max_vecs == 0 || max_bytes == 0) {
+        return 0;
+    }
+    BUFFER_EACH(buffer, entry, {
+        if (entry->size > 0 && char_len + entry->size > char_offset) {
+            size_t start = char_offset > char_len ? char_offset - char_len : 0;
+            size_t len = entry->size - start;
+            if (len > max_bytes - bytes) {
+                len = max_bytes - bytes;
+            }
+            vec[*vec_count].iov_base = (void *)(entry->buffptr + start);
+            vec[*vec_count].iov_len = len;
+            (*vec_count)++;
+            bytes += len;
+            if (bytes == max_bytes || *vec_count == max_vecs) {
+                return bytes;
+            }
+        }
+        char_len += entry->size;
+    })
+    return bytes;
+}
+
+/**
+ * Copies up to @param count bytes of the buffer contents starting at @param char_offset to @param dest,
+ * with one memcpy per entry in a single pass. Any necessary locking must be performed by caller.
+ * Entries must not be compressed.
+ * @return the number of bytes copied, less than count only when the end of the buffer is reached
+ */
+size_t aesd_circular_buffer_copy_out(struct aesd_circular_buffer *buffer, size_t char_offset,
+            char *dest, size_t count)
+{
+    size_t char_len = 0;
+    size_t copied = 0;
+    if (count == 0) {
+        return 0;
+    }
+    BUFFER_EACH(buffer, entry, {
+        if (char_len + entry->size > char_offset) {
+            size_t start = char_offset > char_len ? char_offset - char_len : 0;
+            size_t len = entry->size - start;
+            if (len > count - copied) {
+                len = count - copied;
+            }
+            memcpy(dest + copied, entry->buffptr + start, len);
+            copied += len;
+            if (copied == count) {
+                return copied;
+            }
+        }
+        char_len += entry->size;
+    })
+    return copied;
+}
@@ -10,13 +10,26 @@
 
 #ifdef __KERNEL__
 #include <linux/types.h>
+#include <linux/uio.h>
+/**
+ * struct iovec in user space, struct kvec in the kernel: both have iov_base and iov_len
+ */
+#define aesd_iovec kvec
 #else
 #include <stddef.h> // size_t
 #include <stdint.h> // uintx_t
 #include <stdbool.h>
+#include <sys/uio.h>
+#define aesd_iovec iovec
 #endif
 
+/**
+ * Number of entries in the ring. Offsets are uint8_t, so at most 255.
+ * Can be overridden at build time, e.g. to benchmark other capacities.
+ */
+#ifndef AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
 #define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10
+#endif
 
 struct aesd_buffer_entry
 {
@@ -28,6 +41,11 @@ struct aesd_buffer_entry
      * Number of bytes stored in buffptr
      */
     size_t size;
+    /**
+     * 0 if buffptr holds the size bytes as written, otherwise the length of their LZ4 compressed
+     * form held in buffptr instead. size and every fpos stay in uncompressed bytes.
+     */
+    size_t compressed_size;
 };
 
 struct aesd_circular_buffer
@@ -64,6 +82,14 @@ extern void aesd_circular_buffer_destroy(struct aesd_circular_buffer *buffer);
 
 extern size_t aesd_circular_buffer_len(struct aesd_circular_buffer *buffer);
 
+extern struct aesd_buffer_entry *aesd_circular_buffer_entry_at(struct aesd_circular_buffer *buffer,
+            size_t entry_index);
+
+extern size_t aesd_circular_buffer_fill_iovec(struct aesd_circular_buffer *buffer, size_t char_offset,
+            struct aesd_iovec *vec, size_t *vec_count, size_t max_bytes);
+extern size_t aesd_circular_buffer_copy_out(struct aesd_circular_buffer *buffer, size_t char_offset,
+            char *dest, size_t count);
+
 /**
  * Create a for loop to iterate over each member of the circular buffer.
  * Useful when you've allocated memory for circular buffer entries and need to free it
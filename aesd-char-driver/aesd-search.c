@@ -0,0 +1,54 @@
+/**
+ * @file aesd-search.c
+ * @brief Substring search over records, usable from the kernel and user space
+ *
+ */
+
+#ifdef __KERNEL__
+#include <linux/string.h>
+#include <linux/types.h>
+#else
+#include <string.h>
+#endif
+
+#include "aesd-search.h"
+
+/**
+ * Compiles @param pattern of @param len bytes into @param search.
+ * @return 0 on success, -1 if the pattern is empty or longer than AESD_SEARCH_MAX_PATTERN
+ */
+int aesd_search_init(struct aesd_search *search, const char *pattern, size_t len)
+{
+    if (len == 0 || len > AESD_SEARCH_MAX_PATTERN) {
+        return -1;
+    }
+    search->pattern = pattern;
+    search->len = len;
+    memset(search->skip, len, sizeof(search->skip));
+    for (size_t i = 0; i + 1 < len; i++) {
+        search->skip[(uint8_t)pattern[i]] = len - 1 - i;
+    }
+    return 0;
+}
+
+/**
+ * @return true if @param text of @param len bytes contains the pattern of @param search.
+ * Each byte of text is examined at most once per alignment, and most alignments are skipped.
+ */
+bool aesd_search_match(const struct aesd_search *search, const char *text, size_t len)
+{
+    const char *pattern = search->pattern;
+    size_t last = search->len - 1;
+    if (len < search->len) {
+        return false;
+    }
+    if (last == 0) {
+        return memchr(text, pattern[0], len) != NULL;
+    }
+    for (size_t pos = 0; pos + last < len; pos += search->skip[(uint8_t)text[pos + last]]) {
+        if (text[pos + last] == pattern[last] && memcmp(text + pos, pattern, last) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,43 @@
+/*
+ * aesd-search.h
+ *
+ * Substring search over records, shared by the driver's filter ioctl and
+ * the server's user space fallback.
+ */
+
+#ifndef AESD_SEARCH_H
+#define AESD_SEARCH_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stddef.h> // size_t
+#include <stdint.h> // uintx_t
+#include <stdbool.h>
+#endif
+
+/**
+ * Longest pattern supported, so that every shift fits the uint8_t skip table
+ */
+#define AESD_SEARCH_MAX_PATTERN 255
+
+/**
+ * A compiled pattern for Boyer-Moore-Horspool search
+ */
+struct aesd_search
+{
+    /**
+     * The pattern bytes, which must outlive the search
+     */
+    const char *pattern;
+    size_t len;
+    /**
+     * How far to shift when the byte under the last pattern position is the index
+     */
+    uint8_t skip[256];
+};
+
+extern int aesd_search_init(struct aesd_search *search, const char *pattern, size_t len);
+extern bool aesd_search_match(const struct aesd_search *search, const char *text, size_t len);
+
+#endif /* AESD_SEARCH_H */
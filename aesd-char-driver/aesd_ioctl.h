@@ -33,14 +33,86 @@ struct aesd_seekto {
     uint32_t write_cmd_offset;
 };
 
+/**
+ * Record compression statistics for a device, returned by AESDCHAR_IOCGSTATS.
+ * Sizes of records are always counted uncompressed, as read back.
+ */
+struct aesd_stats {
+    /**
+     * Records committed to the buffer since the module was loaded
+     */
+    uint64_t records;
+    /**
+     * Bytes of those records, and bytes allocated to store them
+     */
+    uint64_t raw_bytes;
+    uint64_t stored_bytes;
+    /**
+     * Records stored compressed; the rest did not shrink, or compression is off
+     */
+    uint64_t compressed_records;
+    /**
+     * Bytes of the records currently held in the buffer, and bytes allocated for them
+     */
+    uint64_t resident_raw_bytes;
+    uint64_t resident_stored_bytes;
+    /**
+     * CPU time spent compressing and decompressing, in nanoseconds
+     */
+    uint64_t compress_ns;
+    uint64_t decompress_ns;
+    uint64_t decompressions;
+    /**
+     * Nonzero if records are compressed on commit
+     */
+    uint32_t compress_enabled;
+    uint32_t reserved;
+};
+
+/**
+ * A filtered read, passed to AESDCHAR_IOCFILTER: copies the records in a range of write commands
+ * that contain a substring to a user buffer, end to end as they would be read.
+ */
+struct aesd_filter {
+    /**
+     * User address and length of the substring to look for, at most 255 bytes
+     */
+    uint64_t pattern;
+    uint32_t pattern_len;
+    /**
+     * The zero referenced write commands to search, both inclusive. On return first_cmd is
+     * where to continue if the output buffer filled up.
+     */
+    uint32_t first_cmd;
+    uint32_t last_cmd;
+    /**
+     * Number of matching records copied, set on return
+     */
+    uint32_t matches;
+    /**
+     * Set on return to nonzero once every record in the range has been searched
+     */
+    uint32_t done;
+    uint32_t reserved;
+    /**
+     * User address and size of the output buffer. On return out_len is the number of bytes
+     * copied, or if the next matching record does not fit at all, fails with EMSGSIZE and
+     * sets out_len to its size.
+     */
+    uint64_t out;
+    uint64_t out_len;
+};
+
 // Pick an arbitrary unused value from https://github.com/torvalds/linux/blob/master/Documentation/userspace-api/ioctl/ioctl-number.rst
 #define AESD_IOC_MAGIC 0x16
 
 // Define a write command from the user point of view, use command number 1
 #define AESDCHAR_IOCSEEKTO _IOWR(AESD_IOC_MAGIC, 1, struct aesd_seekto)
+#define AESDCHAR_IOCGSTATS _IOR(AESD_IOC_MAGIC, 2, struct aesd_stats)
+#define AESDCHAR_IOCFILTER _IOWR(AESD_IOC_MAGIC, 3, struct aesd_filter)
 /**
  * The maximum number of commands supported, used for bounds checking
  */
-#define AESDCHAR_IOC_MAXNR 1
+#define AESDCHAR_IOC_MAXNR 3
 
 #endif /* AESD_IOCTL_H */
@@ -0,0 +1,360 @@
+/**
+ * @file aesdchar-bench.c
+ * @brief Throughput and latency benchmark for the aesdchar device.
+ *
+ * Runs a workload against the device from several threads, each with its own
+ * open file, and prints one line of results per run:
+ *
+ *   BENCH workload=read threads=2 record=64 compress=0 ops=40000 errors=0
+ *         seconds=0.181 ops_per_sec=220994 p50_ns=... p90_ns=... p99_ns=...
+ *         p999_ns=... max_ns=...
+ *
+ * (on a single line). Workloads:
+ *   write  write one record of the record size
+ *   read   pread up to the record size from a random position
+ *   seek   lseek to a random position and back to the end
+ *   ioctl  AESDCHAR_IOCSEEKTO to a random record
+ *   mixed  60% read, 20% write, 10% seek, 10% ioctl
+ *
+ * Usage: aesdchar-bench [-d device] [-w workload[,workload...]] [-t threads[,threads...]]
+ *                       [-n ops_per_thread] [-s record_size]
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+#include "aesd_ioctl.h"
+
+#define DEFAULT_DEVICE "/dev/aesdchar"
+#define DEFAULT_WORKLOADS "write,read,seek,ioctl,mixed"
+#define DEFAULT_THREADS "1,2,4"
+#define DEFAULT_OPS 20000
+#define DEFAULT_RECORD_SIZE 64
+#define MAX_RECORD_SIZE (1024 * 1024)
+/** Records written before a run so reads, seeks and ioctls have something to work on */
+#define PREFILL_RECORDS 10
+
+enum workload {
+    WORKLOAD_WRITE,
+    WORKLOAD_READ,
+    WORKLOAD_SEEK,
+    WORKLOAD_IOCTL,
+    WORKLOAD_MIXED,
+};
+
+static const char *const workload_names[] = {
+    [WORKLOAD_WRITE] = "write",
+    [WORKLOAD_READ] = "read",
+    [WORKLOAD_SEEK] = "seek",
+    [WORKLOAD_IOCTL] = "ioctl",
+    [WORKLOAD_MIXED] = "mixed",
+};
+
+struct bench_thread {
+    pthread_t thread;
+    const char *device;
+    enum workload workload;
+    size_t ops;
+    size_t record_size;
+    uint64_t rng;
+    uint64_t *latency_ns;
+    size_t errors;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t next_random(uint64_t *state)
+{
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * @return the latency below which @param permille of the sorted @param latency_ns fall
+ */
+static uint64_t percentile(const uint64_t *latency_ns, size_t count, unsigned permille)
+{
+    size_t index = count * permille / 1000;
+    return latency_ns[index < count ? index : count - 1];
+}
+
+/**
+ * Fills @param record with @param size bytes of printable text ending in a newline
+ */
+static void make_record(char *record, size_t size)
+{
+    for (size_t i = 0; i + 1 < size; i++) {
+        record[i] = 'a' + i % 26;
+    }
+    record[size - 1] = '\n';
+}
+
+/**
+ * Runs one operation of @param workload on @param fd.
+ * @return true on success
+ */
+static bool run_op(struct bench_thread *self, enum workload workload, int fd, char *buf)
+{
+    switch (workload) {
+    case WORKLOAD_WRITE:
+        return write(fd, buf, self->record_size) == (ssize_t)self->record_size;
+    case WORKLOAD_READ: {
+        off_t len = lseek(fd, 0, SEEK_END);
+        if (len <= 0) {
+            return false;
+        }
+        off_t pos = next_random(&self->rng) % len;
+        return pread(fd, buf, self->record_size, pos) > 0;
+    }
+    case WORKLOAD_SEEK: {
+        off_t len = lseek(fd, 0, SEEK_END);
+        if (len <= 0) {
+            return false;
+        }
+        return lseek(fd, next_random(&self->rng) % len, SEEK_SET) != -1;
+    }
+    case WORKLOAD_IOCTL: {
+        struct aesd_seekto seekto = {
+            .write_cmd = next_random(&self->rng) % PREFILL_RECORDS,
+            .write_cmd_offset = 0,
+        };
+        return ioctl(fd, AESDCHAR_IOCSEEKTO, &seekto) == 0;
+    }
+    case WORKLOAD_MIXED: {
+        unsigned choice = next_random(&self->rng) % 10;
+        enum workload op = choice < 6 ? WORKLOAD_READ
+                         : choice < 8 ? WORKLOAD_WRITE
+                         : choice < 9 ? WORKLOAD_SEEK
+                         : WORKLOAD_IOCTL;
+        if (op == WORKLOAD_WRITE) {
+            // Reads leave their data in buf; writes need a well formed record.
+            make_record(buf, self->record_size);
+        }
+        return run_op(self, op, fd, buf);
+    }
+    }
+    return false;
+}
+
+static void *bench_thread_main(void *arg)
+{
+    struct bench_thread *self = arg;
+    char *buf = malloc(self->record_size);
+    int fd = open(self->device, O_RDWR);
+    if (buf == NULL || fd == -1) {
+        perror(buf == NULL ? "malloc" : "open");
+        self->errors = self->ops;
+        free(buf);
+        return NULL;
+    }
+    make_record(buf, self->record_size);
+    for (size_t i = 0; i < self->ops; i++) {
+        uint64_t start = now_ns();
+        if (!run_op(self, self->workload, fd, buf)) {
+            self->errors++;
+        }
+        self->latency_ns[i] = now_ns() - start;
+    }
+    close(fd);
+    free(buf);
+    return NULL;
+}
+
+/**
+ * Writes PREFILL_RECORDS records of @param record_size so every workload finds data.
+ * @return the compress_enabled flag reported by the device, 0 if it does not report stats
+ */
+static int prefill(const char *device, size_t record_size)
+{
+    int fd = open(device, O_RDWR);
+    if (fd == -1) {
+        perror("open");
+        return -1;
+    }
+    char *record = malloc(record_size);
+    if (record == NULL) {
+        close(fd);
+        return -1;
+    }
+    make_record(record, record_size);
+    for (int i = 0; i < PREFILL_RECORDS; i++) {
+        if (write(fd, record, record_size) != (ssize_t)record_size) {
+            perror("write");
+            break;
+        }
+    }
+    free(record);
+    struct aesd_stats stats;
+    int compress = ioctl(fd, AESDCHAR_IOCGSTATS, &stats) == 0 ? (int)stats.compress_enabled : 0;
+    close(fd);
+    return compress;
+}
+
+/**
+ * Runs @param workload from @param nthreads threads and prints a BENCH line.
+ * @return 0 on success, -1 if the run could not be set up
+ */
+static int run_bench(const char *device, enum workload workload, unsigned nthreads, size_t ops,
+                     size_t record_size)
+{
+    int compress = prefill(device, record_size);
+    if (compress == -1) {
+        return -1;
+    }
+    struct bench_thread *threads = calloc(nthreads, sizeof(struct bench_thread));
+    uint64_t *latency_ns = malloc(nthreads * ops * sizeof(uint64_t));
+    if (threads == NULL || latency_ns == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        free(threads);
+        free(latency_ns);
+        return -1;
+    }
+
+    uint64_t start = now_ns();
+    unsigned started = 0;
+    for (; started < nthreads; started++) {
+        struct bench_thread *thread = &threads[started];
+        thread->device = device;
+        thread->workload = workload;
+        thread->ops = ops;
+        thread->record_size = record_size;
+        thread->rng = 0x9e3779b97f4a7c15ULL * (started + 1);
+        thread->latency_ns = latency_ns + started * ops;
+        if (pthread_create(&thread->thread, NULL, bench_thread_main, thread) != 0) {
+            fprintf(stderr, "pthread_create failed\n");
+            break;
+        }
+    }
+    size_t errors = 0;
+    for (unsigned i = 0; i < started; i++) {
+        pthread_join(threads[i].thread, NULL);
+        errors += threads[i].errors;
+    }
+    uint64_t elapsed_ns = now_ns() - start;
+
+    size_t total = started * ops;
+    int status = started == nthreads && total > 0 ? 0 : -1;
+    if (status == 0) {
+        qsort(latency_ns, total, sizeof(uint64_t), compare_u64);
+        printf("BENCH workload=%s threads=%u record=%zu compress=%d ops=%zu errors=%zu seconds=%.3f "
+               "ops_per_sec=%.0f p50_ns=%llu p90_ns=%llu p99_ns=%llu p999_ns=%llu max_ns=%llu\n",
+               workload_names[workload], nthreads, record_size, compress, total, errors,
+               elapsed_ns / 1e9, total * 1e9 / elapsed_ns,
+               (unsigned long long)percentile(latency_ns, total, 500),
+               (unsigned long long)percentile(latency_ns, total, 900),
+               (unsigned long long)percentile(latency_ns, total, 990),
+               (unsigned long long)percentile(latency_ns, total, 999),
+               (unsigned long long)latency_ns[total - 1]);
+        fflush(stdout);
+    }
+    free(threads);
+    free(latency_ns);
+    return status;
+}
+
+/**
+ * @return the workload named @param name, or -1 if there is none
+ */
+static int parse_workload(const char *name)
+{
+    for (size_t i = 0; i < sizeof(workload_names) / sizeof(workload_names[0]); i++) {
+        if (strcmp(name, workload_names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *device = DEFAULT_DEVICE;
+    const char *workloads = DEFAULT_WORKLOADS;
+    const char *thread_counts = DEFAULT_THREADS;
+    size_t ops = DEFAULT_OPS;
+    size_t record_size = DEFAULT_RECORD_SIZE;
+    int opt;
+    while ((opt = getopt(argc, argv, "d:w:t:n:s:")) != -1) {
+        switch (opt) {
+        case 'd':
+            device = optarg;
+            break;
+        case 'w':
+            workloads = optarg;
+            break;
+        case 't':
+            thread_counts = optarg;
+            break;
+        case 'n':
+            ops = strtoull(optarg, NULL, 10);
+            break;
+        case 's':
+            record_size = strtoull(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-d device] [-w workload[,workload...]] "
+                    "[-t threads[,threads...]] [-n ops_per_thread] [-s record_size]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (ops == 0 || record_size == 0 || record_size > MAX_RECORD_SIZE) {
+        fprintf(stderr, "ops must be positive and record_size between 1 and %d\n", MAX_RECORD_SIZE);
+        return 1;
+    }
+
+    char *workload_list = strdup(workloads);
+    if (workload_list == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    int status = 0;
+    char *workload_save;
+    for (char *name = strtok_r(workload_list, ",", &workload_save); name != NULL;
+         name = strtok_r(NULL, ",", &workload_save)) {
+        int workload = parse_workload(name);
+        if (workload == -1) {
+            fprintf(stderr, "unknown workload %s\n", name);
+            status = 1;
+            continue;
+        }
+        char *count_list = strdup(thread_counts);
+        if (count_list == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            status = 1;
+            break;
+        }
+        char *count_save;
+        for (char *count = strtok_r(count_list, ",", &count_save); count != NULL;
+             count = strtok_r(NULL, ",", &count_save)) {
+            unsigned nthreads = strtoul(count, NULL, 10);
+            if (nthreads == 0 || run_bench(device, workload, nthreads, ops, record_size) != 0) {
+                fprintf(stderr, "%s with %s threads failed\n", name, count);
+                status = 1;
+            }
+        }
+        free(count_list);
+    }
+    free(workload_list);
+    return status;
+}
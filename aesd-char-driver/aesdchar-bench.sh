@@ -0,0 +1,38 @@
+#!/bin/sh
+# Runs aesdchar-bench inside the QEMU guest. Used as the init process by
+# finder-app/run-qemu-bench.sh, which collects the BENCH lines from the serial
+# log, but also works from a shell in a running guest.
+# Settings come from the environment, which the kernel fills from unknown
+# command line parameters:
+#   BENCH_WORKLOADS  comma separated workloads, default all
+#   BENCH_THREADS    comma separated thread counts, default 1,2,4
+#   BENCH_OPS        operations per thread, default 20000
+#   BENCH_RECORD     record size in bytes, default 64
+#   BENCH_COMPRESS   1 to load the driver with compress=1
+cd `dirname $0`
+
+if [ $$ -eq 1 ]; then
+    mount -t proc proc /proc
+    mount -t sysfs sysfs /sys
+fi
+# aesdchar_load hands the device node to the staff group
+grep -q '^staff:' /etc/group 2>/dev/null || echo "staff:x:50:" >> /etc/group
+
+loaded=0
+if [ ! -e /dev/aesdchar ]; then
+    ./aesdchar_load compress=${BENCH_COMPRESS:-0} && loaded=1
+fi
+
+echo "BENCH-BEGIN kernel=$(uname -r) cpus=$(grep -c ^processor /proc/cpuinfo)"
+./aesdchar-bench -w ${BENCH_WORKLOADS:-write,read,seek,ioctl,mixed} \
+    -t ${BENCH_THREADS:-1,2,4} -n ${BENCH_OPS:-20000} -s ${BENCH_RECORD:-64}
+rc=$?
+echo "BENCH-END rc=${rc}"
+
+if [ ${loaded} -eq 1 ]; then
+    ./aesdchar_unload
+fi
+if [ $$ -eq 1 ]; then
+    poweroff -f
+fi
+exit ${rc}
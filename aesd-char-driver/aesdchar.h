@@ -9,6 +9,7 @@
 #define AESD_CHAR_DRIVER_AESDCHAR_H_
 
 #include "aesd-circular-buffer.h"
+#include "aesd_ioctl.h"
 
 #define AESD_DEBUG 1  //Remove comment on this line to enable debug
 
@@ -29,9 +30,18 @@ struct aesd_dev
 {
     struct cdev cdev;     /* Char device structure      */
     size_t pending_bytes;
+    size_t pending_capacity;
     char* pending_write;
     struct aesd_circular_buffer buffer;
     struct mutex buffer_lock;
+    /* Record compression, see the compress module parameter */
+    bool compress;
+    void *lz4_wrkmem;
+    /* Last compressed entry read, decompressed, so short reads do not repeat the work */
+    char *scratch;
+    size_t scratch_size;
+    const char *scratch_src;
+    struct aesd_stats stats;
 };
 
 
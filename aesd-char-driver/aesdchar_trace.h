@@ -0,0 +1,123 @@
+/**
+ * @file aesdchar_trace.h
+ * @brief Tracepoints for the aesdchar driver
+ *
+ * Enabled through tracefs (events/aesdchar/) or with perf and bpftrace, e.g.
+ * perf trace -e 'aesdchar:*'. A disabled tracepoint costs a patched-out branch.
+ * Lock wait times are only measured while the event reporting them is enabled
+ * and read as 0 otherwise.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM aesdchar
+
+#if !defined(_AESDCHAR_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _AESDCHAR_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(aesdchar_read,
+    TP_PROTO(size_t count, loff_t pos, ssize_t ret, u64 lock_wait_ns),
+    TP_ARGS(count, pos, ret, lock_wait_ns),
+    TP_STRUCT__entry(
+        __field(size_t, count)
+        __field(loff_t, pos)
+        __field(ssize_t, ret)
+        __field(u64, lock_wait_ns)
+    ),
+    TP_fast_assign(
+        __entry->count = count;
+        __entry->pos = pos;
+        __entry->ret = ret;
+        __entry->lock_wait_ns = lock_wait_ns;
+    ),
+    TP_printk("count=%zu pos=%lld ret=%zd lock_wait_ns=%llu",
+              __entry->count, __entry->pos, __entry->ret, __entry->lock_wait_ns)
+);
+
+/**
+ * pending is the length of the record still being assembled after the write, 0 once a
+ * newline committed it to the buffer.
+ */
+TRACE_EVENT(aesdchar_write,
+    TP_PROTO(size_t count, size_t pending, ssize_t ret, u64 lock_wait_ns),
+    TP_ARGS(count, pending, ret, lock_wait_ns),
+    TP_STRUCT__entry(
+        __field(size_t, count)
+        __field(size_t, pending)
+        __field(ssize_t, ret)
+        __field(u64, lock_wait_ns)
+    ),
+    TP_fast_assign(
+        __entry->count = count;
+        __entry->pending = pending;
+        __entry->ret = ret;
+        __entry->lock_wait_ns = lock_wait_ns;
+    ),
+    TP_printk("count=%zu pending=%zu ret=%zd lock_wait_ns=%llu",
+              __entry->count, __entry->pending, __entry->ret, __entry->lock_wait_ns)
+);
+
+TRACE_EVENT(aesdchar_llseek,
+    TP_PROTO(loff_t offset, int whence, loff_t size, loff_t ret, u64 lock_wait_ns),
+    TP_ARGS(offset, whence, size, ret, lock_wait_ns),
+    TP_STRUCT__entry(
+        __field(loff_t, offset)
+        __field(int, whence)
+        __field(loff_t, size)
+        __field(loff_t, ret)
+        __field(u64, lock_wait_ns)
+    ),
+    TP_fast_assign(
+        __entry->offset = offset;
+        __entry->whence = whence;
+        __entry->size = size;
+        __entry->ret = ret;
+        __entry->lock_wait_ns = lock_wait_ns;
+    ),
+    TP_printk("offset=%lld whence=%d size=%lld ret=%lld lock_wait_ns=%llu",
+              __entry->offset, __entry->whence, __entry->size, __entry->ret, __entry->lock_wait_ns)
+);
+
+TRACE_EVENT(aesdchar_ioctl,
+    TP_PROTO(unsigned int cmd, long ret, u64 lock_wait_ns),
+    TP_ARGS(cmd, ret, lock_wait_ns),
+    TP_STRUCT__entry(
+        __field(unsigned int, nr)
+        __field(long, ret)
+        __field(u64, lock_wait_ns)
+    ),
+    TP_fast_assign(
+        __entry->nr = _IOC_NR(cmd);
+        __entry->ret = ret;
+        __entry->lock_wait_ns = lock_wait_ns;
+    ),
+    TP_printk("nr=%u ret=%ld lock_wait_ns=%llu",
+              __entry->nr, __entry->ret, __entry->lock_wait_ns)
+);
+
+/**
+ * A record dropped from the buffer to make room for a new one. stored is its size in
+ * memory, smaller than size when it was compressed.
+ */
+TRACE_EVENT(aesdchar_evict,
+    TP_PROTO(size_t size, size_t stored),
+    TP_ARGS(size, stored),
+    TP_STRUCT__entry(
+        __field(size_t, size)
+        __field(size_t, stored)
+    ),
+    TP_fast_assign(
+        __entry->size = size;
+        __entry->stored = stored;
+    ),
+    TP_printk("size=%zu stored=%zu", __entry->size, __entry->stored)
+);
+
+#endif /* _AESDCHAR_TRACE_H */
+
+/* This part must be outside the include guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE aesdchar_trace
+#include <trace/define_trace.h>
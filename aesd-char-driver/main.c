@@ -17,15 +17,39 @@
 #include <linux/types.h>
 #include <linux/cdev.h>
 #include <linux/fs.h> // file_operations
+#include <linux/moduleparam.h>
+#include <linux/slab.h>
+#include <linux/mm.h> // kvmalloc
+#include <linux/timekeeping.h>
+#include <linux/err.h>
+#include <linux/lz4.h>
 #include "aesd-circular-buffer.h"
+#include "aesd-search.h"
 #include "aesdchar.h"
 #include "aesd_ioctl.h"
+#define CREATE_TRACE_POINTS
+#include "aesdchar_trace.h"
 int aesd_major =   0; // use dynamic major
 int aesd_minor =   0;
 
+/**
+ * Entries copied out per read call; a read returns at most this many writes.
+ */
+#define AESD_READ_MAX_VECS 16
+
+/**
+ * LZ4 compression of records needs the kernel's LZ4 library built in. When it is built as modules,
+ * referencing it would make aesdchar fail to insmod over unresolved symbols, even with compress=0.
+ */
+#define AESD_COMPRESS_SUPPORTED (IS_BUILTIN(CONFIG_LZ4_COMPRESS) && IS_BUILTIN(CONFIG_LZ4_DECOMPRESS))
+
 MODULE_AUTHOR("Andy Carlson");
 MODULE_LICENSE("Dual BSD/GPL");
 
+static bool compress = false;
+module_param(compress, bool, 0444);
+MODULE_PARM_DESC(compress, "Store records LZ4 compressed, trading CPU time on write and read for memory");
+
 struct aesd_dev aesd_device;
 
 int aesd_open(struct inode *inode, struct file *filp)
@@ -42,6 +66,86 @@ int aesd_release(struct inode *inode, struct file *filp)
     return 0;
 }
 
+/**
+ * Takes the buffer lock of @param dev. When @param timed, the tracepoint reporting it is
+ * enabled and @param wait_ns is set to the time spent waiting; otherwise the clock is not read.
+ */
+static int aesd_lock(struct aesd_dev *dev, bool timed, u64 *wait_ns)
+{
+    u64 start = timed ? ktime_get_ns() : 0;
+    int status = mutex_lock_interruptible(&dev->buffer_lock);
+    *wait_ns = timed ? ktime_get_ns() - start : 0;
+    return status;
+}
+
+/**
+ * @return the uncompressed contents of @param entry, decompressing it into the device scratch buffer
+ * if needed, or an ERR_PTR. Called with buffer_lock held.
+ */
+static const char *aesd_entry_data(struct aesd_dev *dev, struct aesd_buffer_entry *entry)
+{
+    if (entry->compressed_size == 0) {
+        return entry->buffptr;
+    }
+#if AESD_COMPRESS_SUPPORTED
+    if (dev->scratch_src == entry->buffptr) {
+        return dev->scratch;
+    }
+    dev->scratch_src = NULL;
+    if (dev->scratch_size < entry->size) {
+        kvfree(dev->scratch);
+        dev->scratch_size = 0;
+        dev->scratch = kvmalloc(entry->size, GFP_KERNEL);
+        if (dev->scratch == NULL) {
+            return ERR_PTR(-ENOMEM);
+        }
+        dev->scratch_size = entry->size;
+    }
+    u64 start = ktime_get_ns();
+    int len = LZ4_decompress_safe(entry->buffptr, dev->scratch, entry->compressed_size, entry->size);
+    dev->stats.decompress_ns += ktime_get_ns() - start;
+    dev->stats.decompressions++;
+    if (len != entry->size) {
+        printk(KERN_ERR "aesdchar: corrupt compressed record, %d of %zu bytes", len, entry->size);
+        return ERR_PTR(-EIO);
+    }
+    dev->scratch_src = entry->buffptr;
+    return dev->scratch;
+#else
+    return ERR_PTR(-EIO);
+#endif
+}
+
+/**
+ * Read path for compressed devices, which decompresses each entry before copying it out. Walks the
+ * entries once, skipping those before @param f_pos without decompressing them.
+ * Called with buffer_lock held.
+ */
+static ssize_t aesd_read_entries(struct aesd_dev *dev, char __user *buf, size_t count, loff_t f_pos)
+{
+    ssize_t retval = 0;
+    size_t skip = f_pos;
+    struct aesd_buffer_entry *entry;
+    for (size_t index = 0; (size_t)retval < count &&
+                (entry = aesd_circular_buffer_entry_at(&dev->buffer, index)) != NULL; index++) {
+        if (skip >= entry->size) {
+            skip -= entry->size;
+            continue;
+        }
+        const char *data = aesd_entry_data(dev, entry);
+        if (IS_ERR(data)) {
+            return retval > 0 ? retval : PTR_ERR(data);
+        }
+        size_t len = min_t(size_t, entry->size - skip, count - retval);
+        if (copy_to_user(buf + retval, data + skip, len) != 0) {
+            return retval > 0 ? retval : -EFAULT;
+        }
+        retval += len;
+        skip = 0;
+    }
+    return retval;
+}
+
 ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
                 loff_t *f_pos)
 {
@@ -49,29 +153,73 @@ ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
     PDEBUG("read %zu bytes with offset %lld",count,*f_pos);
 
     struct aesd_dev *aesd_device = (struct aesd_dev *)filp->private_data;
-    int status = mutex_lock_interruptible(&aesd_device->buffer_lock);
+    u64 wait_ns;
+    int status = aesd_lock(aesd_device, trace_aesdchar_read_enabled(), &wait_ns);
     if (status != 0) {
         return status;
     }
-    size_t entry_offset;
-    struct aesd_buffer_entry *entry = aesd_circular_buffer_find_entry_offset_for_fpos(&aesd_device->buffer, *f_pos, &entry_offset);
-    if (entry == NULL) {
-        retval = 0;
-        goto cleanup1;
+    loff_t pos = *f_pos;
+    if (aesd_device->compress) {
+        retval = aesd_read_entries(aesd_device, buf, count, *f_pos);
+    } else {
+        // Fill as much of the request as the buffer holds in one pass, rather
+        // than returning a single entry per read.
+        struct aesd_iovec vec[AESD_READ_MAX_VECS];
+        size_t vec_count = AESD_READ_MAX_VECS;
+        aesd_circular_buffer_fill_iovec(&aesd_device->buffer, *f_pos, vec, &vec_count, count);
+        for (size_t i = 0; i < vec_count; i++) {
+            if (copy_to_user(buf + retval, vec[i].iov_base, vec[i].iov_len) != 0) {
+                if (retval == 0) {
+                    retval = -EFAULT;
+                }
+                break;
+            }
+            retval += vec[i].iov_len;
+        }
     }
-    ulong bytes_not_written = copy_to_user(buf, entry->buffptr + entry_offset, entry->size - entry_offset);
-    if (bytes_not_written != 0) {
-        retval = -EFAULT;
-        goto cleanup1;
+    if (retval > 0) {
+        *f_pos += retval;
     }
-    retval = entry->size - entry_offset;
-    *f_pos += retval;
 
-cleanup1:
     mutex_unlock(&aesd_device->buffer_lock);
+    trace_aesdchar_read(count, pos, retval, wait_ns);
     return retval;
 }
 
+/**
+ * Replaces the contents of @param entry with their LZ4 compressed form when that is smaller,
+ * freeing the original. Leaves it as is if compression does not pay off or fails.
+ */
+static void aesd_compress_entry(struct aesd_dev *dev, struct aesd_buffer_entry *entry)
+{
+#if AESD_COMPRESS_SUPPORTED
+    if (entry->size > LZ4_MAX_INPUT_SIZE) {
+        return;
+    }
+    u64 start = ktime_get_ns();
+    int bound = LZ4_compressBound(entry->size);
+    char *compressed = kmalloc(bound, GFP_KERNEL);
+    if (compressed == NULL) {
+        return;
+    }
+    int len = LZ4_compress_default(entry->buffptr, compressed, entry->size, bound, dev->lz4_wrkmem);
+    if (len <= 0 || len >= entry->size) {
+        kfree(compressed);
+        dev->stats.compress_ns += ktime_get_ns() - start;
+        return;
+    }
+    char *shrunk = krealloc(compressed, len, GFP_KERNEL);
+    if (shrunk != NULL) {
+        compressed = shrunk;
+    }
+    kfree(entry->buffptr);
+    entry->buffptr = compressed;
+    entry->compressed_size = len;
+    dev->stats.compress_ns += ktime_get_ns() - start;
+    dev->stats.compressed_records++;
+#endif
+}
+
 ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
                 loff_t *f_pos)
 {
@@ -79,14 +227,23 @@ ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
     PDEBUG("write %zu bytes with offset %lld",count,*f_pos);
     struct aesd_dev *aesd_device = (struct aesd_dev *)filp->private_data;
 
-    int status = mutex_lock_interruptible(&aesd_device->buffer_lock);
+    u64 wait_ns = 0;
+    int status = aesd_lock(aesd_device, trace_aesdchar_write_enabled(), &wait_ns);
     if (status != 0) {
         retval = status;
         goto cleanup0;
     }
-    aesd_device->pending_write = (char*)krealloc(aesd_device->pending_write, aesd_device->pending_bytes + count, GFP_KERNEL);
-    if (aesd_device->pending_write == NULL) {
-        return retval;
+    // A record written in many pieces grows its buffer geometrically, so assembling it costs
+    // amortized O(1) copies per byte. One extra byte holds the terminating NUL.
+    size_t needed = aesd_device->pending_bytes + count + 1;
+    if (needed > aesd_device->pending_capacity) {
+        size_t capacity = max(needed, 2 * aesd_device->pending_capacity);
+        char *grown = krealloc(aesd_device->pending_write, capacity, GFP_KERNEL);
+        if (grown == NULL) {
+            goto cleanup1;
+        }
+        aesd_device->pending_write = grown;
+        aesd_device->pending_capacity = capacity;
     }
     ulong bytes_not_written = copy_from_user(aesd_device->pending_write + aesd_device->pending_bytes, buf, count);
     if (bytes_not_written != 0) {
@@ -97,36 +254,117 @@ ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
     aesd_device->pending_bytes += count;
     aesd_device->pending_write[aesd_device->pending_bytes] = 0;
 
-    if (aesd_device->pending_write[aesd_device->pending_bytes - 1] == '\n') {
+    if (aesd_device->pending_bytes > 0 && aesd_device->pending_write[aesd_device->pending_bytes - 1] == '\n') {
         struct aesd_buffer_entry entry;
         entry.buffptr = aesd_device->pending_write;
         entry.size = aesd_device->pending_bytes;
+        entry.compressed_size = 0;
+        if (aesd_device->compress) {
+            aesd_compress_entry(aesd_device, &entry);
+        }
+        aesd_device->stats.records++;
+        aesd_device->stats.raw_bytes += entry.size;
+        aesd_device->stats.stored_bytes += entry.compressed_size ? entry.compressed_size : entry.size;
+        if (aesd_device->buffer.full && trace_aesdchar_evict_enabled()) {
+            struct aesd_buffer_entry *oldest = aesd_circular_buffer_entry_at(&aesd_device->buffer, 0);
+            trace_aesdchar_evict(oldest->size, oldest->compressed_size ? oldest->compressed_size : oldest->size);
+        }
         const char *evicted = aesd_circular_buffer_add_entry(&aesd_device->buffer, &entry);
         if (evicted != NULL) {
+            if (evicted == aesd_device->scratch_src) {
+                aesd_device->scratch_src = NULL;
+            }
             kfree(evicted);
         }
         aesd_device->pending_bytes = 0;
         aesd_device->pending_write = NULL;
+        aesd_device->pending_capacity = 0;
     }
     retval = count;
 
 cleanup1:
     mutex_unlock(&aesd_device->buffer_lock);
 cleanup0:
+    trace_aesdchar_write(count, aesd_device->pending_bytes, retval, wait_ns);
     return retval;
 }
 
 static loff_t aesd_llseek(struct file *filp, loff_t f_pos, int whence) {
-    int status = mutex_lock_interruptible(&aesd_device.buffer_lock);
+    u64 wait_ns;
+    int status = aesd_lock(&aesd_device, trace_aesdchar_llseek_enabled(), &wait_ns);
     if (status != 0) {
         return status;
     }
     loff_t size = aesd_circular_buffer_len(&aesd_device.buffer);
     mutex_unlock(&aesd_device.buffer_lock);
-    return fixed_size_llseek(filp, f_pos, whence, size);
+    loff_t retval = fixed_size_llseek(filp, f_pos, whence, size);
+    trace_aesdchar_llseek(f_pos, whence, size, retval, wait_ns);
+    return retval;
 }
 
-static long aesd_ioctl(struct file *filp, uint cmd, ulong arg) {
+/**
+ * Copies the records of @param filter that match its pattern to its output buffer. Each record
+ * is scanned once and only matches are copied.
+ */
+static long aesd_filter(struct aesd_dev *dev, struct aesd_filter *filter, u64 *wait_ns)
+{
+    char pattern[AESD_SEARCH_MAX_PATTERN];
+    struct aesd_search search;
+    if (filter->pattern_len == 0 || filter->pattern_len > AESD_SEARCH_MAX_PATTERN) {
+        return -EINVAL;
+    }
+    if (copy_from_user(pattern, u64_to_user_ptr(filter->pattern), filter->pattern_len)) {
+        return -EFAULT;
+    }
+    aesd_search_init(&search, pattern, filter->pattern_len);
+
+    char __user *out = u64_to_user_ptr(filter->out);
+    size_t used = 0;
+    long retval = 0;
+    filter->matches = 0;
+    filter->done = 0;
+    if (aesd_lock(dev, trace_aesdchar_ioctl_enabled(), wait_ns) != 0) {
+        return -ERESTARTSYS;
+    }
+    struct aesd_buffer_entry *entry = NULL;
+    for (; filter->first_cmd <= filter->last_cmd; filter->first_cmd++) {
+        entry = aesd_circular_buffer_entry_at(&dev->buffer, filter->first_cmd);
+        if (entry == NULL) {
+            break;
+        }
+        const char *data = aesd_entry_data(dev, entry);
+        if (IS_ERR(data)) {
+            retval = PTR_ERR(data);
+            break;
+        }
+        if (!aesd_search_match(&search, data, entry->size)) {
+            continue;
+        }
+        if (entry->size > filter->out_len - used) {
+            if (used == 0) {
+                used = entry->size;
+                retval = -EMSGSIZE;
+            }
+            break;
+        }
+        if (copy_to_user(out + used, data, entry->size)) {
+            retval = -EFAULT;
+            break;
+        }
+        used += entry->size;
+        filter->matches++;
+    }
+    filter->done = entry == NULL || filter->first_cmd > filter->last_cmd;
+    mutex_unlock(&dev->buffer_lock);
+    filter->out_len = used;
+    return retval;
+}
+
+/**
+ * Carries out ioctl @param cmd, setting @param wait_ns to the time spent waiting for the
+ * buffer lock while the aesdchar_ioctl tracepoint is enabled.
+ */
+static long aesd_ioctl_cmd(struct file *filp, uint cmd, ulong arg, u64 *wait_ns) {
     PDEBUG("aesd_ioctl");
     if (_IOC_TYPE(cmd) != AESD_IOC_MAGIC) return -ENOTTY;
 	if (_IOC_NR(cmd) > AESDCHAR_IOC_MAXNR) return -ENOTTY;
@@ -138,18 +376,60 @@ static long aesd_ioctl(struct file *filp, uint cmd, ulong arg) {
             return -EFAULT;
         }
         PDEBUG("seekto: %i, %i\n", seekto.write_cmd, seekto.write_cmd_offset);
-        mutex_lock_interruptible(&aesd_device.buffer_lock);
+        if (aesd_lock(&aesd_device, trace_aesdchar_ioctl_enabled(), wait_ns) != 0) {
+            return -ERESTARTSYS;
+        }
         long long f_pos = aesd_circular_buffer_find_fpos_for_entry_offset(&aesd_device.buffer, seekto.write_cmd, seekto.write_cmd_offset);
         PDEBUG("f_pos: %i", f_pos);
         filp->f_pos = f_pos;
         mutex_unlock(&aesd_device.buffer_lock);
         break;
+    case AESDCHAR_IOCGSTATS:
+        struct aesd_stats stats;
+        if (aesd_lock(&aesd_device, trace_aesdchar_ioctl_enabled(), wait_ns) != 0) {
+            return -ERESTARTSYS;
+        }
+        stats = aesd_device.stats;
+        stats.compress_enabled = aesd_device.compress;
+        uint8_t index;
+        struct aesd_buffer_entry *entry;
+        AESD_CIRCULAR_BUFFER_FOREACH(entry, &aesd_device.buffer, index) {
+            if (entry->buffptr != NULL) {
+                stats.resident_raw_bytes += entry->size;
+                stats.resident_stored_bytes += entry->compressed_size ? entry->compressed_size : entry->size;
+            }
+        }
+        mutex_unlock(&aesd_device.buffer_lock);
+        if (copy_to_user((struct aesd_stats __user *)arg, &stats, sizeof(struct aesd_stats))) {
+            return -EFAULT;
+        }
+        break;
+    case AESDCHAR_IOCFILTER:
+        struct aesd_filter filter;
+        if (copy_from_user(&filter, (struct aesd_filter __user *)arg, sizeof(struct aesd_filter))) {
+            return -EFAULT;
+        }
+        long result = aesd_filter(&aesd_device, &filter, wait_ns);
+        if (result != 0 && result != -EMSGSIZE) {
+            return result;
+        }
+        if (copy_to_user((struct aesd_filter __user *)arg, &filter, sizeof(struct aesd_filter))) {
+            return -EFAULT;
+        }
+        return result;
     default:
 		return -ENOTTY;
     }
     return 0;
 }
 
+static long aesd_ioctl(struct file *filp, uint cmd, ulong arg) {
+    u64 wait_ns = 0;
+    long retval = aesd_ioctl_cmd(filp, cmd, arg, &wait_ns);
+    trace_aesdchar_ioctl(cmd, retval, wait_ns);
+    return retval;
+}
+
 struct file_operations aesd_fops = {
     .owner =    THIS_MODULE,
     .read =     aesd_read,
@@ -193,9 +473,23 @@ int aesd_init_module(void)
     aesd_circular_buffer_init(&aesd_device.buffer);
     mutex_init(&aesd_device.buffer_lock);
 
+    if (compress) {
+#if AESD_COMPRESS_SUPPORTED
+        aesd_device.lz4_wrkmem = kvmalloc(LZ4_MEM_COMPRESS, GFP_KERNEL);
+        if (aesd_device.lz4_wrkmem == NULL) {
+            unregister_chrdev_region(dev, 1);
+            return -ENOMEM;
+        }
+        aesd_device.compress = true;
+#else
+        printk(KERN_WARNING "aesdchar: LZ4 is not built into the kernel, storing records uncompressed\n");
+#endif
+    }
+
     result = aesd_setup_cdev(&aesd_device);
 
     if( result ) {
+        kvfree(aesd_device.lz4_wrkmem);
         unregister_chrdev_region(dev, 1);
     }
     return result;
@@ -210,6 +504,9 @@ void aesd_cleanup_module(void)
 
     mutex_destroy(&aesd_device.buffer_lock);
     aesd_circular_buffer_destroy(&aesd_device.buffer);
+    kvfree(aesd_device.lz4_wrkmem);
+    kvfree(aesd_device.scratch);
+    kfree(aesd_device.pending_write);
 
     unregister_chrdev_region(devno, 1);
 }
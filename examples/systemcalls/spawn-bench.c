@@ -0,0 +1,111 @@
+/**
+ * @file spawn-bench.c
+ * @brief Compares the launch latency of do_exec (fork + execv) against
+ * do_spawn (posix_spawn) for parents with a growing resident set.
+ *
+ * Usage: spawn-bench [-n iterations] [-m rss_mb[,rss_mb...]] [command]
+ */
+#include "systemcalls.h"
+#include <string.h>
+#include <time.h>
+
+#define DEFAULT_ITERATIONS 200
+#define DEFAULT_COMMAND "/bin/true"
+#define MAX_SIZES 16
+
+static double elapsed_us(const struct timespec *start, const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1e6 + (end->tv_nsec - start->tv_nsec) / 1e3;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Launches @param command @param iterations times with @param launch and prints the
+ * mean, median and 99th percentile latency of a launch in microseconds.
+ */
+static bool run(const char *name, bool (*launch)(int count, ...), char *command,
+                int iterations, size_t rss_mb)
+{
+    double *samples = malloc(iterations * sizeof(double));
+    if (samples == NULL) {
+        perror("malloc");
+        return false;
+    }
+    double total = 0;
+    for (int i = 0; i < iterations; i++) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        bool ok = launch(1, command);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if (!ok) {
+            fprintf(stderr, "%s: %s failed\n", name, command);
+            free(samples);
+            return false;
+        }
+        samples[i] = elapsed_us(&start, &end);
+        total += samples[i];
+    }
+    qsort(samples, iterations, sizeof(double), compare_double);
+    printf("%-10s %8zu %10.1f %10.1f %10.1f\n", name, rss_mb, total / iterations,
+           samples[iterations / 2], samples[(iterations * 99) / 100]);
+    free(samples);
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    int iterations = DEFAULT_ITERATIONS;
+    size_t sizes[MAX_SIZES] = {0, 256, 1024};
+    int nsizes = 3;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:m:")) != -1) {
+        switch (opt) {
+        case 'n':
+            iterations = atoi(optarg);
+            break;
+        case 'm':
+            nsizes = 0;
+            for (char *tok = strtok(optarg, ","); tok != NULL && nsizes < MAX_SIZES;
+                 tok = strtok(NULL, ",")) {
+                sizes[nsizes++] = strtoul(tok, NULL, 10);
+            }
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n iterations] [-m rss_mb[,rss_mb...]] [command]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    if (iterations <= 0) {
+        fprintf(stderr, "invalid iteration count\n");
+        return 1;
+    }
+    char *command = optind < argc ? argv[optind] : DEFAULT_COMMAND;
+
+    printf("%-10s %8s %10s %10s %10s\n", "launcher", "rss_mb", "mean_us", "p50_us", "p99_us");
+    for (int i = 0; i < nsizes; i++) {
+        // Touch every page so the ballast is resident and fork has page tables to copy.
+        size_t len = sizes[i] << 20;
+        char *ballast = NULL;
+        if (len > 0) {
+            ballast = malloc(len);
+            if (ballast == NULL) {
+                perror("malloc");
+                return 1;
+            }
+            memset(ballast, 1, len);
+        }
+        if (!run("do_exec", do_exec, command, iterations, sizes[i]) ||
+            !run("do_spawn", do_spawn, command, iterations, sizes[i])) {
+            return 1;
+        }
+        free(ballast);
+    }
+    return 0;
+}
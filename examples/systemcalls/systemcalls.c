@@ -1,5 +1,8 @@
+#define _GNU_SOURCE
 #include "systemcalls.h"
 
+extern char **environ;
+
 /**
  * @param cmd the command to execute with system()
  * @return true if the command in @param cmd was executed
@@ -124,3 +127,427 @@ bool do_exec_redirect(const char *outputfile, int count, ...)
     return success;
 }
 
+
+/**
+* @param command - A NULL terminated argument vector. command[0] is the full path
+*   to the command to execute, as with execv().
+* @param outputfile - When not NULL, the full path to a file that receives the
+*   command's standard output. The file is truncated or created, as in do_exec_redirect.
+* @return the pid of the started child, or -1 if it could not be started.
+*   The child is started with posix_spawn(), which glibc implements with
+*   clone(CLONE_VM|CLONE_VFORK). Unlike fork(), the parent's page tables are never
+*   copied, so the cost of a launch does not grow with the parent's memory size.
+*/
+pid_t spawn_command(char *const command[], const char *outputfile)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_t *actionsp = NULL;
+    if (outputfile != NULL) {
+        int rc = posix_spawn_file_actions_init(&actions);
+        if (rc == 0) {
+            rc = posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, outputfile,
+                                                  O_WRONLY | O_TRUNC | O_CREAT, 0644);
+            if (rc != 0) {
+                posix_spawn_file_actions_destroy(&actions);
+            }
+        }
+        if (rc != 0) {
+            errno = rc;
+            perror("posix_spawn_file_actions");
+            return -1;
+        }
+        actionsp = &actions;
+    }
+
+    pid_t pid;
+    int rc = posix_spawn(&pid, command[0], actionsp, NULL, command, environ);
+    if (actionsp != NULL) {
+        posix_spawn_file_actions_destroy(actionsp);
+    }
+    if (rc != 0) {
+        errno = rc;
+        perror("posix_spawn");
+        return -1;
+    }
+    return pid;
+}
+
+/**
+* @param pid - A child started with spawn_command().
+* @return true if the child exited with a zero status, false if it failed or
+*   could not be waited for.
+*/
+bool wait_command(pid_t pid)
+{
+    int status;
+    while (waitpid(pid, &status, 0) == -1) {
+        if (errno != EINTR) {
+            perror("waitpid");
+            return false;
+        }
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/**
+* Same as do_exec, but launches the command with posix_spawn() instead of fork() and execv().
+* Semantics of @param count, ... and the return value are the same as for do_exec.
+*/
+bool do_spawn(int count, ...)
+{
+    va_list args;
+    va_start(args, count);
+    char * command[count+1];
+    int i;
+    for(i=0; i<count; i++)
+    {
+        command[i] = va_arg(args, char *);
+    }
+    command[count] = NULL;
+    va_end(args);
+
+    pid_t pid = spawn_command(command, NULL);
+    return pid != -1 && wait_command(pid);
+}
+
+/**
+* Same as do_exec_redirect, but launches the command with posix_spawn(). The output file
+* is opened by a spawn file action in the child.
+*/
+bool do_spawn_redirect(const char *outputfile, int count, ...)
+{
+    va_list args;
+    va_start(args, count);
+    char * command[count+1];
+    int i;
+    for(i=0; i<count; i++)
+    {
+        command[i] = va_arg(args, char *);
+    }
+    command[count] = NULL;
+    va_end(args);
+
+    pid_t pid = spawn_command(command, outputfile);
+    return pid != -1 && wait_command(pid);
+}
+
+/**
+* A child of do_exec_batch that has been started but not yet reaped.
+*/
+struct batch_slot {
+    pid_t pid;
+    /** pidfd of the child, readable once it exits, or -1 if unavailable */
+    int pidfd;
+    size_t index;
+    struct timespec start;
+};
+
+static int open_pidfd(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+    return syscall(SYS_pidfd_open, pid, 0);
+#else
+    (void)pid;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+static void finish_slot(struct batch_slot *slot, struct exec_result results[])
+{
+    struct exec_result *result = &results[slot->index];
+    int status;
+    while (waitpid(slot->pid, &status, 0) == -1) {
+        if (errno != EINTR) {
+            perror("waitpid");
+            status = -1;
+            break;
+        }
+    }
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    result->status = status;
+    result->success = status != -1 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    result->elapsed_ns = (end.tv_sec - slot->start.tv_sec) * 1000000000ULL +
+                         (end.tv_nsec - slot->start.tv_nsec);
+    if (slot->pidfd != -1) {
+        close(slot->pidfd);
+    }
+}
+
+/**
+* @param commands - An array of @param count NULL terminated argument vectors, each
+*   starting with the full path to the command to execute, as with execv().
+* @param max_concurrent - The maximum number of commands running at any time.
+* @param results - An array of @param count entries that receives the exit status and
+*   launch-to-exit time of each command, in the same order as @param commands.
+* @return true if every command was started and exited with a zero status.
+*
+* Commands are launched with spawn_command() in order, keeping up to @param max_concurrent
+* children running. Each child is watched through a pidfd, so whichever finishes first is
+* reaped first and its slot refilled at once; unrelated children of the caller are never
+* reaped. Without pidfd support (Linux < 5.3) it falls back to blocking on one running
+* child at a time.
+*/
+bool do_exec_batch(char *const *const commands[], size_t count, size_t max_concurrent,
+                   struct exec_result results[])
+{
+    if (max_concurrent == 0) {
+        max_concurrent = 1;
+    }
+    if (max_concurrent > count) {
+        max_concurrent = count;
+    }
+    struct batch_slot *slots = calloc(max_concurrent, sizeof(struct batch_slot));
+    struct pollfd *fds = calloc(max_concurrent, sizeof(struct pollfd));
+    if (count > 0 && (slots == NULL || fds == NULL)) {
+        perror("calloc");
+        free(slots);
+        free(fds);
+        return false;
+    }
+
+    bool success = true;
+    size_t next = 0;
+    size_t running = 0;
+    while (next < count || running > 0) {
+        while (next < count && running < max_concurrent) {
+            struct batch_slot *slot = &slots[running];
+            struct exec_result *result = &results[next];
+            clock_gettime(CLOCK_MONOTONIC, &slot->start);
+            slot->index = next++;
+            slot->pid = spawn_command(commands[slot->index], NULL);
+            if (slot->pid == -1) {
+                result->status = -1;
+                result->success = false;
+                result->elapsed_ns = 0;
+                success = false;
+                continue;
+            }
+            slot->pidfd = open_pidfd(slot->pid);
+            running++;
+        }
+        if (running == 0) {
+            break;
+        }
+
+        bool have_pidfds = true;
+        for (size_t i = 0; i < running; i++) {
+            fds[i].fd = slots[i].pidfd;
+            fds[i].events = POLLIN;
+            fds[i].revents = 0;
+            have_pidfds = have_pidfds && slots[i].pidfd != -1;
+        }
+        if (have_pidfds) {
+            if (poll(fds, running, -1) == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                perror("poll");
+                have_pidfds = false;
+            }
+        }
+        if (!have_pidfds) {
+            fds[0].revents = POLLIN;
+        }
+
+        // Reap every finished child, moving the last running slot into each hole.
+        for (size_t i = running; i-- > 0;) {
+            if (fds[i].revents == 0) {
+                continue;
+            }
+            finish_slot(&slots[i], results);
+            success = success && results[slots[i].index].success;
+            slots[i] = slots[--running];
+        }
+    }
+
+    free(slots);
+    free(fds);
+    return success;
+}
+
+/**
+* Appends @param len bytes of @param data to @param buffer, growing it geometrically.
+* @return false if memory could not be allocated.
+*/
+bool exec_buffer_append(struct exec_buffer *buffer, const char *data, size_t len)
+{
+    if (buffer->len + len + 1 > buffer->capacity) {
+        size_t capacity = buffer->capacity ? buffer->capacity : 4096;
+        while (buffer->len + len + 1 > capacity) {
+            capacity *= 2;
+        }
+        char *grown = realloc(buffer->data, capacity);
+        if (grown == NULL) {
+            perror("realloc");
+            return false;
+        }
+        buffer->data = grown;
+        buffer->capacity = capacity;
+    }
+    memcpy(buffer->data + buffer->len, data, len);
+    buffer->len += len;
+    buffer->data[buffer->len] = '\0';
+    return true;
+}
+
+void exec_buffer_free(struct exec_buffer *buffer)
+{
+    free(buffer->data);
+    buffer->data = NULL;
+    buffer->len = 0;
+    buffer->capacity = 0;
+}
+
+/**
+* @param command - A NULL terminated argument vector, as for spawn_command().
+* @param callback - Called from the calling thread with each chunk the child writes to its
+*   stdout or stderr, as they arrive. Returning false stops capturing that stream. A child
+*   that keeps writing to it is then killed by SIGPIPE, as in a shell pipeline, unless it
+*   ignores the signal and handles EPIPE itself; either way the result is usually false.
+* @return true if the command was started and exited with a zero status.
+*
+* The child's stdout and stderr are connected to pipes which are polled until both reach
+* EOF, so the output never touches the filesystem.
+*/
+bool exec_capture(char *const command[], exec_output_cb callback, void *ctx)
+{
+    int pipes[2][2] = {{-1, -1}, {-1, -1}};
+    const int streams[2] = {STDOUT_FILENO, STDERR_FILENO};
+    bool success = false;
+    posix_spawn_file_actions_t actions;
+    if (posix_spawn_file_actions_init(&actions) != 0) {
+        perror("posix_spawn_file_actions_init");
+        return false;
+    }
+    for (int i = 0; i < 2; i++) {
+        if (pipe2(pipes[i], O_CLOEXEC) == -1) {
+            perror("pipe2");
+            goto cleanup;
+        }
+        // dup2 clears O_CLOEXEC on the copy, so only the child's stdout and
+        // stderr survive the exec.
+        posix_spawn_file_actions_adddup2(&actions, pipes[i][1], streams[i]);
+    }
+
+    pid_t pid;
+    int rc = posix_spawn(&pid, command[0], &actions, NULL, command, environ);
+    if (rc != 0) {
+        errno = rc;
+        perror("posix_spawn");
+        goto cleanup;
+    }
+    for (int i = 0; i < 2; i++) {
+        close(pipes[i][1]);
+        pipes[i][1] = -1;
+    }
+
+    struct pollfd fds[2];
+    for (int i = 0; i < 2; i++) {
+        fds[i].fd = pipes[i][0];
+        fds[i].events = POLLIN;
+    }
+    char buf[65536];
+    while (fds[0].fd != -1 || fds[1].fd != -1) {
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            break;
+        }
+        for (int i = 0; i < 2; i++) {
+            if (fds[i].fd == -1 || fds[i].revents == 0) {
+                continue;
+            }
+            ssize_t n = read(fds[i].fd, buf, sizeof(buf));
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0 || !callback(streams[i], buf, n, ctx)) {
+                close(fds[i].fd);
+                pipes[i][0] = -1;
+                fds[i].fd = -1;
+            }
+        }
+    }
+    success = wait_command(pid);
+
+cleanup:
+    posix_spawn_file_actions_destroy(&actions);
+    for (int i = 0; i < 2; i++) {
+        for (int j = 0; j < 2; j++) {
+            if (pipes[i][j] != -1) {
+                close(pipes[i][j]);
+            }
+        }
+    }
+    return success;
+}
+
+static bool capture_to_buffers(int stream, const char *data, size_t len, void *ctx)
+{
+    struct exec_output *output = ctx;
+    struct exec_buffer *buffer = stream == STDOUT_FILENO ? &output->out : &output->err;
+    return exec_buffer_append(buffer, data, len);
+}
+
+/**
+* Runs the command like do_exec and collects its stdout and stderr into @param output.
+* The buffers in @param output are appended to, so they may be reused across calls, and must
+* be released with exec_buffer_free().
+* @return true if the command exited with a zero status.
+*/
+bool do_exec_capture(struct exec_output *output, int count, ...)
+{
+    va_list args;
+    va_start(args, count);
+    char * command[count+1];
+    int i;
+    for(i=0; i<count; i++)
+    {
+        command[i] = va_arg(args, char *);
+    }
+    command[count] = NULL;
+    va_end(args);
+
+    return exec_capture(command, capture_to_buffers, output);
+}
+
+/**
+* Runs the command like do_exec with its stdout connected directly to @param fd, which may be
+* any descriptor the child can write to, such as a socket, pipe or /dev/aesdchar. The caller's
+* descriptor is shared with the child, so the output is written by the child itself and never
+* copied through this process. @param fd is left open.
+* @return true if the command exited with a zero status.
+*/
+bool do_exec_to_fd(int fd, int count, ...)
+{
+    va_list args;
+    va_start(args, count);
+    char * command[count+1];
+    int i;
+    for(i=0; i<count; i++)
+    {
+        command[i] = va_arg(args, char *);
+    }
+    command[count] = NULL;
+    va_end(args);
+
+    posix_spawn_file_actions_t actions;
+    if (posix_spawn_file_actions_init(&actions) != 0) {
+        perror("posix_spawn_file_actions_init");
+        return false;
+    }
+    posix_spawn_file_actions_adddup2(&actions, fd, STDOUT_FILENO);
+    pid_t pid;
+    int rc = posix_spawn(&pid, command[0], &actions, NULL, command, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (rc != 0) {
+        errno = rc;
+        perror("posix_spawn");
+        return false;
+    }
+    return wait_command(pid);
+}
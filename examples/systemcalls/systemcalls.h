@@ -1,14 +1,78 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/wait.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <spawn.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/syscall.h>
 
 bool do_system(const char *command);
 
 bool do_exec(int count, ...);
 
 bool do_exec_redirect(const char *outputfile, int count, ...);
+
+pid_t spawn_command(char *const command[], const char *outputfile);
+
+bool wait_command(pid_t pid);
+
+bool do_spawn(int count, ...);
+
+bool do_spawn_redirect(const char *outputfile, int count, ...);
+
+/**
+ * The outcome of one command run by do_exec_batch.
+ */
+struct exec_result {
+    /**
+     * Wait status of the command as returned by waitpid(), or -1 if it could not be started
+     */
+    int status;
+    /**
+     * Set to true if the command exited with a zero status
+     */
+    bool success;
+    /**
+     * Nanoseconds from launching the command until it was reaped
+     */
+    uint64_t elapsed_ns;
+};
+
+bool do_exec_batch(char *const *const commands[], size_t count, size_t max_concurrent,
+                   struct exec_result results[]);
+
+/**
+ * A growable byte buffer. The contents are always NUL terminated once non-empty.
+ */
+struct exec_buffer {
+    char *data;
+    size_t len;
+    size_t capacity;
+};
+
+/**
+ * Output of a command run by do_exec_capture.
+ */
+struct exec_output {
+    struct exec_buffer out;
+    struct exec_buffer err;
+};
+
+typedef bool (*exec_output_cb)(int stream, const char *data, size_t len, void *ctx);
+
+bool exec_buffer_append(struct exec_buffer *buffer, const char *data, size_t len);
+
+void exec_buffer_free(struct exec_buffer *buffer);
+
+bool exec_capture(char *const command[], exec_output_cb callback, void *ctx);
+
+bool do_exec_capture(struct exec_output *output, int count, ...);
+
+bool do_exec_to_fd(int fd, int count, ...);
@@ -0,0 +1,244 @@
+/**
+ * @file lockbench.c
+ * @brief Lock contention benchmark.
+ *
+ * Every thread repeats the cycle of threadfunc() in threading.c: wait
+ * wait_to_obtain, take the lock, hold it for wait_to_release, release it.
+ * Waits are busy loops in microseconds, since usleep() is far coarser than
+ * the critical sections being measured. The benchmark sweeps thread counts,
+ * hold and wait times over each lock type and reports acquisition latency
+ * percentiles, throughput and fairness.
+ *
+ * Usage: lockbench [-l lock[,lock...]] [-t threads[,threads...]]
+ *                  [-H hold_us[,...]] [-W wait_us[,...]] [-d duration_ms]
+ */
+#include "locks.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_SWEEP 16
+#define MAX_SAMPLES_PER_THREAD 20000
+#define DEFAULT_DURATION_MS 500
+
+struct bench_thread {
+    pthread_t thread;
+    const struct lock_ops *ops;
+    void *lock;
+    int wait_to_obtain_us;
+    int wait_to_release_us;
+    uint64_t acquisitions;
+    /** Reservoir sample of acquisition latencies in nanoseconds */
+    uint64_t *samples;
+    size_t nsamples;
+    uint64_t rng;
+    struct mcs_node node;
+};
+
+static pthread_barrier_t start_barrier;
+static atomic_bool stop;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void spin_for_us(int us)
+{
+    if (us <= 0) {
+        return;
+    }
+    uint64_t end = now_ns() + us * 1000ULL;
+    while (now_ns() < end) {
+        cpu_relax();
+    }
+}
+
+static uint64_t xorshift(uint64_t *state)
+{
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+static void *bench_threadfunc(void *thread_param)
+{
+    struct bench_thread *data = thread_param;
+    pthread_barrier_wait(&start_barrier);
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        spin_for_us(data->wait_to_obtain_us);
+        uint64_t start = now_ns();
+        data->ops->lock(data->lock, &data->node);
+        uint64_t latency = now_ns() - start;
+        spin_for_us(data->wait_to_release_us);
+        data->ops->unlock(data->lock, &data->node);
+
+        data->acquisitions++;
+        if (data->nsamples < MAX_SAMPLES_PER_THREAD) {
+            data->samples[data->nsamples++] = latency;
+        } else {
+            uint64_t slot = xorshift(&data->rng) % data->acquisitions;
+            if (slot < MAX_SAMPLES_PER_THREAD) {
+                data->samples[slot] = latency;
+            }
+        }
+    }
+    return thread_param;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Runs one configuration and prints a result row.
+ * Fairness is Jain's index over per-thread acquisition counts: 1.0 when every
+ * thread got the lock equally often, 1/threads when one thread got it always.
+ */
+static bool run(const struct lock_ops *ops, int nthreads, int hold_us, int wait_us,
+                int duration_ms)
+{
+    struct bench_thread *threads = calloc(nthreads, sizeof(struct bench_thread));
+    uint64_t *samples = malloc(sizeof(uint64_t) * MAX_SAMPLES_PER_THREAD * nthreads);
+    void *lock = ops->create();
+    if (threads == NULL || samples == NULL || lock == NULL) {
+        perror("malloc");
+        return false;
+    }
+
+    atomic_store(&stop, false);
+    pthread_barrier_init(&start_barrier, NULL, nthreads + 1);
+    for (int i = 0; i < nthreads; i++) {
+        threads[i].ops = ops;
+        threads[i].lock = lock;
+        threads[i].wait_to_obtain_us = wait_us;
+        threads[i].wait_to_release_us = hold_us;
+        threads[i].samples = samples + (size_t)i * MAX_SAMPLES_PER_THREAD;
+        threads[i].rng = 0x9e3779b97f4a7c15ULL * (i + 1);
+        if (pthread_create(&threads[i].thread, NULL, bench_threadfunc, &threads[i]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    pthread_barrier_wait(&start_barrier);
+    uint64_t start = now_ns();
+    usleep(duration_ms * 1000);
+    atomic_store(&stop, true);
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(threads[i].thread, NULL);
+    }
+    double elapsed_s = (now_ns() - start) / 1e9;
+    pthread_barrier_destroy(&start_barrier);
+
+    uint64_t total = 0;
+    double sum_sq = 0;
+    size_t nsamples = 0;
+    for (int i = 0; i < nthreads; i++) {
+        total += threads[i].acquisitions;
+        sum_sq += (double)threads[i].acquisitions * threads[i].acquisitions;
+        // Compact the per-thread reservoirs into one array for sorting.
+        memmove(samples + nsamples, threads[i].samples, threads[i].nsamples * sizeof(uint64_t));
+        nsamples += threads[i].nsamples;
+    }
+    qsort(samples, nsamples, sizeof(uint64_t), compare_u64);
+    double fairness = sum_sq > 0 ? (double)total * total / (nthreads * sum_sq) : 0;
+    uint64_t p50 = nsamples ? samples[nsamples / 2] : 0;
+    uint64_t p90 = nsamples ? samples[(nsamples * 90) / 100] : 0;
+    uint64_t p99 = nsamples ? samples[(nsamples * 99) / 100] : 0;
+    uint64_t max = nsamples ? samples[nsamples - 1] : 0;
+    printf("%-9s %7d %7d %7d %12.0f %9llu %9llu %9llu %10llu %8.3f\n", ops->name, nthreads,
+           hold_us, wait_us, total / elapsed_s, (unsigned long long)p50,
+           (unsigned long long)p90, (unsigned long long)p99, (unsigned long long)max, fairness);
+    fflush(stdout);
+
+    ops->destroy(lock);
+    free(samples);
+    free(threads);
+    return true;
+}
+
+static int parse_list(char *arg, int *values)
+{
+    int n = 0;
+    for (char *tok = strtok(arg, ","); tok != NULL && n < MAX_SWEEP; tok = strtok(NULL, ",")) {
+        values[n++] = atoi(tok);
+    }
+    return n;
+}
+
+int main(int argc, char *argv[])
+{
+    const struct lock_ops *locks[MAX_SWEEP];
+    int nlocks = 0;
+    int threads[MAX_SWEEP] = {1, 2, 4, 8};
+    int nthreads = 4;
+    int holds[MAX_SWEEP] = {0, 1, 10};
+    int nholds = 3;
+    int waits[MAX_SWEEP] = {0, 10};
+    int nwaits = 2;
+    int duration_ms = DEFAULT_DURATION_MS;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "l:t:H:W:d:")) != -1) {
+        switch (opt) {
+        case 'l':
+            for (char *tok = strtok(optarg, ","); tok != NULL && nlocks < MAX_SWEEP;
+                 tok = strtok(NULL, ",")) {
+                locks[nlocks] = find_lock(tok);
+                if (locks[nlocks] == NULL) {
+                    fprintf(stderr, "unknown lock %s\n", tok);
+                    return 1;
+                }
+                nlocks++;
+            }
+            break;
+        case 't':
+            nthreads = parse_list(optarg, threads);
+            break;
+        case 'H':
+            nholds = parse_list(optarg, holds);
+            break;
+        case 'W':
+            nwaits = parse_list(optarg, waits);
+            break;
+        case 'd':
+            duration_ms = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-l lock[,lock...]] [-t threads[,...]] [-H hold_us[,...]] "
+                            "[-W wait_us[,...]] [-d duration_ms]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (nlocks == 0) {
+        for (int i = 0; all_locks[i] != NULL; i++) {
+            locks[nlocks++] = all_locks[i];
+        }
+    }
+
+    printf("%-9s %7s %7s %7s %12s %9s %9s %9s %10s %8s\n", "lock", "threads", "hold_us",
+           "wait_us", "acq/s", "p50_ns", "p90_ns", "p99_ns", "max_ns", "fairness");
+    for (int t = 0; t < nthreads; t++) {
+        for (int h = 0; h < nholds; h++) {
+            for (int w = 0; w < nwaits; w++) {
+                for (int l = 0; l < nlocks; l++) {
+                    if (threads[t] <= 0 ||
+                        !run(locks[l], threads[t], holds[h], waits[w], duration_ms)) {
+                        return 1;
+                    }
+                }
+            }
+        }
+    }
+    return 0;
+}
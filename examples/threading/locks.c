@@ -0,0 +1,184 @@
+#define _GNU_SOURCE
+#include "locks.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define CACHE_LINE 64
+
+static void *mutex_create_type(int type)
+{
+    pthread_mutex_t *mutex = malloc(sizeof(pthread_mutex_t));
+    if (mutex == NULL) {
+        return NULL;
+    }
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, type);
+    pthread_mutex_init(mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    return mutex;
+}
+
+static void *mutex_create(void)
+{
+    return mutex_create_type(PTHREAD_MUTEX_NORMAL);
+}
+
+static void *adaptive_create(void)
+{
+    return mutex_create_type(PTHREAD_MUTEX_ADAPTIVE_NP);
+}
+
+static void mutex_destroy(void *lock)
+{
+    pthread_mutex_destroy(lock);
+    free(lock);
+}
+
+static void mutex_lock(void *lock, struct mcs_node *node)
+{
+    pthread_mutex_lock(lock);
+}
+
+static void mutex_unlock(void *lock, struct mcs_node *node)
+{
+    pthread_mutex_unlock(lock);
+}
+
+static void *spin_create(void)
+{
+    pthread_spinlock_t *spin = malloc(sizeof(pthread_spinlock_t));
+    if (spin != NULL) {
+        pthread_spin_init(spin, PTHREAD_PROCESS_PRIVATE);
+    }
+    return (void *)spin;
+}
+
+static void spin_destroy(void *lock)
+{
+    pthread_spin_destroy(lock);
+    free(lock);
+}
+
+static void spin_lock(void *lock, struct mcs_node *node)
+{
+    pthread_spin_lock(lock);
+}
+
+static void spin_unlock(void *lock, struct mcs_node *node)
+{
+    pthread_spin_unlock(lock);
+}
+
+/**
+ * FIFO spinlock: each waiter takes a ticket and spins until it is served.
+ * The counters live on separate cache lines so taking a ticket does not
+ * disturb the waiters polling `serving`.
+ */
+struct ticket_lock {
+    _Alignas(CACHE_LINE) atomic_uint next;
+    _Alignas(CACHE_LINE) atomic_uint serving;
+};
+
+static void *ticket_create(void)
+{
+    struct ticket_lock *ticket = aligned_alloc(CACHE_LINE, sizeof(struct ticket_lock));
+    if (ticket != NULL) {
+        atomic_init(&ticket->next, 0);
+        atomic_init(&ticket->serving, 0);
+    }
+    return ticket;
+}
+
+static void ticket_lock(void *lock, struct mcs_node *node)
+{
+    struct ticket_lock *ticket = lock;
+    unsigned int mine = atomic_fetch_add_explicit(&ticket->next, 1, memory_order_relaxed);
+    while (atomic_load_explicit(&ticket->serving, memory_order_acquire) != mine) {
+        cpu_relax();
+    }
+}
+
+static void ticket_unlock(void *lock, struct mcs_node *node)
+{
+    struct ticket_lock *ticket = lock;
+    unsigned int serving = atomic_load_explicit(&ticket->serving, memory_order_relaxed);
+    atomic_store_explicit(&ticket->serving, serving + 1, memory_order_release);
+}
+
+struct mcs_lock {
+    _Alignas(CACHE_LINE) _Atomic(struct mcs_node *) tail;
+};
+
+static void *mcs_create(void)
+{
+    struct mcs_lock *mcs = aligned_alloc(CACHE_LINE, sizeof(struct mcs_lock));
+    if (mcs != NULL) {
+        atomic_init(&mcs->tail, NULL);
+    }
+    return mcs;
+}
+
+static void mcs_lock(void *lock, struct mcs_node *node)
+{
+    struct mcs_lock *mcs = lock;
+    atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+    atomic_store_explicit(&node->locked, true, memory_order_relaxed);
+    struct mcs_node *prev = atomic_exchange_explicit(&mcs->tail, node, memory_order_acq_rel);
+    if (prev == NULL) {
+        return;
+    }
+    atomic_store_explicit(&prev->next, node, memory_order_release);
+    while (atomic_load_explicit(&node->locked, memory_order_acquire)) {
+        cpu_relax();
+    }
+}
+
+static void mcs_unlock(void *lock, struct mcs_node *node)
+{
+    struct mcs_lock *mcs = lock;
+    struct mcs_node *next = atomic_load_explicit(&node->next, memory_order_acquire);
+    if (next == NULL) {
+        struct mcs_node *expected = node;
+        if (atomic_compare_exchange_strong_explicit(&mcs->tail, &expected, NULL,
+                                                    memory_order_release,
+                                                    memory_order_relaxed)) {
+            return;
+        }
+        // A waiter swapped itself in but has not linked to us yet.
+        while ((next = atomic_load_explicit(&node->next, memory_order_acquire)) == NULL) {
+            cpu_relax();
+        }
+    }
+    atomic_store_explicit(&next->locked, false, memory_order_release);
+}
+
+static const struct lock_ops mutex_ops = {
+    "mutex", mutex_create, mutex_destroy, mutex_lock, mutex_unlock,
+};
+static const struct lock_ops adaptive_ops = {
+    "adaptive", adaptive_create, mutex_destroy, mutex_lock, mutex_unlock,
+};
+static const struct lock_ops spin_ops = {
+    "spinlock", spin_create, spin_destroy, spin_lock, spin_unlock,
+};
+static const struct lock_ops ticket_ops = {
+    "ticket", ticket_create, free, ticket_lock, ticket_unlock,
+};
+static const struct lock_ops mcs_ops = {
+    "mcs", mcs_create, free, mcs_lock, mcs_unlock,
+};
+
+const struct lock_ops *const all_locks[] = {
+    &mutex_ops, &adaptive_ops, &spin_ops, &ticket_ops, &mcs_ops, NULL,
+};
+
+const struct lock_ops *find_lock(const char *name)
+{
+    for (int i = 0; all_locks[i] != NULL; i++) {
+        if (strcmp(all_locks[i]->name, name) == 0) {
+            return all_locks[i];
+        }
+    }
+    return NULL;
+}
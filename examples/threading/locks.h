@@ -0,0 +1,39 @@
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__) || defined(__arm__)
+#define cpu_relax() __asm__ __volatile__("yield" ::: "memory")
+#else
+#define cpu_relax() atomic_signal_fence(memory_order_seq_cst)
+#endif
+
+/**
+ * Queue node of an MCS lock. Each waiter spins on its own node, so a release
+ * only touches the cache line of the next waiter.
+ */
+struct mcs_node {
+    _Atomic(struct mcs_node *) next;
+    atomic_bool locked;
+};
+
+/**
+ * A lock implementation exercised by lockbench. @param node is a per-thread
+ * queue node, only used by queue locks.
+ */
+struct lock_ops {
+    const char *name;
+    void *(*create)(void);
+    void (*destroy)(void *lock);
+    void (*lock)(void *lock, struct mcs_node *node);
+    void (*unlock)(void *lock, struct mcs_node *node);
+};
+
+/**
+ * NULL terminated list of every lock implementation.
+ */
+extern const struct lock_ops *const all_locks[];
+
+const struct lock_ops *find_lock(const char *name);
@@ -0,0 +1,39 @@
+#include "threading-pool.h"
+#include <pthread.h>
+#include <unistd.h>
+#include <stdio.h>
+
+// Optional: use these functions to add debug or error prints to your application
+#define DEBUG_LOG(msg,...)
+//#define DEBUG_LOG(msg,...) printf("threading-pool: " msg "\n" , ##__VA_ARGS__)
+#define ERROR_LOG(msg,...) printf("threading-pool ERROR: " msg "\n" , ##__VA_ARGS__)
+
+/**
+ * The pooled counterpart of threadfunc() in threading.c, kept separate so threading.c still
+ * builds and links on its own.
+ */
+static void* taskfunc(void* task_param)
+{
+    struct thread_data *data = (struct thread_data *)task_param;
+    usleep(data->wait_to_obtain_ms * 1000);
+    pthread_mutex_lock(data->mutex);
+    usleep(data->wait_to_release_ms * 1000);
+    pthread_mutex_unlock(data->mutex);
+    data->thread_complete_success = true;
+    return task_param;
+}
+
+bool start_task_obtaining_mutex(struct threadpool *pool, struct tp_task **task, struct thread_data *data,
+                                pthread_mutex_t *mutex, int wait_to_obtain_ms, int wait_to_release_ms)
+{
+    data->mutex = mutex;
+    data->wait_to_obtain_ms = wait_to_obtain_ms;
+    data->wait_to_release_ms = wait_to_release_ms;
+    data->thread_complete_success = false;
+    *task = threadpool_submit(pool, taskfunc, data);
+    if (*task == NULL) {
+        ERROR_LOG("could not queue task, pool is shutting down");
+        return false;
+    }
+    return true;
+}
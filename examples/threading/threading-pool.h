@@ -0,0 +1,13 @@
+#include "threading.h"
+#include "threadpool.h"
+
+/**
+* Same as start_thread_obtaining_mutex, but runs the task on a worker of @param pool instead of
+* creating a thread for it. The caller supplies the thread_data structure in @param data, so
+* nothing is allocated per task.
+* @param task is filled with the queued task; tp_task_wait() on it returns @param data once
+* the task has released the mutex.
+* @return true if the task was queued, false if the pool is shutting down.
+*/
+bool start_task_obtaining_mutex(struct threadpool *pool, struct tp_task **task, struct thread_data *data,
+                                pthread_mutex_t *mutex, int wait_to_obtain_ms, int wait_to_release_ms);
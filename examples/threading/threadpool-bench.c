@@ -0,0 +1,186 @@
+/**
+ * @file threadpool-bench.c
+ * @brief Task spawn overhead of the thread pool against raw pthread_create.
+ *
+ * Each mode runs the same trivial task many times and reports the cost per
+ * task:
+ *  - pthread:  pthread_create + pthread_join per task, as start_thread_obtaining_mutex does
+ *  - pool:     threadpool_submit + tp_task_wait per task
+ *  - batch:    submit a batch of tasks, then wait for all of them
+ *  - detached: threadpool_submit_detached, waiting once on a counter at the end
+ *  - nested:   a binary tree of tasks, each submitting and waiting on its children
+ *              from a worker, which exercises the per-worker deques and stealing
+ *
+ * Usage: threadpool-bench [-n tasks] [-w workers] [-b batch]
+ */
+#include "threadpool.h"
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_TASKS 100000
+#define DEFAULT_BATCH 256
+
+static atomic_size_t completed;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *noop_task(void *arg)
+{
+    atomic_fetch_add_explicit(&completed, 1, memory_order_relaxed);
+    return arg;
+}
+
+struct tree_node {
+    struct threadpool *pool;
+    size_t size;
+};
+
+/** Counts the nodes of a binary tree of @param arg->size nodes, one task per node */
+static void *tree_task(void *arg)
+{
+    struct tree_node *node = arg;
+    size_t children = node->size - 1;
+    struct tree_node left = {node->pool, children / 2};
+    struct tree_node right = {node->pool, children - children / 2};
+    struct tp_task *task = NULL;
+    size_t count = 1;
+    if (left.size > 0) {
+        task = threadpool_submit(node->pool, tree_task, &left);
+    }
+    if (right.size > 0) {
+        count += (size_t)tree_task(&right);
+    }
+    if (task != NULL) {
+        count += (size_t)tp_task_wait(task);
+    }
+    return (void *)count;
+}
+
+static void report(const char *mode, size_t tasks, uint64_t elapsed_ns)
+{
+    printf("%-9s %8zu tasks %10.3f ms %9.1f ns/task\n", mode, tasks,
+           elapsed_ns / 1e6, (double)elapsed_ns / tasks);
+}
+
+static void bench_pthread(size_t tasks)
+{
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < tasks; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, noop_task, NULL) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+        pthread_join(thread, NULL);
+    }
+    report("pthread", tasks, now_ns() - start);
+}
+
+static void bench_pool(struct threadpool *pool, size_t tasks)
+{
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < tasks; i++) {
+        tp_task_wait(threadpool_submit(pool, noop_task, NULL));
+    }
+    report("pool", tasks, now_ns() - start);
+}
+
+static void bench_batch(struct threadpool *pool, size_t tasks, size_t batch)
+{
+    struct tp_task **pending = malloc(batch * sizeof(*pending));
+    if (pending == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    uint64_t start = now_ns();
+    for (size_t done = 0; done < tasks; done += batch) {
+        size_t n = tasks - done < batch ? tasks - done : batch;
+        for (size_t i = 0; i < n; i++) {
+            pending[i] = threadpool_submit(pool, noop_task, NULL);
+        }
+        for (size_t i = 0; i < n; i++) {
+            tp_task_wait(pending[i]);
+        }
+    }
+    report("batch", tasks, now_ns() - start);
+    free(pending);
+}
+
+static void bench_detached(struct threadpool *pool, size_t tasks)
+{
+    atomic_store(&completed, 0);
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < tasks; i++) {
+        threadpool_submit_detached(pool, noop_task, NULL);
+    }
+    while (atomic_load(&completed) < tasks) {
+        sched_yield();
+    }
+    report("detached", tasks, now_ns() - start);
+}
+
+static void bench_nested(struct threadpool *pool, size_t tasks)
+{
+    struct tree_node root = {pool, tasks};
+    uint64_t start = now_ns();
+    size_t count = (size_t)tp_task_wait(threadpool_submit(pool, tree_task, &root));
+    uint64_t elapsed = now_ns() - start;
+    if (count != tasks) {
+        fprintf(stderr, "nested: counted %zu tasks, expected %zu\n", count, tasks);
+        exit(1);
+    }
+    report("nested", tasks, elapsed);
+}
+
+int main(int argc, char **argv)
+{
+    size_t tasks = DEFAULT_TASKS;
+    size_t batch = DEFAULT_BATCH;
+    long nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+    while ((opt = getopt(argc, argv, "n:w:b:")) != -1) {
+        switch (opt) {
+        case 'n':
+            tasks = strtoul(optarg, NULL, 10);
+            break;
+        case 'w':
+            nworkers = strtol(optarg, NULL, 10);
+            break;
+        case 'b':
+            batch = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n tasks] [-w workers] [-b batch]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (tasks == 0 || batch == 0 || nworkers < 1) {
+        fprintf(stderr, "tasks, batch and workers must be positive\n");
+        return 1;
+    }
+
+    // The nested tree keeps one descriptor per task in flight at worst.
+    struct threadpool *pool = threadpool_create(nworkers, tasks > batch ? tasks : batch);
+    if (pool == NULL) {
+        fprintf(stderr, "threadpool_create failed\n");
+        return 1;
+    }
+    printf("%ld workers\n", nworkers);
+    bench_pthread(tasks);
+    bench_pool(pool, tasks);
+    bench_batch(pool, tasks, batch);
+    bench_detached(pool, tasks);
+    bench_nested(pool, tasks);
+    threadpool_destroy(pool);
+    return 0;
+}
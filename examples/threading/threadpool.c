@@ -0,0 +1,424 @@
+#include "threadpool.h"
+#include <errno.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Optional: use these functions to add debug or error prints to your application
+#define DEBUG_LOG(msg,...)
+//#define DEBUG_LOG(msg,...) printf("threadpool: " msg "\n" , ##__VA_ARGS__)
+#define ERROR_LOG(msg,...) printf("threadpool ERROR: " msg "\n" , ##__VA_ARGS__)
+
+// Number of times a waiter polls a task before sleeping on the condition variable.
+#define WAIT_SPINS 256
+
+enum tp_task_state {
+    TASK_FREE,
+    TASK_QUEUED,
+    TASK_DONE,
+};
+
+struct tp_task {
+    tp_func fn;
+    void *arg;
+    void *result;
+    struct threadpool *pool;
+    bool detached;
+    atomic_int state;
+    /**
+     * Set by a waiter before it sleeps, so completion only signals when needed.
+     */
+    atomic_bool waiting;
+    /**
+     * Index + 1 of the next descriptor on the free stack, 0 at the bottom.
+     */
+    _Atomic uint32_t next_free;
+};
+
+/**
+ * Double ended queue of task indices. The owning worker pushes and pops at the
+ * bottom, so it runs its most recent (cache-hot) task first, while thieves take
+ * the oldest task from the top.
+ */
+struct tp_deque {
+    pthread_mutex_t lock;
+    uint32_t *slots;
+    size_t mask;
+    size_t top;
+    size_t bottom;
+};
+
+struct tp_worker {
+    pthread_t thread;
+    struct threadpool *pool;
+    struct tp_deque deque;
+    size_t id;
+};
+
+struct threadpool {
+    struct tp_task *tasks;
+    size_t max_tasks;
+    /**
+     * Top of the lock free stack of free descriptors: a generation tag in the high 32
+     * bits guards against ABA, the low 32 bits hold the index + 1 of the top descriptor.
+     */
+    _Atomic uint64_t free_head;
+    /**
+     * Counts free descriptors, so a submitter that gets past it is sure to pop one.
+     */
+    sem_t free_slots;
+
+    struct tp_worker *workers;
+    size_t nworkers;
+    atomic_size_t next_worker;
+
+    /**
+     * Tasks sitting in any deque.
+     */
+    atomic_size_t queued;
+    atomic_int sleepers;
+    atomic_bool shutdown;
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+};
+
+static __thread struct tp_worker *current_worker = NULL;
+
+static struct tp_task *pop_free(struct threadpool *pool)
+{
+    uint64_t head = atomic_load(&pool->free_head);
+    while (1) {
+        uint32_t index = (uint32_t)head;
+        if (index == 0) {
+            return NULL;
+        }
+        struct tp_task *task = &pool->tasks[index - 1];
+        uint64_t next = ((head >> 32) + 1) << 32 | atomic_load_explicit(&task->next_free, memory_order_relaxed);
+        if (atomic_compare_exchange_weak(&pool->free_head, &head, next)) {
+            return task;
+        }
+    }
+}
+
+static void release_task(struct tp_task *task)
+{
+    struct threadpool *pool = task->pool;
+    uint32_t index = task - pool->tasks + 1;
+    atomic_store_explicit(&task->state, TASK_FREE, memory_order_relaxed);
+    uint64_t head = atomic_load(&pool->free_head);
+    uint64_t next;
+    do {
+        atomic_store_explicit(&task->next_free, (uint32_t)head, memory_order_relaxed);
+        next = ((head >> 32) + 1) << 32 | index;
+    } while (!atomic_compare_exchange_weak(&pool->free_head, &head, next));
+    sem_post(&pool->free_slots);
+}
+
+static void deque_push(struct tp_deque *deque, uint32_t index)
+{
+    pthread_mutex_lock(&deque->lock);
+    deque->slots[deque->bottom & deque->mask] = index;
+    deque->bottom++;
+    pthread_mutex_unlock(&deque->lock);
+}
+
+static bool deque_pop(struct tp_deque *deque, uint32_t *index)
+{
+    bool found = false;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom != deque->top) {
+        deque->bottom--;
+        *index = deque->slots[deque->bottom & deque->mask];
+        found = true;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+static bool deque_steal(struct tp_deque *deque, uint32_t *index)
+{
+    bool found = false;
+    // Do not queue up behind the owner; just try the next victim.
+    if (pthread_mutex_trylock(&deque->lock) != 0) {
+        return false;
+    }
+    if (deque->bottom != deque->top) {
+        *index = deque->slots[deque->top & deque->mask];
+        deque->top++;
+        found = true;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+static void run_task(struct tp_task *task)
+{
+    struct threadpool *pool = task->pool;
+    void *result = task->fn(task->arg);
+    if (task->detached) {
+        release_task(task);
+        return;
+    }
+    task->result = result;
+    atomic_store(&task->state, TASK_DONE);
+    if (atomic_load(&task->waiting)) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_broadcast(&pool->done_cond);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+/**
+ * Take a task from @param worker's own deque, or steal one from another worker.
+ * @return true if a task was run.
+ */
+static bool run_one(struct tp_worker *worker)
+{
+    struct threadpool *pool = worker->pool;
+    uint32_t index;
+    bool found = deque_pop(&worker->deque, &index);
+    for (size_t i = 1; !found && i < pool->nworkers; i++) {
+        found = deque_steal(&pool->workers[(worker->id + i) % pool->nworkers].deque, &index);
+    }
+    if (!found) {
+        return false;
+    }
+    atomic_fetch_sub(&pool->queued, 1);
+    run_task(&pool->tasks[index]);
+    return true;
+}
+
+static void *worker_main(void *arg)
+{
+    struct tp_worker *worker = arg;
+    struct threadpool *pool = worker->pool;
+    current_worker = worker;
+    while (1) {
+        if (run_one(worker)) {
+            continue;
+        }
+        // A thief can miss a task behind a contended deque lock, so only sleep
+        // once nothing is queued anywhere. The sleepers/queued pair is ordered so
+        // that either this worker sees the new task or the submitter sees the sleeper.
+        pthread_mutex_lock(&pool->lock);
+        atomic_fetch_add(&pool->sleepers, 1);
+        while (atomic_load(&pool->queued) == 0 && !atomic_load(&pool->shutdown)) {
+            pthread_cond_wait(&pool->work_cond, &pool->lock);
+        }
+        atomic_fetch_sub(&pool->sleepers, 1);
+        pthread_mutex_unlock(&pool->lock);
+        if (atomic_load(&pool->shutdown) && atomic_load(&pool->queued) == 0) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Take a free descriptor slot, waiting for one if @param block is set.
+ * Only workers release descriptors, so a worker that blocked could wait forever once
+ * every worker does: @param self, the calling worker if any, runs queued tasks
+ * instead, and gives up once none is left.
+ * @return true if a slot was taken, false with errno EAGAIN if none is free.
+ */
+static bool take_slot(struct threadpool *pool, struct tp_worker *self, bool block)
+{
+    while (1) {
+        int rc = block && self == NULL ? sem_wait(&pool->free_slots)
+                                       : sem_trywait(&pool->free_slots);
+        if (rc == 0) {
+            return true;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno != EAGAIN) {
+            ERROR_LOG("sem_wait failed");
+            return false;
+        }
+        if (!block || self == NULL || !run_one(self)) {
+            errno = EAGAIN;
+            return false;
+        }
+    }
+}
+
+static struct tp_task *submit(struct threadpool *pool, tp_func fn, void *arg, bool detached, bool block)
+{
+    struct tp_worker *self = current_worker != NULL && current_worker->pool == pool ? current_worker : NULL;
+    // Workers may still add subtasks while the pool drains.
+    if (self == NULL && atomic_load(&pool->shutdown)) {
+        errno = ECANCELED;
+        return NULL;
+    }
+    if (!take_slot(pool, self, block)) {
+        return NULL;
+    }
+    struct tp_task *task = pop_free(pool);
+    task->fn = fn;
+    task->arg = arg;
+    task->result = NULL;
+    task->detached = detached;
+    atomic_store_explicit(&task->waiting, false, memory_order_relaxed);
+    atomic_store_explicit(&task->state, TASK_QUEUED, memory_order_relaxed);
+
+    if (self == NULL) {
+        self = &pool->workers[atomic_fetch_add(&pool->next_worker, 1) % pool->nworkers];
+    }
+    deque_push(&self->deque, task - pool->tasks);
+    atomic_fetch_add(&pool->queued, 1);
+    if (atomic_load(&pool->sleepers) > 0) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_signal(&pool->work_cond);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    DEBUG_LOG("queued task %zu on worker %zu", (size_t)(task - pool->tasks), self->id);
+    return task;
+}
+
+struct tp_task *threadpool_submit(struct threadpool *pool, tp_func fn, void *arg)
+{
+    return submit(pool, fn, arg, false, true);
+}
+
+bool threadpool_submit_detached(struct threadpool *pool, tp_func fn, void *arg)
+{
+    if (submit(pool, fn, arg, true, true) != NULL) {
+        return true;
+    }
+    // Nobody waits for the result, so a worker that found the pool full runs it itself.
+    if (errno == EAGAIN && current_worker != NULL && current_worker->pool == pool) {
+        fn(arg);
+        return true;
+    }
+    return false;
+}
+
+bool threadpool_try_submit_detached(struct threadpool *pool, tp_func fn, void *arg)
+{
+    return submit(pool, fn, arg, true, false) != NULL;
+}
+
+void *tp_task_wait(struct tp_task *task)
+{
+    struct threadpool *pool = task->pool;
+    if (current_worker != NULL && current_worker->pool == pool) {
+        while (atomic_load(&task->state) != TASK_DONE) {
+            if (!run_one(current_worker)) {
+                sched_yield();
+            }
+        }
+    } else {
+        for (int i = 0; i < WAIT_SPINS && atomic_load(&task->state) != TASK_DONE; i++) {
+            sched_yield();
+        }
+        if (atomic_load(&task->state) != TASK_DONE) {
+            pthread_mutex_lock(&pool->lock);
+            atomic_store(&task->waiting, true);
+            while (atomic_load(&task->state) != TASK_DONE) {
+                pthread_cond_wait(&pool->done_cond, &pool->lock);
+            }
+            pthread_mutex_unlock(&pool->lock);
+        }
+    }
+    void *result = task->result;
+    release_task(task);
+    return result;
+}
+
+struct threadpool *threadpool_create(size_t nworkers, size_t max_tasks)
+{
+    if (nworkers == 0 || max_tasks == 0 || max_tasks >= UINT32_MAX) {
+        return NULL;
+    }
+    struct threadpool *pool = calloc(1, sizeof(struct threadpool));
+    if (pool == NULL) {
+        return NULL;
+    }
+    pool->max_tasks = max_tasks;
+    pool->nworkers = nworkers;
+    pool->tasks = calloc(max_tasks, sizeof(struct tp_task));
+    pool->workers = calloc(nworkers, sizeof(struct tp_worker));
+    if (pool->tasks == NULL || pool->workers == NULL) {
+        goto fail;
+    }
+    for (size_t i = 0; i < max_tasks; i++) {
+        pool->tasks[i].pool = pool;
+        // Chain every descriptor onto the free stack: task i points at task i + 1.
+        atomic_init(&pool->tasks[i].next_free, i + 1 < max_tasks ? i + 2 : 0);
+    }
+    atomic_init(&pool->free_head, 1);
+    sem_init(&pool->free_slots, 0, max_tasks);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+
+    // Every deque can hold all tasks, so a push never has to grow one.
+    size_t capacity = 1;
+    while (capacity < max_tasks) {
+        capacity <<= 1;
+    }
+    for (size_t i = 0; i < nworkers; i++) {
+        struct tp_worker *worker = &pool->workers[i];
+        worker->pool = pool;
+        worker->id = i;
+        worker->deque.mask = capacity - 1;
+        worker->deque.slots = malloc(capacity * sizeof(uint32_t));
+        if (worker->deque.slots == NULL) {
+            goto fail;
+        }
+        pthread_mutex_init(&worker->deque.lock, NULL);
+    }
+    for (size_t i = 0; i < nworkers; i++) {
+        if (pthread_create(&pool->workers[i].thread, NULL, worker_main, &pool->workers[i]) != 0) {
+            ERROR_LOG("pthread_create failed for worker %zu", i);
+            // Let the workers already started exit, then release everything.
+            for (size_t j = i; j < nworkers; j++) {
+                pthread_mutex_destroy(&pool->workers[j].deque.lock);
+                free(pool->workers[j].deque.slots);
+            }
+            pool->nworkers = i;
+            threadpool_destroy(pool);
+            return NULL;
+        }
+    }
+    return pool;
+
+fail:
+    if (pool->workers != NULL) {
+        for (size_t i = 0; i < nworkers; i++) {
+            free(pool->workers[i].deque.slots);
+        }
+    }
+    free(pool->workers);
+    free(pool->tasks);
+    free(pool);
+    return NULL;
+}
+
+void threadpool_destroy(struct threadpool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    atomic_store(&pool->shutdown, true);
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+    for (size_t i = 0; i < pool->nworkers; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+
+    for (size_t i = 0; i < pool->nworkers; i++) {
+        pthread_mutex_destroy(&pool->workers[i].deque.lock);
+        free(pool->workers[i].deque.slots);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work_cond);
+    pthread_cond_destroy(&pool->done_cond);
+    sem_destroy(&pool->free_slots);
+    free(pool->workers);
+    free(pool->tasks);
+    free(pool);
+}
@@ -0,0 +1,63 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+typedef void *(*tp_func)(void *arg);
+
+struct threadpool;
+
+/**
+ * A task submitted to a thread pool. Descriptors come from a fixed slab
+ * allocated with the pool, so submitting does not call malloc. A task returned
+ * by threadpool_submit also serves as its future: it stays valid until it is
+ * passed to tp_task_wait.
+ */
+struct tp_task;
+
+/**
+* Create a pool of @param nworkers threads, each with its own task deque.
+* At most @param max_tasks tasks may be queued or running at once; further submissions
+* block until a descriptor is released, except from the pool's own workers (see
+* threadpool_submit).
+* @return the pool, or NULL if it could not be created.
+*/
+struct threadpool *threadpool_create(size_t nworkers, size_t max_tasks);
+
+/**
+* Queue @param fn to be called with @param arg on a worker thread.
+* Submitting from a worker pushes onto that worker's own deque; other threads spread
+* tasks over the workers round robin. Idle workers steal from the others' deques.
+* A worker never blocks for a free descriptor, since only workers release them: while
+* the pool is full it runs queued tasks, and fails if none is left.
+* @return the task, to be waited for with tp_task_wait(), or NULL if the pool is shutting
+* down or, when called from a worker, with errno EAGAIN if the pool is full.
+*/
+struct tp_task *threadpool_submit(struct threadpool *pool, tp_func fn, void *arg);
+
+/**
+* Same as threadpool_submit, but nobody waits for the task: its descriptor is released
+* as soon as @param fn returns. A worker that finds the pool full calls @param fn itself.
+* @return true if the task was queued or run.
+*/
+bool threadpool_submit_detached(struct threadpool *pool, tp_func fn, void *arg);
+
+/**
+* Same as threadpool_submit_detached, but fails instead of blocking when max_tasks tasks
+* are already queued or running.
+* @return true if the task was queued, false with errno EAGAIN if the pool is full or
+* ECANCELED if it is shutting down.
+*/
+bool threadpool_try_submit_detached(struct threadpool *pool, tp_func fn, void *arg);
+
+/**
+* Wait for @param task to complete and release its descriptor. When called from one
+* of the pool's own workers, other queued tasks are run while waiting so nested
+* waits cannot deadlock the pool.
+* @return the value returned by the task's function.
+*/
+void *tp_task_wait(struct tp_task *task);
+
+/**
+* Run every queued task to completion, stop the workers and free the pool.
+*/
+void threadpool_destroy(struct threadpool *pool);
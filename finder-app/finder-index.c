@@ -0,0 +1,863 @@
+/*
+ * Persistent search index for finder.
+ *
+ * The index records the metadata of every file under the searched directory
+ * and which trigrams each file contains. A query cache next to it keeps the
+ * per-file line counts of the most recent search strings. A search only reads
+ * files that changed since they were indexed, or that neither the cache nor
+ * the trigrams can answer for.
+ *
+ * Both files are in host byte order with every section 4-byte aligned, so
+ * they are used in place through mmap. The index, at the given path:
+ *
+ *   struct index_header
+ *   struct index_file  files[nfiles]                  sorted by path
+ *   uint32_t           bucket_start[TRIGRAM_BUCKETS + 1]
+ *   uint8_t            postings[postings_len]
+ *   char               strings[strings_len]           root, then paths
+ *
+ * Trigrams are hashed into TRIGRAM_BUCKETS buckets. The ids of the files
+ * containing a trigram of bucket b are stored in ascending order from byte
+ * bucket_start[b] of the postings, each as the LEB128 varint of its distance
+ * from the previous id plus one.
+ *
+ * The query cache, at the index path with ".queries" appended:
+ *
+ *   struct query_header
+ *   struct index_query queries[nqueries]              most recent first
+ *   uint32_t           counts[nqueries][nfiles]
+ *   char               strings[strings_len]
+ *
+ * The cache is only used with the index whose generation it records, so the
+ * index is rewritten only when files change, while each new search string
+ * just rewrites the much smaller cache.
+ */
+#define _GNU_SOURCE
+#include "finder-index.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define INDEX_MAGIC "FNDRIDX2"
+#define QUERY_MAGIC "FNDRQRY2"
+#define TRIGRAM_BITS 16
+#define TRIGRAM_BUCKETS (1u << TRIGRAM_BITS)
+// Search strings whose per-file counts are kept.
+#define MAX_QUERIES 16
+#define COUNT_UNKNOWN UINT32_MAX
+#define NO_FILE UINT32_MAX
+
+struct index_header {
+  char magic[8];
+  uint64_t generation;
+  uint32_t nfiles;
+  uint32_t postings_len;
+  uint32_t strings_len;
+  uint32_t root_len;
+};
+
+struct index_file {
+  uint64_t ino;
+  uint64_t size;
+  int64_t mtime_ns;
+  int64_t ctime_ns;
+  uint32_t path_off;
+  uint32_t path_len;
+};
+
+struct query_header {
+  char magic[8];
+  uint64_t generation;
+  uint32_t nfiles;
+  uint32_t nqueries;
+  uint32_t strings_len;
+  uint32_t reserved;
+};
+
+struct index_query {
+  uint32_t str_off;
+  uint32_t str_len;
+};
+
+// A file mapped into memory.
+struct mapping {
+  void *data;
+  size_t len;
+};
+
+// The index and query cache of the previous search.
+struct index_view {
+  struct mapping map;
+  struct index_header header;
+  const struct index_file *files;
+  const uint32_t *bucket_start;
+  const uint8_t *postings;
+  const char *strings;
+
+  struct mapping query_map;
+  uint32_t nqueries;
+  const struct index_query *queries;
+  const uint32_t *counts;
+  const char *query_strings;
+};
+
+// What the search knows about one of the entries.
+struct entry_state {
+  // Id of the file in the old index, NO_FILE if it is new or changed.
+  uint32_t old_id;
+  uint32_t count;
+  // Trigram buckets of a file that was read because it changed.
+  uint16_t *buckets;
+  uint32_t nbuckets;
+};
+
+struct read_job {
+  struct index_entry *entries;
+  struct entry_state *states;
+  size_t *todo;
+  size_t ntodo;
+  size_t next;
+};
+
+struct byte_vec {
+  uint8_t *data;
+  size_t len;
+  size_t capacity;
+};
+
+static uint32_t trigram_bucket(const unsigned char *p) {
+  uint32_t trigram = (uint32_t)p[0] << 16 | (uint32_t)p[1] << 8 | p[2];
+  return (trigram * 2654435761u) >> (32 - TRIGRAM_BITS);
+}
+
+// Collects the distinct trigram buckets of data[0..len) in ascending order.
+static uint16_t *trigram_buckets(const char *data, size_t len,
+                                 uint32_t *count) {
+  uint64_t seen[TRIGRAM_BUCKETS / 64];
+  memset(seen, 0, sizeof(seen));
+  const unsigned char *p = (const unsigned char *)data;
+  for (size_t i = 0; i + 2 < len; i++) {
+    uint32_t b = trigram_bucket(p + i);
+    seen[b / 64] |= 1ULL << (b % 64);
+  }
+  uint32_t n = 0;
+  for (size_t w = 0; w < TRIGRAM_BUCKETS / 64; w++) {
+    n += __builtin_popcountll(seen[w]);
+  }
+  uint16_t *buckets = malloc((n > 0 ? n : 1) * sizeof(uint16_t));
+  if (buckets == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  n = 0;
+  for (size_t w = 0; w < TRIGRAM_BUCKETS / 64; w++) {
+    for (uint64_t bits = seen[w]; bits != 0; bits &= bits - 1) {
+      buckets[n++] = w * 64 + __builtin_ctzll(bits);
+    }
+  }
+  *count = n;
+  return buckets;
+}
+
+static void byte_vec_push(struct byte_vec *vec, uint8_t byte) {
+  if (vec->len == vec->capacity) {
+    vec->capacity = vec->capacity ? vec->capacity * 2 : 64 * 1024;
+    vec->data = realloc(vec->data, vec->capacity);
+    if (vec->data == NULL) {
+      perror("realloc");
+      exit(1);
+    }
+  }
+  vec->data[vec->len++] = byte;
+}
+
+static void put_varint(struct byte_vec *vec, uint32_t value) {
+  while (value >= 0x80) {
+    byte_vec_push(vec, value | 0x80);
+    value >>= 7;
+  }
+  byte_vec_push(vec, value);
+}
+
+// Decodes the file ids of bucket `b` of the old index into `ids`, which has
+// room for every file. Returns the number of ids, or -1 if the bucket is
+// corrupt.
+static ssize_t decode_bucket(const struct index_view *view, uint32_t b,
+                             uint32_t *ids) {
+  const uint8_t *p = view->postings + view->bucket_start[b];
+  const uint8_t *end = view->postings + view->bucket_start[b + 1];
+  uint64_t next = 0;
+  ssize_t n = 0;
+  while (p < end) {
+    uint64_t delta = 0;
+    for (int shift = 0;; shift += 7) {
+      if (p == end || shift > 28) {
+        return -1;
+      }
+      delta |= (uint64_t)(*p & 0x7f) << shift;
+      if ((*p++ & 0x80) == 0) {
+        break;
+      }
+    }
+    next += delta;
+    if (next >= view->header.nfiles) {
+      return -1;
+    }
+    ids[n++] = next++;
+  }
+  return n;
+}
+
+static bool in_range(size_t off, size_t len, size_t limit) {
+  return off <= limit && len <= limit - off;
+}
+
+static bool map_file(const char *path, struct mapping *map) {
+  map->data = NULL;
+  map->len = 0;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    if (errno != ENOENT) {
+      fprintf(stderr, "finder: %s: %s\n", path, strerror(errno));
+    }
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    map->data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    map->len = st.st_size;
+  }
+  close(fd);
+  if (map->data == NULL || map->data == MAP_FAILED) {
+    map->data = NULL;
+    return false;
+  }
+  return true;
+}
+
+static void unmap_file(struct mapping *map) {
+  if (map->data != NULL) {
+    munmap(map->data, map->len);
+    map->data = NULL;
+  }
+}
+
+// Splits map[off..] into consecutive sections of the given lengths.
+static bool split_sections(const struct mapping *map, size_t off,
+                           const size_t *lens, const void **sections,
+                           size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    if (!in_range(off, lens[i], map->len)) {
+      return false;
+    }
+    sections[i] = (const char *)map->data + off;
+    off += lens[i];
+  }
+  return true;
+}
+
+static bool load_queries(const char *path, struct index_view *view) {
+  if (!map_file(path, &view->query_map)) {
+    return false;
+  }
+  struct query_header h;
+  if (view->query_map.len < sizeof(h)) {
+    goto invalid;
+  }
+  memcpy(&h, view->query_map.data, sizeof(h));
+  if (memcmp(h.magic, QUERY_MAGIC, sizeof(h.magic)) != 0 ||
+      h.nqueries > MAX_QUERIES) {
+    goto invalid;
+  }
+  // The cache of an older index is stale rather than corrupt.
+  if (h.generation != view->header.generation ||
+      h.nfiles != view->header.nfiles) {
+    unmap_file(&view->query_map);
+    return false;
+  }
+  size_t lens[] = {h.nqueries * sizeof(struct index_query),
+                   (size_t)h.nqueries * h.nfiles * sizeof(uint32_t),
+                   h.strings_len};
+  const void *sections[3];
+  if (!split_sections(&view->query_map, sizeof(h), lens, sections, 3)) {
+    goto invalid;
+  }
+  view->queries = sections[0];
+  view->counts = sections[1];
+  view->query_strings = sections[2];
+  for (uint32_t q = 0; q < h.nqueries; q++) {
+    if (!in_range(view->queries[q].str_off, view->queries[q].str_len,
+                  h.strings_len)) {
+      goto invalid;
+    }
+  }
+  view->nqueries = h.nqueries;
+  return true;
+
+invalid:
+  fprintf(stderr, "finder: ignoring invalid query cache %s\n", path);
+  unmap_file(&view->query_map);
+  return false;
+}
+
+// Maps the index at `path` and its query cache if they exist, are well formed
+// and were built for `root`. Anything else means starting from an empty
+// index.
+static void load_index(const char *path, const char *query_path,
+                       const char *root, struct index_view *view) {
+  memset(view, 0, sizeof(*view));
+  if (!map_file(path, &view->map)) {
+    return;
+  }
+  struct index_header *h = &view->header;
+  if (view->map.len < sizeof(*h)) {
+    goto invalid;
+  }
+  memcpy(h, view->map.data, sizeof(*h));
+  if (memcmp(h->magic, INDEX_MAGIC, sizeof(h->magic)) != 0) {
+    goto invalid;
+  }
+  size_t lens[] = {(size_t)h->nfiles * sizeof(struct index_file),
+                   (TRIGRAM_BUCKETS + 1) * sizeof(uint32_t), h->postings_len,
+                   h->strings_len};
+  const void *sections[4];
+  if (!split_sections(&view->map, sizeof(*h), lens, sections, 4)) {
+    goto invalid;
+  }
+  view->files = sections[0];
+  view->bucket_start = sections[1];
+  view->postings = sections[2];
+  view->strings = sections[3];
+
+  // Bucket contents are checked as they are decoded.
+  for (uint32_t b = 0; b < TRIGRAM_BUCKETS; b++) {
+    if (view->bucket_start[b] > view->bucket_start[b + 1]) {
+      goto invalid;
+    }
+  }
+  if (view->bucket_start[TRIGRAM_BUCKETS] > h->postings_len) {
+    goto invalid;
+  }
+  for (uint32_t i = 0; i < h->nfiles; i++) {
+    if (!in_range(view->files[i].path_off, view->files[i].path_len,
+                  h->strings_len)) {
+      goto invalid;
+    }
+  }
+  if (h->root_len > h->strings_len) {
+    goto invalid;
+  }
+  // An index of another directory is not wrong, just of no use here.
+  if (h->root_len != strlen(root) ||
+      memcmp(view->strings, root, h->root_len) != 0) {
+    unmap_file(&view->map);
+    memset(view, 0, sizeof(*view));
+    return;
+  }
+  load_queries(query_path, view);
+  return;
+
+invalid:
+  fprintf(stderr, "finder: ignoring invalid index %s\n", path);
+  unmap_file(&view->map);
+  memset(view, 0, sizeof(*view));
+}
+
+static int compare_entries(const void *a, const void *b) {
+  const struct index_entry *x = a;
+  const struct index_entry *y = b;
+  return strcmp(x->rel, y->rel);
+}
+
+static int compare_old_path(const struct index_view *view, uint32_t id,
+                            const char *rel) {
+  const struct index_file *f = &view->files[id];
+  size_t len = strlen(rel);
+  int cmp = memcmp(view->strings + f->path_off, rel,
+                   f->path_len < len ? f->path_len : len);
+  if (cmp != 0) {
+    return cmp;
+  }
+  return f->path_len < len ? -1 : f->path_len > len;
+}
+
+static bool same_metadata(const struct index_entry *entry,
+                          const struct stat *st) {
+  return entry->ino == st->st_ino && entry->size == (uint64_t)st->st_size &&
+         entry->mtime_ns ==
+             st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec &&
+         entry->ctime_ns ==
+             st->st_ctim.tv_sec * 1000000000LL + st->st_ctim.tv_nsec;
+}
+
+static void read_entry(struct index_entry *entry, struct entry_state *state) {
+  state->count = 0;
+  int fd = open(entry->path, O_RDONLY | O_NOFOLLOW | O_NOCTTY | O_CLOEXEC);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) == -1) {
+    fprintf(stderr, "finder: %s: %s\n", entry->path, strerror(errno));
+    goto fail;
+  }
+  // The file may have changed since the walk; index what is actually read.
+  if (!same_metadata(entry, &st)) {
+    state->old_id = NO_FILE;
+    entry->ino = st.st_ino;
+    entry->size = st.st_size;
+    entry->mtime_ns = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+    entry->ctime_ns = st.st_ctim.tv_sec * 1000000000LL + st.st_ctim.tv_nsec;
+  }
+
+  const char *data = "";
+  if (st.st_size > 0) {
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      fprintf(stderr, "finder: %s: %s\n", entry->path, strerror(errno));
+      goto fail;
+    }
+    madvise((void *)data, st.st_size, MADV_SEQUENTIAL);
+  }
+  state->count = count_lines(data, st.st_size);
+  if (state->old_id == NO_FILE) {
+    state->buckets = trigram_buckets(data, st.st_size, &state->nbuckets);
+  }
+  if (st.st_size > 0) {
+    munmap((void *)data, st.st_size);
+  }
+  close(fd);
+  return;
+
+fail:
+  if (fd != -1) {
+    close(fd);
+  }
+  // Never matches the file's metadata, so the next search retries it.
+  entry->mtime_ns = -1;
+  state->old_id = NO_FILE;
+  state->nbuckets = 0;
+}
+
+static void *read_main(void *arg) {
+  struct read_job *job = arg;
+  size_t k;
+  while ((k = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) <
+         job->ntodo) {
+    size_t i = job->todo[k];
+    read_entry(&job->entries[i], &job->states[i]);
+  }
+  return NULL;
+}
+
+static void read_entries(struct read_job *job, int nthreads) {
+  pthread_t threads[nthreads];
+  int started = 0;
+  while (started < nthreads - 1 && (size_t)started + 1 < job->ntodo) {
+    if (pthread_create(&threads[started], NULL, read_main, job) != 0) {
+      break;
+    }
+    started++;
+  }
+  read_main(job);
+  for (int i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+}
+
+// Marks the old files that may contain the needle: those listed in every one
+// of its trigram buckets.
+static uint64_t *candidate_files(const struct index_view *view,
+                                 const uint16_t *buckets, uint32_t nbuckets) {
+  uint32_t nold = view->header.nfiles;
+  size_t words = nold / 64 + 1;
+  uint64_t *candidates = malloc(words * sizeof(uint64_t));
+  uint64_t *in_bucket = malloc(words * sizeof(uint64_t));
+  uint32_t *ids = malloc((nold + 1) * sizeof(uint32_t));
+  if (candidates == NULL || in_bucket == NULL || ids == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  memset(candidates, 0xff, words * sizeof(uint64_t));
+  for (uint32_t j = 0; j < nbuckets; j++) {
+    ssize_t n = decode_bucket(view, buckets[j], ids);
+    if (n == -1) {
+      // Cannot rule anything out with a corrupt bucket.
+      continue;
+    }
+    memset(in_bucket, 0, words * sizeof(uint64_t));
+    for (ssize_t k = 0; k < n; k++) {
+      in_bucket[ids[k] / 64] |= 1ULL << (ids[k] % 64);
+    }
+    for (size_t w = 0; w < words; w++) {
+      candidates[w] &= in_bucket[w];
+    }
+  }
+  free(ids);
+  free(in_bucket);
+  return candidates;
+}
+
+// Builds the new posting lists by merging, bucket by bucket, the old lists
+// of unchanged files (renumbered) with the buckets of the files just read.
+static void build_postings(const struct index_view *old,
+                           const struct entry_state *states, size_t nentries,
+                           uint32_t *bucket_start, struct byte_vec *postings) {
+  uint32_t nold = old->map.data != NULL ? old->header.nfiles : 0;
+  uint32_t *new_id = malloc((nold + 1) * sizeof(uint32_t));
+  uint32_t *old_ids = malloc((nold + 1) * sizeof(uint32_t));
+  uint32_t *fresh_start = calloc(TRIGRAM_BUCKETS + 1, sizeof(uint32_t));
+  if (new_id == NULL || old_ids == NULL || fresh_start == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  for (uint32_t i = 0; i < nold; i++) {
+    new_id[i] = NO_FILE;
+  }
+  size_t nfresh = 0;
+  for (size_t i = 0; i < nentries; i++) {
+    if (states[i].old_id != NO_FILE) {
+      new_id[states[i].old_id] = i;
+    } else {
+      for (uint32_t j = 0; j < states[i].nbuckets; j++) {
+        fresh_start[states[i].buckets[j] + 1]++;
+      }
+      nfresh += states[i].nbuckets;
+    }
+  }
+  // Counting sort of the fresh (bucket, file) pairs by bucket. Files are
+  // visited in order, so each bucket's ids come out ascending.
+  for (uint32_t b = 0; b < TRIGRAM_BUCKETS; b++) {
+    fresh_start[b + 1] += fresh_start[b];
+  }
+  uint32_t *fresh = malloc((nfresh + 1) * sizeof(uint32_t));
+  uint32_t *fill = malloc(TRIGRAM_BUCKETS * sizeof(uint32_t));
+  if (fresh == NULL || fill == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  memcpy(fill, fresh_start, TRIGRAM_BUCKETS * sizeof(uint32_t));
+  for (size_t i = 0; i < nentries; i++) {
+    if (states[i].old_id == NO_FILE) {
+      for (uint32_t j = 0; j < states[i].nbuckets; j++) {
+        fresh[fill[states[i].buckets[j]]++] = i;
+      }
+    }
+  }
+
+  for (uint32_t b = 0; b < TRIGRAM_BUCKETS; b++) {
+    bucket_start[b] = postings->len;
+    ssize_t nold_ids = nold > 0 ? decode_bucket(old, b, old_ids) : 0;
+    if (nold_ids == -1) {
+      // Unchanged files whose bucket is lost would be missed by searches.
+      fprintf(stderr, "finder: index bucket %u is corrupt\n", b);
+      exit(1);
+    }
+    ssize_t o = 0;
+    uint32_t f = fresh_start[b];
+    uint32_t f_end = fresh_start[b + 1];
+    uint32_t next = 0;
+    while (o < nold_ids || f < f_end) {
+      uint32_t kept = NO_FILE;
+      if (o < nold_ids) {
+        kept = new_id[old_ids[o]];
+        if (kept == NO_FILE) {
+          o++;
+          continue;
+        }
+      }
+      uint32_t id;
+      if (f < f_end && (kept == NO_FILE || fresh[f] < kept)) {
+        id = fresh[f++];
+      } else {
+        id = kept;
+        o++;
+      }
+      put_varint(postings, id - next);
+      next = id + 1;
+    }
+  }
+  bucket_start[TRIGRAM_BUCKETS] = postings->len;
+  free(fill);
+  free(fresh);
+  free(fresh_start);
+  free(old_ids);
+  free(new_id);
+}
+
+static FILE *open_temp(const char *path, char **tmp_path) {
+  if (asprintf(tmp_path, "%s.tmp", path) == -1) {
+    perror("asprintf");
+    return NULL;
+  }
+  FILE *out = fopen(*tmp_path, "we");
+  if (out == NULL) {
+    fprintf(stderr, "finder: %s: %s\n", *tmp_path, strerror(errno));
+    free(*tmp_path);
+  }
+  return out;
+}
+
+// Closes a file written by open_temp and renames it over `path`, so readers
+// only ever see a complete file.
+static int commit_temp(FILE *out, char *tmp_path, const char *path) {
+  int status = 0;
+  bool failed = ferror(out);
+  if (fclose(out) != 0 || failed) {
+    fprintf(stderr, "finder: %s: write failed\n", tmp_path);
+    unlink(tmp_path);
+    status = -1;
+  } else if (rename(tmp_path, path) == -1) {
+    fprintf(stderr, "finder: %s: %s\n", path, strerror(errno));
+    unlink(tmp_path);
+    status = -1;
+  }
+  free(tmp_path);
+  return status;
+}
+
+static int write_index(const char *path, const char *root, uint64_t generation,
+                       const struct index_entry *entries, size_t nentries,
+                       const uint32_t *bucket_start,
+                       const struct byte_vec *postings) {
+  char *tmp_path;
+  FILE *out = open_temp(path, &tmp_path);
+  if (out == NULL) {
+    return -1;
+  }
+  struct index_header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+  header.generation = generation;
+  header.nfiles = nentries;
+  // Keeps the strings that follow 4-byte aligned.
+  header.postings_len = (postings->len + 3) & ~(size_t)3;
+  header.root_len = strlen(root);
+  header.strings_len = header.root_len;
+  for (size_t i = 0; i < nentries; i++) {
+    header.strings_len += strlen(entries[i].rel);
+  }
+  fwrite(&header, sizeof(header), 1, out);
+
+  uint32_t str_off = header.root_len;
+  for (size_t i = 0; i < nentries; i++) {
+    struct index_file file = {
+        .ino = entries[i].ino,
+        .size = entries[i].size,
+        .mtime_ns = entries[i].mtime_ns,
+        .ctime_ns = entries[i].ctime_ns,
+        .path_off = str_off,
+        .path_len = strlen(entries[i].rel),
+    };
+    str_off += file.path_len;
+    fwrite(&file, sizeof(file), 1, out);
+  }
+  fwrite(bucket_start, sizeof(uint32_t), TRIGRAM_BUCKETS + 1, out);
+  fwrite(postings->data, 1, postings->len, out);
+  fwrite("\0\0\0", 1, header.postings_len - postings->len, out);
+  fwrite(root, 1, header.root_len, out);
+  for (size_t i = 0; i < nentries; i++) {
+    fwrite(entries[i].rel, 1, strlen(entries[i].rel), out);
+  }
+  return commit_temp(out, tmp_path, path);
+}
+
+static int write_queries(const char *path, uint64_t generation,
+                         size_t nentries, const char **queries,
+                         const uint32_t *query_lens, uint32_t nqueries,
+                         const uint32_t *counts) {
+  char *tmp_path;
+  FILE *out = open_temp(path, &tmp_path);
+  if (out == NULL) {
+    return -1;
+  }
+  struct query_header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, QUERY_MAGIC, sizeof(header.magic));
+  header.generation = generation;
+  header.nfiles = nentries;
+  header.nqueries = nqueries;
+  for (uint32_t q = 0; q < nqueries; q++) {
+    header.strings_len += query_lens[q];
+  }
+  fwrite(&header, sizeof(header), 1, out);
+  uint32_t str_off = 0;
+  for (uint32_t q = 0; q < nqueries; q++) {
+    struct index_query query = {.str_off = str_off, .str_len = query_lens[q]};
+    str_off += query.str_len;
+    fwrite(&query, sizeof(query), 1, out);
+  }
+  fwrite(counts, sizeof(uint32_t), (size_t)nqueries * nentries, out);
+  for (uint32_t q = 0; q < nqueries; q++) {
+    fwrite(queries[q], 1, query_lens[q], out);
+  }
+  return commit_temp(out, tmp_path, path);
+}
+
+int index_search(const char *index_path, const char *root,
+                 struct index_entry *entries, size_t nentries,
+                 const char *needle, size_t needle_len, int nthreads,
+                 size_t *lines) {
+  if (nentries >= NO_FILE) {
+    fprintf(stderr, "finder: too many files to index\n");
+    return -1;
+  }
+  char *query_path;
+  if (asprintf(&query_path, "%s.queries", index_path) == -1) {
+    perror("asprintf");
+    return -1;
+  }
+  qsort(entries, nentries, sizeof(struct index_entry), compare_entries);
+
+  struct index_view old;
+  load_index(index_path, query_path, root, &old);
+  uint32_t nold = old.map.data != NULL ? old.header.nfiles : 0;
+
+  // Which cached query, if any, is this search string.
+  uint32_t cached = NO_FILE;
+  for (uint32_t q = 0; q < old.nqueries; q++) {
+    if (old.queries[q].str_len == needle_len &&
+        memcmp(old.query_strings + old.queries[q].str_off, needle,
+               needle_len) == 0) {
+      cached = q;
+      break;
+    }
+  }
+
+  // A file lacking any trigram of the needle cannot contain it. Needles
+  // shorter than a trigram have none and rule nothing out.
+  uint64_t *candidates = NULL;
+  if (cached == NO_FILE && nold > 0) {
+    uint32_t nneedle;
+    uint16_t *needle_buckets = trigram_buckets(needle, needle_len, &nneedle);
+    candidates = candidate_files(&old, needle_buckets, nneedle);
+    free(needle_buckets);
+  }
+
+  struct entry_state *states =
+      calloc(nentries + 1, sizeof(struct entry_state));
+  size_t *todo = malloc((nentries + 1) * sizeof(size_t));
+  if (states == NULL || todo == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  // Both lists are sorted by path, so matching them is a merge.
+  bool files_changed = nentries != nold;
+  size_t ntodo = 0;
+  uint32_t o = 0;
+  for (size_t i = 0; i < nentries; i++) {
+    struct entry_state *state = &states[i];
+    state->old_id = NO_FILE;
+    state->count = COUNT_UNKNOWN;
+    while (o < nold && compare_old_path(&old, o, entries[i].rel) < 0) {
+      o++;
+    }
+    if (o < nold && compare_old_path(&old, o, entries[i].rel) == 0) {
+      const struct index_file *f = &old.files[o];
+      if (f->ino == entries[i].ino && f->size == entries[i].size &&
+          f->mtime_ns == entries[i].mtime_ns &&
+          f->ctime_ns == entries[i].ctime_ns) {
+        state->old_id = o;
+      }
+      o++;
+    }
+    if (state->old_id != NO_FILE) {
+      if (cached != NO_FILE) {
+        state->count = old.counts[(size_t)cached * nold + state->old_id];
+      } else if ((candidates[state->old_id / 64] &
+                  (1ULL << (state->old_id % 64))) == 0) {
+        state->count = 0;
+      }
+    }
+    if (state->count == COUNT_UNKNOWN) {
+      todo[ntodo++] = i;
+    }
+  }
+  free(candidates);
+
+  struct read_job job = {entries, states, todo, ntodo, 0};
+  read_entries(&job, nthreads);
+
+  *lines = 0;
+  for (size_t i = 0; i < nentries; i++) {
+    *lines += states[i].count;
+    files_changed |= states[i].old_id == NO_FILE;
+  }
+
+  uint64_t generation = old.header.generation;
+  if (files_changed || old.map.data == NULL) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    generation = now.tv_sec * 1000000000ULL + now.tv_nsec;
+    if (generation == old.header.generation) {
+      generation++;
+    }
+    uint32_t *bucket_start = malloc((TRIGRAM_BUCKETS + 1) * sizeof(uint32_t));
+    if (bucket_start == NULL) {
+      perror("malloc");
+      exit(1);
+    }
+    struct byte_vec postings = {NULL, 0, 0};
+    build_postings(&old, states, nentries, bucket_start, &postings);
+    if (write_index(index_path, root, generation, entries, nentries,
+                    bucket_start, &postings) == -1) {
+      // The counts are still right; the next search just reads more.
+      generation = 0;
+    }
+    free(postings.data);
+    free(bucket_start);
+  }
+
+  // This search string becomes the most recent query; the counts of older
+  // ones carry over for the files that did not change. Nothing needs saving
+  // when it already was the most recent and no file changed.
+  if (generation != 0 && (files_changed || cached != 0)) {
+    const char *queries[MAX_QUERIES];
+    uint32_t query_lens[MAX_QUERIES];
+    uint32_t from[MAX_QUERIES];
+    uint32_t nqueries = 0;
+    queries[nqueries] = needle;
+    query_lens[nqueries] = needle_len;
+    from[nqueries++] = NO_FILE;
+    for (uint32_t q = 0; q < old.nqueries && nqueries < MAX_QUERIES; q++) {
+      if (q != cached) {
+        queries[nqueries] = old.query_strings + old.queries[q].str_off;
+        query_lens[nqueries] = old.queries[q].str_len;
+        from[nqueries++] = q;
+      }
+    }
+    uint32_t *counts =
+        malloc(((size_t)nqueries * nentries + 1) * sizeof(uint32_t));
+    if (counts == NULL) {
+      perror("malloc");
+      exit(1);
+    }
+    for (size_t i = 0; i < nentries; i++) {
+      counts[i] = states[i].count;
+      for (uint32_t q = 1; q < nqueries; q++) {
+        counts[(size_t)q * nentries + i] =
+            states[i].old_id != NO_FILE
+                ? old.counts[(size_t)from[q] * nold + states[i].old_id]
+                : COUNT_UNKNOWN;
+      }
+    }
+    write_queries(query_path, generation, nentries, queries, query_lens,
+                  nqueries, counts);
+    free(counts);
+  }
+
+  for (size_t i = 0; i < nentries; i++) {
+    free(states[i].buckets);
+  }
+  free(states);
+  free(todo);
+  unmap_file(&old.query_map);
+  unmap_file(&old.map);
+  free(query_path);
+  return 0;
+}
@@ -0,0 +1,35 @@
+#ifndef FINDER_INDEX_H
+#define FINDER_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A regular file found by the walk, with the metadata used to tell whether it
+// changed since it was indexed.
+struct index_entry {
+  // Path to open the file by, and the part of it relative to the searched
+  // directory, which is the key in the index.
+  char *path;
+  const char *rel;
+  uint64_t ino;
+  uint64_t size;
+  int64_t mtime_ns;
+  int64_t ctime_ns;
+};
+
+// Counts the lines of data[0..len) containing the search string. Provided by
+// finder.c.
+size_t count_lines(const char *data, size_t len);
+
+// Counts the lines containing `needle` in the `nentries` files found under
+// `root`, using and then rewriting the index at `index_path`. Files whose
+// metadata still matches the index are not read again: their count comes
+// from the query cache, or is 0 when the index shows that they lack one of
+// the needle's trigrams. `entries` is sorted by path on return.
+// Returns 0 with the total in `lines`, or -1 if the search failed.
+int index_search(const char *index_path, const char *root,
+                 struct index_entry *entries, size_t nentries,
+                 const char *needle, size_t needle_len, int nthreads,
+                 size_t *lines);
+
+#endif /* FINDER_INDEX_H */
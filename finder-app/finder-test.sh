@@ -53,10 +53,11 @@ fi
 # make clean
 # make
 
+# Write all the files from a single writer process in bulk mode
 for i in $( seq 1 $NUMFILES)
 do
-	writer "$WRITEDIR/${username}$i.txt" "$WRITESTR"
-done
+	printf '%s\t%s\n' "$WRITEDIR/${username}$i.txt" "$WRITESTR"
+done | writer -b
 
 OUTPUTSTRING=$(finder.sh "$WRITEDIR" "$WRITESTR")
 
@@ -0,0 +1,595 @@
+/*
+ * Counts the regular files under a directory and the lines in them that
+ * contain a string, printing the same summary as finder.sh.
+ *
+ * Usage: finder [-j threads] [-x index [-w]] filesdir searchstr
+ *
+ * Directories are read with getdents64 relative to their parent's fd, so no
+ * full path is ever resolved, and files are searched through mmap and memmem.
+ * Both are spread over a pool of threads sharing a stack of work items: one
+ * item per directory to list, and one per batch of files found in it.
+ *
+ * With -x the walk only collects file metadata, and the search goes through
+ * the persistent index in finder-index.c. Adding -w keeps watching the tree
+ * with inotify, updating the index and printing a new summary on changes.
+ */
+#define _GNU_SOURCE
+#include "finder-index.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define MAX_THREADS 64
+// Files handed out to a thread at once.
+#define FILE_BATCH 32
+#define DENTS_BUF_LEN (32 * 1024)
+#define READ_CHUNK (64 * 1024)
+// Files up to this size are read into a buffer, since mapping them costs more
+// than the copy.
+#define MMAP_THRESHOLD (32 * 1024)
+// Changes are batched until the tree has been quiet for this long.
+#define WATCH_QUIET_MS 200
+#define WATCH_MASK                                                             \
+  (IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_MOVED_FROM |             \
+   IN_MOVED_TO | IN_DELETE_SELF)
+
+struct linux_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+// An open directory shared by the work items that refer to it. The fd is
+// closed when the last of them is done.
+struct dir_ref {
+  int fd;
+  int refs;
+  char *path;
+};
+
+enum work_type { WORK_DIR, WORK_FILES };
+
+struct work {
+  enum work_type type;
+  // Directory the names below are relative to, NULL for the root.
+  struct dir_ref *dir;
+  size_t count;
+  char *names[FILE_BATCH];
+  struct work *next;
+};
+
+struct finder_thread {
+  pthread_t thread;
+  size_t files;
+  size_t lines;
+  // Files collected for the index.
+  struct index_entry *entries;
+  size_t nentries;
+  size_t capacity;
+};
+
+static const char *needle;
+static size_t needle_len;
+// Set when searching through the index: the walk only collects metadata.
+static bool collect = false;
+static size_t root_len;
+static int inotify_fd = -1;
+
+static pthread_mutex_t work_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+// Depth first, so few directories are held open at once.
+static struct work *work_stack = NULL;
+// Items queued or being processed; the walk is over when it drops to zero.
+static size_t work_pending = 0;
+
+// Like grep in finder.sh, unreadable entries are reported but do not stop the
+// search or change the exit status.
+static void report_error(const struct dir_ref *dir, const char *name) {
+  if (dir != NULL) {
+    fprintf(stderr, "finder: %s/%s: %s\n", dir->path, name, strerror(errno));
+  } else {
+    fprintf(stderr, "finder: %s: %s\n", name, strerror(errno));
+  }
+}
+
+static void dir_get(struct dir_ref *dir) {
+  if (dir != NULL) {
+    __atomic_add_fetch(&dir->refs, 1, __ATOMIC_RELAXED);
+  }
+}
+
+static void dir_put(struct dir_ref *dir) {
+  if (dir != NULL && __atomic_sub_fetch(&dir->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    close(dir->fd);
+    free(dir->path);
+    free(dir);
+  }
+}
+
+static void push_work(struct work *work) {
+  pthread_mutex_lock(&work_lock);
+  work->next = work_stack;
+  work_stack = work;
+  work_pending++;
+  pthread_cond_signal(&work_cond);
+  pthread_mutex_unlock(&work_lock);
+}
+
+static struct work *pop_work(void) {
+  pthread_mutex_lock(&work_lock);
+  while (work_stack == NULL && work_pending > 0) {
+    pthread_cond_wait(&work_cond, &work_lock);
+  }
+  struct work *work = work_stack;
+  if (work != NULL) {
+    work_stack = work->next;
+  }
+  pthread_mutex_unlock(&work_lock);
+  return work;
+}
+
+static void finish_work(struct work *work) {
+  for (size_t i = 0; i < work->count; i++) {
+    free(work->names[i]);
+  }
+  dir_put(work->dir);
+  free(work);
+  pthread_mutex_lock(&work_lock);
+  if (--work_pending == 0) {
+    pthread_cond_broadcast(&work_cond);
+  }
+  pthread_mutex_unlock(&work_lock);
+}
+
+static struct work *new_work(enum work_type type, struct dir_ref *dir) {
+  struct work *work = calloc(1, sizeof(struct work));
+  if (work == NULL) {
+    perror("calloc");
+    exit(1);
+  }
+  work->type = type;
+  work->dir = dir;
+  dir_get(dir);
+  return work;
+}
+
+// Counts the lines of data[0..len) containing the needle, the way grep counts
+// them: a last line without a newline still counts.
+size_t count_lines(const char *data, size_t len) {
+  const char *p = data;
+  const char *end = data + len;
+  size_t lines = 0;
+  if (needle_len == 0) {
+    while ((p = memchr(p, '\n', end - p)) != NULL) {
+      lines++;
+      p++;
+    }
+    return lines + (len > 0 && data[len - 1] != '\n');
+  }
+  while (p < end) {
+    const char *match = memmem(p, end - p, needle, needle_len);
+    if (match == NULL) {
+      break;
+    }
+    lines++;
+    // Skip the rest of the matching line.
+    p = memchr(match + needle_len, '\n', end - match - needle_len);
+    if (p == NULL) {
+      break;
+    }
+    p++;
+  }
+  return lines;
+}
+
+// Searches files that cannot be mapped, such as those reporting a size of 0.
+static ssize_t search_by_read(int fd, size_t *lines) {
+  char *buf = NULL;
+  size_t len = 0;
+  size_t capacity = 0;
+  while (1) {
+    if (capacity - len < READ_CHUNK) {
+      capacity += READ_CHUNK;
+      char *grown = realloc(buf, capacity);
+      if (grown == NULL) {
+        free(buf);
+        return -1;
+      }
+      buf = grown;
+    }
+    ssize_t n = read(fd, buf + len, capacity - len);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      free(buf);
+      return -1;
+    }
+    if (n == 0) {
+      break;
+    }
+    len += n;
+  }
+  *lines += count_lines(buf, len);
+  free(buf);
+  return 0;
+}
+
+static void collect_file(struct dir_ref *dir, const char *name,
+                         struct finder_thread *self) {
+  struct stat st;
+  if (fstatat(dir->fd, name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+    report_error(dir, name);
+    return;
+  }
+  if (!S_ISREG(st.st_mode)) {
+    return;
+  }
+  if (self->nentries == self->capacity) {
+    self->capacity = self->capacity ? self->capacity * 2 : 256;
+    self->entries =
+        realloc(self->entries, self->capacity * sizeof(struct index_entry));
+    if (self->entries == NULL) {
+      perror("realloc");
+      exit(1);
+    }
+  }
+  struct index_entry *entry = &self->entries[self->nentries++];
+  if (asprintf(&entry->path, "%s/%s", dir->path, name) == -1) {
+    perror("asprintf");
+    exit(1);
+  }
+  entry->rel = entry->path + root_len + 1;
+  entry->ino = st.st_ino;
+  entry->size = st.st_size;
+  entry->mtime_ns = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+  entry->ctime_ns = st.st_ctim.tv_sec * 1000000000LL + st.st_ctim.tv_nsec;
+}
+
+static void search_file(struct dir_ref *dir, const char *name,
+                        struct finder_thread *self) {
+  if (collect) {
+    collect_file(dir, name, self);
+    return;
+  }
+  int fd = openat(dir->fd, name, O_RDONLY | O_NOFOLLOW | O_NOCTTY | O_CLOEXEC);
+  if (fd == -1) {
+    report_error(dir, name);
+    return;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    report_error(dir, name);
+    close(fd);
+    return;
+  }
+  if (!S_ISREG(st.st_mode)) {
+    close(fd);
+    return;
+  }
+  self->files++;
+
+  void *data = MAP_FAILED;
+  if (st.st_size > 0 && st.st_size <= MMAP_THRESHOLD) {
+    char buf[MMAP_THRESHOLD];
+    ssize_t n = pread(fd, buf, st.st_size, 0);
+    if (n == st.st_size) {
+      self->lines += count_lines(buf, n);
+      close(fd);
+      return;
+    }
+  } else if (st.st_size > 0) {
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  if (data != MAP_FAILED) {
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+    self->lines += count_lines(data, st.st_size);
+    munmap(data, st.st_size);
+  } else if (search_by_read(fd, &self->lines) == -1) {
+    report_error(dir, name);
+  }
+  close(fd);
+}
+
+// Opens the directory of a WORK_DIR item and queues its subdirectories and
+// batches of its files.
+static void walk_dir(struct work *work) {
+  const char *name = work->names[0];
+  int fd;
+  if (work->dir != NULL) {
+    fd = openat(work->dir->fd, name,
+                O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  } else {
+    fd = open(name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  }
+  if (fd == -1) {
+    report_error(work->dir, name);
+    return;
+  }
+  struct dir_ref *dir = malloc(sizeof(struct dir_ref));
+  if (dir == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  dir->fd = fd;
+  dir->refs = 1;
+  if (work->dir != NULL) {
+    if (asprintf(&dir->path, "%s/%s", work->dir->path, name) == -1) {
+      dir->path = NULL;
+    }
+  } else {
+    dir->path = strdup(name);
+  }
+  if (dir->path == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  // Watching a directory twice just returns its existing watch.
+  if (inotify_fd != -1 &&
+      inotify_add_watch(inotify_fd, dir->path, WATCH_MASK) == -1) {
+    report_error(work->dir, name);
+  }
+
+  char *buf = malloc(DENTS_BUF_LEN);
+  if (buf == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  struct work *files = NULL;
+  while (1) {
+    long n = syscall(SYS_getdents64, fd, buf, DENTS_BUF_LEN);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      report_error(work->dir, name);
+      break;
+    }
+    if (n == 0) {
+      break;
+    }
+    for (long off = 0; off < n;) {
+      struct linux_dirent64 *d = (struct linux_dirent64 *)(buf + off);
+      off += d->d_reclen;
+      if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0) {
+        continue;
+      }
+      unsigned char type = d->d_type;
+      if (type == DT_UNKNOWN) {
+        // Not every file system fills in d_type.
+        struct stat st;
+        if (fstatat(fd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+          report_error(dir, d->d_name);
+          continue;
+        }
+        type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : 0;
+      }
+      if (type != DT_DIR && type != DT_REG) {
+        continue;
+      }
+      char *entry = strdup(d->d_name);
+      if (entry == NULL) {
+        perror("strdup");
+        exit(1);
+      }
+      if (type == DT_DIR) {
+        struct work *sub = new_work(WORK_DIR, dir);
+        sub->names[sub->count++] = entry;
+        push_work(sub);
+        continue;
+      }
+      if (files == NULL) {
+        files = new_work(WORK_FILES, dir);
+      }
+      files->names[files->count++] = entry;
+      if (files->count == FILE_BATCH) {
+        push_work(files);
+        files = NULL;
+      }
+    }
+  }
+  if (files != NULL) {
+    push_work(files);
+  }
+  free(buf);
+  dir_put(dir);
+}
+
+static void *finder_main(void *arg) {
+  struct finder_thread *self = arg;
+  struct work *work;
+  while ((work = pop_work()) != NULL) {
+    if (work->type == WORK_DIR) {
+      walk_dir(work);
+    } else {
+      for (size_t i = 0; i < work->count; i++) {
+        search_file(work->dir, work->names[i], self);
+      }
+    }
+    finish_work(work);
+  }
+  return NULL;
+}
+
+// Walks `filesdir` on `nthreads` threads, the calling thread included.
+static void walk(const char *filesdir, struct finder_thread *threads,
+                 long nthreads) {
+  struct work *root = new_work(WORK_DIR, NULL);
+  root->names[root->count] = strdup(filesdir);
+  if (root->names[root->count++] == NULL) {
+    perror("strdup");
+    exit(1);
+  }
+  push_work(root);
+
+  long started = 1;
+  for (; started < nthreads; started++) {
+    if (pthread_create(&threads[started].thread, NULL, finder_main,
+                       &threads[started]) != 0) {
+      perror("pthread_create");
+      break;
+    }
+  }
+  finder_main(&threads[0]);
+  for (long i = 1; i < started; i++) {
+    pthread_join(threads[i].thread, NULL);
+  }
+}
+
+// Blocks until something under the watched directories changes, then until
+// the changes have stopped for WATCH_QUIET_MS.
+static bool wait_for_changes(void) {
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  struct pollfd pfd = {.fd = inotify_fd, .events = POLLIN};
+  int timeout = -1;
+  while (1) {
+    int ready = poll(&pfd, 1, timeout);
+    if (ready == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("poll");
+      return false;
+    }
+    if (ready == 0) {
+      return true;
+    }
+    if (read(inotify_fd, buf, sizeof(buf)) == -1 && errno != EINTR) {
+      perror("read");
+      return false;
+    }
+    timeout = WATCH_QUIET_MS;
+  }
+}
+
+static int search_indexed(const char *filesdir, const char *index_path,
+                          bool watch, struct finder_thread *threads,
+                          long nthreads) {
+  // The index is keyed by the absolute path of the directory searched.
+  char root[PATH_MAX];
+  if (realpath(filesdir, root) == NULL) {
+    perror("realpath");
+    return 1;
+  }
+  collect = true;
+  root_len = strlen(filesdir);
+  if (watch) {
+    inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (inotify_fd == -1) {
+      perror("inotify_init1");
+      return 1;
+    }
+  }
+
+  do {
+    walk(filesdir, threads, nthreads);
+    size_t nentries = 0;
+    for (long i = 0; i < nthreads; i++) {
+      nentries += threads[i].nentries;
+    }
+    struct index_entry *entries =
+        malloc((nentries ? nentries : 1) * sizeof(struct index_entry));
+    if (entries == NULL) {
+      perror("malloc");
+      return 1;
+    }
+    nentries = 0;
+    for (long i = 0; i < nthreads; i++) {
+      memcpy(entries + nentries, threads[i].entries,
+             threads[i].nentries * sizeof(struct index_entry));
+      nentries += threads[i].nentries;
+      threads[i].nentries = 0;
+    }
+
+    size_t lines;
+    if (index_search(index_path, root, entries, nentries, needle, needle_len,
+                     nthreads, &lines) == -1) {
+      return 1;
+    }
+    printf("The number of files are %zu and the number of matching lines are "
+           "%zu\n",
+           nentries, lines);
+    fflush(stdout);
+    for (size_t i = 0; i < nentries; i++) {
+      free(entries[i].path);
+    }
+    free(entries);
+  } while (watch && wait_for_changes());
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  const char *index_path = NULL;
+  bool watch = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "j:x:w")) != -1) {
+    switch (opt) {
+    case 'j':
+      nthreads = strtol(optarg, NULL, 10);
+      break;
+    case 'x':
+      // Persistent index to search through and keep up to date.
+      index_path = optarg;
+      break;
+    case 'w':
+      watch = true;
+      break;
+    default:
+      fprintf(stderr,
+              "Usage: %s [-j threads] [-x index [-w]] filesdir searchstr\n",
+              argv[0]);
+      return 1;
+    }
+  }
+  if (argc - optind < 2 || (watch && index_path == NULL)) {
+    fprintf(stderr, "invalid args\n");
+    return 1;
+  }
+  const char *filesdir = argv[optind];
+  needle = argv[optind + 1];
+  needle_len = strlen(needle);
+  if (nthreads < 1) {
+    nthreads = 1;
+  } else if (nthreads > MAX_THREADS) {
+    nthreads = MAX_THREADS;
+  }
+
+  struct stat st;
+  if (stat(filesdir, &st) == -1 || !S_ISDIR(st.st_mode)) {
+    fprintf(stderr, "%s is not a valid directory\n", filesdir);
+    return 1;
+  }
+
+  struct finder_thread threads[MAX_THREADS];
+  memset(threads, 0, sizeof(threads));
+  if (index_path != NULL) {
+    return search_indexed(filesdir, index_path, watch, threads, nthreads);
+  }
+
+  walk(filesdir, threads, nthreads);
+  size_t files = 0;
+  size_t lines = 0;
+  for (long i = 0; i < nthreads; i++) {
+    files += threads[i].files;
+    lines += threads[i].lines;
+  }
+  printf("The number of files are %zu and the number of matching lines are %zu\n",
+         files, lines);
+  return 0;
+}
@@ -13,8 +13,18 @@ if [ ! -d "$FILESDIR" ]; then
 	exit 1
 fi
 
-FILES=$(find "$FILESDIR" -type f)
-COUNT_FILES=$(echo "$FILES" | wc -l)
-COUNT_LINES=$(grep "$SEARCHSTR" $FILES | wc -l)
+# Prefer the native finder built next to this script, or found on the PATH.
+FINDER="$(dirname "$0")/finder"
+if [ ! -x "$FINDER" ]; then
+	FINDER=$(command -v finder)
+fi
+if [ -n "$FINDER" ] && [ -x "$FINDER" ]; then
+	exec "$FINDER" -- "$FILESDIR" "$SEARCHSTR"
+fi
+
+# Let find pass the file names to grep, so paths with spaces and trees too
+# large for a single argument list still work.
+COUNT_FILES=$(find "$FILESDIR" -type f | wc -l)
+COUNT_LINES=$(find "$FILESDIR" -type f -exec grep -h -e "$SEARCHSTR" {} + | wc -l)
 
 echo The number of files are $COUNT_FILES and the number of matching lines are $COUNT_LINES
@@ -96,9 +96,15 @@ cd "$FINDER_APP_DIR"
 make clean
 make
 
+# The driver and its benchmark, run in the guest by aesdchar-bench.sh
+DRIVER_DIR="$FINDER_APP_DIR/../aesd-char-driver"
+make -C "$DRIVER_DIR" clean
+make -C "$DRIVER_DIR" KERNELDIR="${OUTDIR}/linux-stable" modules aesdchar-bench
+
 cd "$OUTDIR/rootfs"
-cp "$FINDER_APP_DIR/writer" home
+cp "$FINDER_APP_DIR/writer" "$FINDER_APP_DIR/finder" home
 cp "$FINDER_APP_DIR"/*.sh home
+cp "$DRIVER_DIR"/{aesdchar.ko,aesdchar_load,aesdchar_unload,aesdchar-bench,aesdchar-bench.sh} home
 cp -r "$FINDER_APP_DIR/../conf" conf
 
 sudo chown -R root:root "$OUTDIR/rootfs"
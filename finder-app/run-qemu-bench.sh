@@ -0,0 +1,87 @@
+#!/bin/bash
+# Boots the image built by manual-linux.sh with aesdchar-bench.sh as init,
+# which loads the driver, runs the benchmark and powers off, then extracts the
+# results from the serial log.
+# Usage: run-qemu-bench.sh [outdir] [baseline]
+# The results are written to ${OUTDIR}/bench-<date>.txt. Given the results of
+# an earlier run as baseline, throughput and p99 latency are compared with it.
+# BENCH_WORKLOADS, BENCH_THREADS, BENCH_OPS, BENCH_RECORD and BENCH_COMPRESS
+# are passed to the guest (see aesdchar-bench.sh); SMP sets the guest CPUs.
+
+set -e
+
+OUTDIR=${1:-/tmp/aeld}
+BASELINE=$2
+KERNEL_IMAGE=${OUTDIR}/Image
+INITRD_IMAGE=${OUTDIR}/initramfs.cpio.gz
+SERIAL_LOG=${OUTDIR}/bench-serial.log
+RESULTS=${OUTDIR}/bench-$(date +%Y%m%d-%H%M%S).txt
+
+if [ ! -e ${KERNEL_IMAGE} ]; then
+    echo "Missing kernel image at ${KERNEL_IMAGE}"
+    exit 1
+fi
+if [ ! -e ${INITRD_IMAGE} ]; then
+    echo "Missing initrd image at ${INITRD_IMAGE}"
+    exit 1
+fi
+
+# Unknown kernel parameters end up in the environment of init
+BENCH_ENV=""
+for var in BENCH_WORKLOADS BENCH_THREADS BENCH_OPS BENCH_RECORD BENCH_COMPRESS; do
+    if [ -n "${!var}" ]; then
+        BENCH_ENV="${BENCH_ENV} ${var}=${!var}"
+    fi
+done
+
+echo "Booting the kernel to run the benchmark"
+rm -f ${SERIAL_LOG}
+timeout ${BENCH_TIMEOUT:-1800} qemu-system-aarch64 \
+        -m 256M \
+        -M virt \
+        -cpu cortex-a53 \
+        -nographic \
+        -no-reboot \
+        -smp ${SMP:-1} \
+        -kernel ${KERNEL_IMAGE} \
+        -chardev stdio,id=char0,mux=on,logfile=${SERIAL_LOG},signal=off \
+        -serial chardev:char0 -mon chardev=char0 \
+        -append "rdinit=/home/aesdchar-bench.sh console=ttyAMA0${BENCH_ENV}" -initrd ${INITRD_IMAGE} \
+        < /dev/null
+
+tr -d '\r' < ${SERIAL_LOG} | grep -E '^BENCH(-BEGIN|-END)? ' > ${RESULTS} || true
+if ! grep -q '^BENCH-END rc=0' ${RESULTS}; then
+    echo "Benchmark did not complete, see ${SERIAL_LOG}"
+    exit 1
+fi
+grep '^BENCH ' ${RESULTS}
+echo "Results written to ${RESULTS}"
+
+if [ -n "${BASELINE}" ]; then
+    echo "Compared with ${BASELINE}:"
+    # Runs are matched on workload, threads, record size and compression.
+    awk '
+    function field(name,   i) {
+        for (i = 2; i <= NF; i++) {
+            if (index($i, name "=") == 1) {
+                return substr($i, length(name) + 2)
+            }
+        }
+        return ""
+    }
+    $1 != "BENCH" { next }
+    {
+        key = field("workload") " threads=" field("threads") " record=" field("record") " compress=" field("compress")
+    }
+    FNR == NR {
+        base_ops[key] = field("ops_per_sec")
+        base_p99[key] = field("p99_ns")
+        next
+    }
+    key in base_ops && base_ops[key] > 0 && base_p99[key] > 0 {
+        printf "%-40s ops/s %10s -> %10s (%+6.1f%%)  p99 %8s -> %8s ns (%+6.1f%%)\n", key,
+            base_ops[key], field("ops_per_sec"), 100 * (field("ops_per_sec") / base_ops[key] - 1),
+            base_p99[key], field("p99_ns"), 100 * (field("p99_ns") / base_p99[key] - 1)
+    }
+    ' ${BASELINE} ${RESULTS}
+fi
@@ -1,32 +1,234 @@
+/*
+ * Usage: writer [-f] [--] writefile writestr
+ *        writer -b [-z] [-f] [-j threads] [manifest]
+ *
+ * Writes writestr to writefile, replacing its contents. In bulk mode (-b)
+ * the files and their contents are read from the manifest, or from stdin if
+ * none is given, one "path<TAB>content" line per file, or with -z as pairs
+ * of NUL terminated path and content. The files are written from a small
+ * pool of I/O threads, so generating many files takes one process instead of
+ * one per file. With -f the space of every file is allocated up front with
+ * fallocate. Options must come before the operands; "--" ends them early, for a
+ * writefile that starts with '-'.
+ */
+#define _GNU_SOURCE
+#include "threadpool.h"
 #include <errno.h>
 #include <fcntl.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
 #include <unistd.h>
 
-int main(int argc, char *argv[]) {
-  if (argc < 2) {
-    syslog(LOG_ERR, "invalid args");
-    return 1;
-  }
-  char *writefile = argv[1];
-  char *writestr = argv[2];
+#define BULK_WORKERS 4
+// Files read from the manifest but not yet written.
+#define BULK_MAX_QUEUED 256
 
-  syslog(LOG_DEBUG, "Writing %s to %s", writestr, writefile);
+struct write_job {
+  char *path;
+  char *content;
+  size_t len;
+};
 
-  int fd = open(writefile, O_WRONLY | O_CREAT, 0644);
+static bool preallocate = false;
+static atomic_size_t failures;
+
+static int write_file(const char *path, const char *data, size_t len) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
   if (fd == -1) {
-    syslog(LOG_ERR, "Error opening file %s: %s", writefile, strerror(errno));
+    syslog(LOG_ERR, "Error opening file %s: %s", path, strerror(errno));
+    return -1;
+  }
+
+  // Not every file system supports this; it is only an optimization.
+  if (preallocate && len > 0 && fallocate(fd, 0, 0, len) == -1 &&
+      errno != EOPNOTSUPP) {
+    syslog(LOG_ERR, "Error allocating %zu bytes for %s: %s", len, path,
+           strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  size_t written_len = 0;
+  while (written_len < len) {
+    ssize_t n = write(fd, data + written_len, len - written_len);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      syslog(LOG_ERR, "Error writing to file %s: %s", path, strerror(errno));
+      close(fd);
+      return -1;
+    }
+    written_len += n;
+  }
+  if (close(fd) == -1) {
+    syslog(LOG_ERR, "Error closing file %s: %s", path, strerror(errno));
+    return -1;
+  }
+
+  syslog(LOG_DEBUG, "%zu bytes written to %s", written_len, path);
+  return 0;
+}
+
+static void *write_task(void *arg) {
+  struct write_job *job = arg;
+  if (write_file(job->path, job->content, job->len) == -1) {
+    atomic_fetch_add(&failures, 1);
+  }
+  free(job->path);
+  free(job);
+  return NULL;
+}
+
+// Reads the next path and content from the manifest into one allocation,
+// with `job->content` pointing into it. Returns false at the end of input.
+static bool read_job(FILE *in, bool nul_separated, struct write_job *job,
+                     size_t line) {
+  char *record = NULL;
+  size_t capacity = 0;
+  ssize_t len;
+  while (1) {
+    len = getdelim(&record, &capacity, nul_separated ? '\0' : '\n', in);
+    if (len == -1) {
+      free(record);
+      return false;
+    }
+    if (nul_separated) {
+      break;
+    }
+    if (record[len - 1] == '\n') {
+      record[--len] = '\0';
+    }
+    char *tab = strchr(record, '\t');
+    if (tab != NULL) {
+      *tab = '\0';
+      job->path = record;
+      job->content = tab + 1;
+      job->len = record + len - job->content;
+      return true;
+    }
+    if (len > 0) {
+      syslog(LOG_ERR, "Ignoring manifest line %zu without a tab", line);
+      atomic_fetch_add(&failures, 1);
+    }
+  }
+
+  // The path's terminator is part of `len`; the content follows it.
+  char *content = NULL;
+  size_t content_capacity = 0;
+  ssize_t content_len = getdelim(&content, &content_capacity, '\0', in);
+  if (content_len == -1) {
+    syslog(LOG_ERR, "Missing content for %s", record);
+    atomic_fetch_add(&failures, 1);
+    free(record);
+    free(content);
+    return false;
+  }
+  if (content_len > 0 && content[content_len - 1] == '\0') {
+    content_len--;
+  }
+  job->path = realloc(record, len + content_len + 1);
+  if (job->path == NULL) {
+    syslog(LOG_ERR, "Out of memory");
+    exit(1);
+  }
+  job->content = job->path + len;
+  memcpy(job->content, content, content_len);
+  job->content[content_len] = '\0';
+  job->len = content_len;
+  free(content);
+  return true;
+}
+
+static int write_bulk(FILE *in, bool nul_separated, size_t nworkers) {
+  struct threadpool *pool = threadpool_create(nworkers, BULK_MAX_QUEUED);
+  if (pool == NULL) {
+    syslog(LOG_ERR, "Unable to start %zu writer threads", nworkers);
     return 1;
   }
+  size_t count = 0;
+  struct write_job next;
+  while (read_job(in, nul_separated, &next, count + 1)) {
+    struct write_job *job = malloc(sizeof(struct write_job));
+    if (job == NULL) {
+      syslog(LOG_ERR, "Out of memory");
+      exit(1);
+    }
+    *job = next;
+    // Blocks while BULK_MAX_QUEUED files are pending, bounding memory use.
+    threadpool_submit_detached(pool, write_task, job);
+    count++;
+  }
+  if (ferror(in)) {
+    syslog(LOG_ERR, "Error reading manifest: %s", strerror(errno));
+    atomic_fetch_add(&failures, 1);
+  }
+  threadpool_destroy(pool);
 
-  int written_len = write(fd, writestr, strlen(writestr));
-  if (written_len == -1) {
-    syslog(LOG_ERR, "Error writing to file %s: %s", writefile, strerror(errno));
+  size_t failed = atomic_load(&failures);
+  syslog(LOG_DEBUG, "Wrote %zu files, %zu failures", count, failed);
+  return failed == 0 ? 0 : 1;
+}
+
+int main(int argc, char *argv[]) {
+  bool bulk = false;
+  bool nul_separated = false;
+  long nworkers = BULK_WORKERS;
+  int opt;
+  // "+": options end at the first operand, so writestr may start with '-'.
+  while ((opt = getopt(argc, argv, "+bzfj:")) != -1) {
+    switch (opt) {
+    case 'b':
+      bulk = true;
+      break;
+    case 'z':
+      nul_separated = true;
+      break;
+    case 'f':
+      preallocate = true;
+      break;
+    case 'j':
+      nworkers = strtol(optarg, NULL, 10);
+      break;
+    default:
+      syslog(LOG_ERR, "invalid args");
+      return 1;
+    }
+  }
+
+  if (bulk) {
+    if (nworkers < 1) {
+      syslog(LOG_ERR, "invalid thread count %ld", nworkers);
+      return 1;
+    }
+    FILE *in = stdin;
+    if (optind < argc && strcmp(argv[optind], "-") != 0) {
+      in = fopen(argv[optind], "re");
+      if (in == NULL) {
+        syslog(LOG_ERR, "Error opening manifest %s: %s", argv[optind],
+               strerror(errno));
+        return 1;
+      }
+    }
+    int status = write_bulk(in, nul_separated, nworkers);
+    if (in != stdin) {
+      fclose(in);
+    }
+    return status;
+  }
+
+  if (argc - optind < 2) {
+    syslog(LOG_ERR, "invalid args");
     return 1;
   }
+  char *writefile = argv[optind];
+  char *writestr = argv[optind + 1];
 
-  syslog(LOG_DEBUG, "%i bytes written", written_len);
+  syslog(LOG_DEBUG, "Writing %s to %s", writestr, writefile);
 
-  return 0;
+  return write_file(writefile, writestr, strlen(writestr)) == 0 ? 0 : 1;
 }
@@ -1,119 +1,866 @@
+#define _GNU_SOURCE
+#include "aesd-search.h"
 #include "aesd_ioctl.h"
-#include <arpa/inet.h>
-#include <assert.h>
+#include "listener.h"
+#include "metrics.h"
+#include "probes.h"
+#include "replication.h"
+#include "threadpool.h"
+#include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
+#include <poll.h>
 #include <pthread.h>
 #include <regex.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/queue.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #define BUF_LEN 4096
 #define DATAFILE_PATH "/dev/aesdchar"
+#define DEFAULT_IDLE_TIMEOUT_MS 60000
+#define DEFAULT_DRAIN_TIMEOUT_MS 5000
+#define DEFAULT_SEND_TIMEOUT_MS 10000
+#define DEFAULT_LISTENER "9000"
+#define MAX_LISTENER_SPECS 8
+#define MAX_SHARDS 64
+// Connections that may wait for a free worker in pooled mode; any more are
+// closed as soon as they are accepted.
+#define POOL_MAX_QUEUED 1024
+// "AESDCHAR_GREP:[first,last:]pattern\n" sends back only the records that
+// contain pattern, optionally only among write commands first to last,
+// counted from 0 and both inclusive.
+#define GREP_COMMAND "AESDCHAR_GREP:"
+// Matching records are sent in batches of up to this many bytes.
+#define GREP_BATCH_LEN (64 * 1024)
+// Bytes of device data buffered per connection. Reading from the device stops
+// once the high watermark is queued and resumes below the low watermark.
+#define OUT_QUEUE_HIGH_WATERMARK (64 * 1024)
+#define OUT_QUEUE_LOW_WATERMARK (16 * 1024)
+// How soon a timestamp tick that found device_write_lock taken is retried.
+#define TIMER_RETRY_MS 1
 
-static bool should_exit = false;
+// Where records are stored, /dev/aesdchar unless set with -D. Any other path
+// is a regular file, created if needed, which lets several instances run on
+// one host.
+static const char *datafile_path = DATAFILE_PATH;
 static int datafile_fd = -1;
-static int sock_fd = -1;
-static bool timer_started = false;
+static pthread_mutex_t datafile_lock = PTHREAD_MUTEX_INITIALIZER;
+// Held for every write to the data file, and across all the chunks of a
+// streamed line, so records never interleave.
+static pthread_mutex_t device_write_lock = PTHREAD_MUTEX_INITIALIZER;
+// Set with -R. Only then are written records logged and followers served.
+static bool serve_followers = false;
+// Longest record accepted, including its newline; longer lines are truncated
+// and the connection closed. Zero means no limit.
+static size_t max_record_len = 0;
+
+// Milliseconds a connection may sit without sending anything before it is
+// closed, and that a request has to arrive in full once it has started. Zero
+// disables the timeout between requests, but a started request still has
+// DEFAULT_IDLE_TIMEOUT_MS, since a long line holds device_write_lock.
+static int idle_timeout_ms = DEFAULT_IDLE_TIMEOUT_MS;
+// Milliseconds a client may go without accepting any sent bytes before it is
+// dropped. Zero disables the timeout.
+static int send_timeout_ms = DEFAULT_SEND_TIMEOUT_MS;
+// Readable once shutdown has started. Nothing ever reads it, so it wakes every
+// client thread that polls it.
+static int shutdown_efd = -1;
+// Written by client threads when they finish so the main loop reaps them.
+static int reap_efd = -1;
+static atomic_bool draining = false;
+// CLOCK_MONOTONIC time after which in-flight requests are abandoned. Only
+// valid once `draining` is set.
+static struct timespec drain_deadline;
+
+// Cached RFC 2822 timestamp record, with milliseconds so ticks within one
+// second can be told apart. The text only changes in the seconds and
+// milliseconds digits within a minute, so strftime only runs once per minute
+// and every other tick just patches those.
+struct timestamp_record {
+    // Wall-clock time at which the cached minute starts.
+    time_t minute_start;
+    // Offset of "SS.mmm" within `buf`.
+    size_t sec_offs;
+    size_t len;
+    char buf[128];
+    // Set while a tick waits for device_write_lock, with the time it fired.
+    bool pending;
+    struct timespec due;
+};
+
+// Per-connection ring of bytes read from the device but not yet sent.
+struct out_queue {
+    char buf[OUT_QUEUE_HIGH_WATERMARK];
+    // Offset of the first unsent byte.
+    size_t head;
+    // Number of unsent bytes.
+    size_t len;
+};
 
 struct list_entry {
     pthread_t tid;
-    bool complete;
+    int conn_fd;
+    struct client_thread_args *thread_args;
+    atomic_bool complete;
     STAILQ_ENTRY(list_entry) entries;
 };
 
 STAILQ_HEAD(list_head, list_entry);
 
+// Client threads started by any acceptor. Only the main thread reaps them.
+static struct list_head clients = STAILQ_HEAD_INITIALIZER(clients);
+static pthread_mutex_t clients_lock = PTHREAD_MUTEX_INITIALIZER;
+// Workers that run the clients when started with -p, instead of a thread per
+// connection.
+static struct threadpool *client_pool = NULL;
+
+// A set of listening sockets with its own accept loop. With SO_REUSEPORT
+// sharding every acceptor owns a separate socket per address.
+struct acceptor {
+    pthread_t tid;
+    int fds[LISTENER_MAX_FDS];
+    size_t nfds;
+};
+
 struct client_thread_args {
     int conn_fd;
     struct list_entry *entry;
 };
 
-static void signal_handler(int signum) {
-    if (signum == SIGINT) {
-        should_exit = true;
-        if (sock_fd != -1) {
-            shutdown(sock_fd, SHUT_RDWR);
-            close(sock_fd);
+// Milliseconds from now until `deadline`, clamped at zero.
+static int ms_until(const struct timespec *deadline) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long ms = (deadline->tv_sec - now.tv_sec) * 1000LL +
+                   (deadline->tv_nsec - now.tv_nsec) / 1000000;
+    return ms < 0 ? 0 : ms;
+}
+
+// Sets `deadline` to the time by which a record whose first byte arrived just
+// now must be complete: the idle timeout bounds the whole record, not each
+// read, so a client cannot keep one open by trickling bytes.
+static void start_record(struct timespec *deadline) {
+    int record_ms =
+        idle_timeout_ms > 0 ? idle_timeout_ms : DEFAULT_IDLE_TIMEOUT_MS;
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += record_ms / 1000;
+    deadline->tv_nsec += (record_ms % 1000) * 1000000L;
+    if (deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+// Waits for the client to send more data. `record_deadline` is NULL between
+// requests and the deadline set by start_record() once part of one has been
+// received: an idle connection is closed as soon as shutdown starts, unless a
+// request is already waiting in the socket, while a partial request is given
+// until the drain deadline to complete. Returns 1 when readable, 0 when the
+// connection should be abandoned and -1 on error.
+static int wait_for_client(int conn_fd,
+                           const struct timespec *record_deadline) {
+    while (1) {
+        struct pollfd fds[2];
+        fds[0].fd = conn_fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = shutdown_efd;
+        fds[1].events = POLLIN;
+        nfds_t nfds = 2;
+        int timeout = idle_timeout_ms > 0 ? idle_timeout_ms : -1;
+        if (record_deadline != NULL) {
+            timeout = ms_until(record_deadline);
+        }
+        if (atomic_load(&draining)) {
+            if (record_deadline == NULL) {
+                // Serve what arrived before shutdown, within the deadline.
+                int ready = poll(fds, 1, 0);
+                if (ready == -1 && errno != EINTR) {
+                    perror("poll");
+                    return -1;
+                }
+                return ready == 1;
+            }
+            nfds = 1;
+            int remaining = ms_until(&drain_deadline);
+            if (timeout == -1 || remaining < timeout) {
+                timeout = remaining;
+            }
+        }
+
+        int ready = poll(fds, nfds, timeout);
+        if (ready == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            return -1;
+        }
+        if (ready == 0) {
+            if (!atomic_load(&draining)) {
+                metrics_error(METRIC_ERROR_IDLE_TIMEOUT);
+            }
+            return 0;
+        }
+        if (fds[0].revents) {
+            return 1;
         }
     }
 }
 
-// Reads from the client in a loop until "\n" char is received. Heap-allocated
-// memory will grow indefinitely until then.
-ssize_t read_line(int conn_fd, char **data_out) {
-    char *data = NULL;
-    size_t capacity = 0;
+// Reads from the client until a "\n" char is received, EOF, or `max_len`
+// bytes have arrived, whichever is first. Anything after the newline is
+// dropped. `deadline` is set by start_record() when the first byte arrives.
+// Returns the length read, or -1 if the client goes idle or shutdown abandons
+// the connection before then.
+ssize_t read_line(int conn_fd, char **data_out, size_t max_len,
+                  struct timespec *deadline) {
     size_t len = 0;
+    char *data = malloc(max_len + 1);
+    *data_out = data;
+    if (data == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    data[0] = '\0';
 
-    char buf[BUF_LEN];
-    while (1) {
-        capacity += BUF_LEN;
-        data = realloc(data, capacity);
-        if (data == NULL) {
-            perror("realloc");
+    while (len < max_len) {
+        int ready = wait_for_client(conn_fd, len > 0 ? deadline : NULL);
+        if (ready != 1) {
             return -1;
         }
-        ssize_t bytes_read = read(conn_fd, buf, BUF_LEN);
+        ssize_t bytes_read = read(conn_fd, data + len, max_len - len);
+        if (bytes_read == -1 && (errno == EAGAIN || errno == EINTR)) {
+            continue;
+        }
         if (bytes_read == -1) {
-            data[0] = '\0';
-            *data_out = data;
+            metrics_error(METRIC_ERROR_CLIENT_READ);
             return -1;
         }
+        metrics_count(METRIC_BYTES_IN, bytes_read);
         if (bytes_read == 0) {
-            data[len] = '\0';
-            *data_out = data;
-            return len;
+            break;
         }
-        for (int i = 0; i < bytes_read; i++) {
-            char c = buf[i];
-            data[len] = c;
-            len++;
-            if (c == '\n') {
-                data[len] = '\0';
-                *data_out = data;
-                return len;
-            }
+        if (len == 0) {
+            start_record(deadline);
+        }
+        char *newline = memchr(data + len, '\n', bytes_read);
+        if (newline != NULL) {
+            metrics_count(METRIC_LINES_RECEIVED, 1);
+            len = newline + 1 - data;
+            break;
         }
+        len += bytes_read;
     }
+    data[len] = '\0';
+    return len;
 }
 
-// Read bytes from `in_fd` until EOF and write them to `out_fd`.
-int stream_data(int in_fd, int out_fd) {
+// Writes `len` bytes to the data file. Returns 0 on success and -1 on error.
+int write_datafile(const char *data, size_t len) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    PROBE1(device_write__start, len);
+    ssize_t bytes_written = replication_write(datafile_fd, data, len);
+    PROBE2(device_write__done, len, bytes_written);
+    if (bytes_written == -1) {
+        perror("write");
+        metrics_error(METRIC_ERROR_DEVICE_WRITE);
+        return -1;
+    }
+    metrics_observe(METRIC_DEVICE_WRITE_LATENCY, &start);
+    return 0;
+}
+
+// Writes a line too long for one read through to the data file chunk by
+// chunk as it arrives, starting with the `len` bytes at `first`, so memory
+// per connection stays at one chunk however long the line is. The driver
+// assembles the chunks into one record. device_write_lock is held until the
+// line ends so no other write lands inside it, and the whole line must
+// arrive by `deadline`, which bounds how long a slow client holds up other
+// writers. A line longer than `max_record_len` is cut short, as is one
+// abandoned midway, and terminated with a newline so the next record starts
+// clean. Returns 0 once the line is written, 1 if it was cut short and -1 on
+// error.
+static int stream_line(int conn_fd, const char *first, size_t len,
+                       const struct timespec *deadline) {
+    char buf[BUF_LEN];
+    const char *chunk = first;
+    size_t total = 0;
+    int status = 0;
+    pthread_mutex_lock(&device_write_lock);
     while (1) {
-        char data[BUF_LEN];
-        ssize_t bytes_read = read(in_fd, data, BUF_LEN);
+        bool line_end = len > 0 && chunk[len - 1] == '\n';
+        // Leave room for the newline that ends the record.
+        if (max_record_len > 0 && total + len + !line_end > max_record_len) {
+            fprintf(stderr, "record longer than %zu bytes, truncating\n",
+                    max_record_len);
+            metrics_error(METRIC_ERROR_RECORD_TOO_LONG);
+            if (total < max_record_len - 1) {
+                write_datafile(chunk, max_record_len - 1 - total);
+            }
+            total = max_record_len - 1;
+            status = 1;
+            break;
+        }
+        if (len > 0 && write_datafile(chunk, len) == -1) {
+            // The driver may hold part of the line; nothing more can be done.
+            total = 0;
+            status = -1;
+            break;
+        }
+        total += len;
+        if (line_end) {
+            break;
+        }
+
+        int ready = wait_for_client(conn_fd, deadline);
+        if (ready != 1) {
+            status = 1;
+            break;
+        }
+        ssize_t bytes_read = read(conn_fd, buf, sizeof(buf));
         if (bytes_read == -1) {
-            perror("read");
-            return -1;
+            if (errno == EAGAIN || errno == EINTR) {
+                len = 0;
+                continue;
+            }
+            metrics_error(METRIC_ERROR_CLIENT_READ);
+            status = 1;
+            break;
         }
         if (bytes_read == 0) {
-            return 0;
+            // Like a short line, the record stays open in the driver.
+            break;
+        }
+        metrics_count(METRIC_BYTES_IN, bytes_read);
+        char *newline = memchr(buf, '\n', bytes_read);
+        if (newline != NULL) {
+            metrics_count(METRIC_LINES_RECEIVED, 1);
         }
-        ssize_t bytes_written = write(out_fd, data, bytes_read);
+        chunk = buf;
+        len = newline != NULL ? (size_t)(newline + 1 - buf)
+                              : (size_t)bytes_read;
+    }
+    if (status == 1 && total > 0) {
+        write_datafile("\n", 1);
+    }
+    pthread_mutex_unlock(&device_write_lock);
+    return status;
+}
+
+// Reads from `in_fd` into the free space at the tail of `queue`. Returns the
+// number of bytes read, 0 on EOF and -1 on error.
+ssize_t out_queue_fill(struct out_queue *queue, int in_fd) {
+    size_t tail = (queue->head + queue->len) % OUT_QUEUE_HIGH_WATERMARK;
+    size_t space = OUT_QUEUE_HIGH_WATERMARK - queue->len;
+    if (space > OUT_QUEUE_HIGH_WATERMARK - tail) {
+        space = OUT_QUEUE_HIGH_WATERMARK - tail;
+    }
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    PROBE1(device_read__start, space);
+    ssize_t bytes_read = read(in_fd, queue->buf + tail, space);
+    PROBE1(device_read__done, bytes_read);
+    if (bytes_read == -1) {
+        perror("read");
+        metrics_error(METRIC_ERROR_DEVICE_READ);
+        return -1;
+    }
+    metrics_observe(METRIC_DEVICE_READ_LATENCY, &start);
+    queue->len += bytes_read;
+    return bytes_read;
+}
+
+// Sends as much of `queue` as `out_fd` accepts without blocking. Returns the
+// number of bytes sent and -1 on error.
+ssize_t out_queue_flush(struct out_queue *queue, int out_fd) {
+    size_t sent = 0;
+    while (queue->len > 0) {
+        size_t chunk = queue->len;
+        if (chunk > OUT_QUEUE_HIGH_WATERMARK - queue->head) {
+            chunk = OUT_QUEUE_HIGH_WATERMARK - queue->head;
+        }
+        PROBE2(send__start, out_fd, chunk);
+        ssize_t bytes_written =
+            send(out_fd, queue->buf + queue->head, chunk, MSG_NOSIGNAL);
+        PROBE2(send__done, out_fd, bytes_written);
+        if (bytes_written == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            perror("send");
+            metrics_error(METRIC_ERROR_SEND);
+            return -1;
+        }
+        metrics_count(METRIC_BYTES_OUT, bytes_written);
+        queue->head = (queue->head + bytes_written) % OUT_QUEUE_HIGH_WATERMARK;
+        queue->len -= bytes_written;
+        sent += bytes_written;
+    }
+    if (queue->len == 0) {
+        queue->head = 0;
+    }
+    return sent;
+}
+
+// Waits until the client can take more data. Returns 1 when writable, 0 when
+// the client has not drained anything within the send timeout and -1 on
+// error.
+int wait_writable(int conn_fd) {
+    struct pollfd pfd;
+    pfd.fd = conn_fd;
+    pfd.events = POLLOUT;
+    int timeout = send_timeout_ms > 0 ? send_timeout_ms : -1;
+    while (1) {
+        int ready = poll(&pfd, 1, timeout);
+        if (ready == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            return -1;
+        }
+        return ready;
+    }
+}
+
+// Read bytes from `in_fd` until EOF and send them to the non-blocking socket
+// `out_fd`. At most OUT_QUEUE_HIGH_WATERMARK bytes are held for a slow reader,
+// and a reader that accepts nothing for `send_timeout_ms` is dropped. `in_fd`
+// is closed as soon as EOF is reached so it is not held while draining.
+int stream_data(int in_fd, int out_fd) {
+    struct out_queue *queue = malloc(sizeof(struct out_queue));
+    if (queue == NULL) {
+        perror("malloc");
+        close(in_fd);
+        return -1;
+    }
+    queue->head = 0;
+    queue->len = 0;
+
+    int status = 0;
+    bool filling = true;
+    while (in_fd != -1 || queue->len > 0) {
+        while (in_fd != -1 && filling) {
+            ssize_t bytes_read = out_queue_fill(queue, in_fd);
+            if (bytes_read <= 0) {
+                close(in_fd);
+                in_fd = -1;
+                status = bytes_read;
+                break;
+            }
+            if (queue->len >= OUT_QUEUE_HIGH_WATERMARK) {
+                filling = false;
+            }
+        }
+
+        ssize_t sent = out_queue_flush(queue, out_fd);
+        if (sent == -1) {
+            status = -1;
+            break;
+        }
+        if (queue->len <= OUT_QUEUE_LOW_WATERMARK) {
+            filling = true;
+        }
+        if (sent > 0 || queue->len == 0) {
+            continue;
+        }
+        int ready = wait_writable(out_fd);
+        if (ready != 1) {
+            if (ready == 0) {
+                fprintf(stderr, "dropping client that stopped reading\n");
+                metrics_error(METRIC_ERROR_SEND_TIMEOUT);
+            }
+            status = -1;
+            break;
+        }
+    }
+
+    if (in_fd != -1) {
+        close(in_fd);
+    }
+    free(queue);
+    return status;
+}
+
+// Sends all of `len` bytes at `buf` to the non-blocking socket `out_fd`,
+// dropping a reader that accepts nothing for `send_timeout_ms`. Returns 0 on
+// success and -1 on error.
+int send_buffer(int out_fd, const char *buf, size_t len) {
+    while (len > 0) {
+        PROBE2(send__start, out_fd, len);
+        ssize_t bytes_written = send(out_fd, buf, len, MSG_NOSIGNAL);
+        PROBE2(send__done, out_fd, bytes_written);
         if (bytes_written == -1) {
-            perror("write");
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("send");
+                metrics_error(METRIC_ERROR_SEND);
+                return -1;
+            }
+            int ready = wait_writable(out_fd);
+            if (ready != 1) {
+                if (ready == 0) {
+                    fprintf(stderr, "dropping client that stopped reading\n");
+                    metrics_error(METRIC_ERROR_SEND_TIMEOUT);
+                }
+                return -1;
+            }
+            continue;
+        }
+        metrics_count(METRIC_BYTES_OUT, bytes_written);
+        buf += bytes_written;
+        len -= bytes_written;
+    }
+    return 0;
+}
+
+// Sends the matching records from the driver's filter ioctl, which scans
+// every record once in the kernel and copies out only the matches. Returns 0
+// on success and -1 on error, with errno ENOTTY if the driver lacks the
+// ioctl.
+int grep_device(int in_fd, int out_fd, const char *pattern,
+                size_t pattern_len, uint32_t first, uint32_t last) {
+    size_t capacity = GREP_BATCH_LEN;
+    char *buf = malloc(capacity);
+    if (buf == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    struct aesd_filter filter = {0};
+    filter.pattern = (uintptr_t)pattern;
+    filter.pattern_len = pattern_len;
+    filter.first_cmd = first;
+    filter.last_cmd = last;
+
+    int status = 0;
+    while (!filter.done) {
+        filter.out = (uintptr_t)buf;
+        filter.out_len = capacity;
+        if (ioctl(in_fd, AESDCHAR_IOCFILTER, &filter) == -1) {
+            if (errno == EMSGSIZE) {
+                // A single record is larger than the buffer.
+                char *larger = realloc(buf, filter.out_len);
+                if (larger == NULL) {
+                    perror("realloc");
+                    status = -1;
+                    break;
+                }
+                buf = larger;
+                capacity = filter.out_len;
+                continue;
+            }
+            if (errno != ENOTTY) {
+                perror("ioctl");
+                metrics_error(METRIC_ERROR_IOCTL);
+            }
+            status = -1;
+            break;
+        }
+        if (send_buffer(out_fd, buf, filter.out_len) == -1) {
+            status = -1;
+            break;
+        }
+    }
+
+    int saved_errno = errno;
+    free(buf);
+    errno = saved_errno;
+    return status;
+}
+
+// Adds the record at `rec` to `batch`, sending the batch first when the
+// record does not fit. Records larger than a batch are sent directly.
+static int grep_emit(int out_fd, char *batch, size_t *batch_len,
+                     const char *rec, size_t rec_len) {
+    if (*batch_len + rec_len > GREP_BATCH_LEN) {
+        if (send_buffer(out_fd, batch, *batch_len) == -1) {
             return -1;
         }
+        *batch_len = 0;
+    }
+    if (rec_len > GREP_BATCH_LEN) {
+        return send_buffer(out_fd, rec, rec_len);
+    }
+    memcpy(batch + *batch_len, rec, rec_len);
+    *batch_len += rec_len;
+    return 0;
+}
+
+// Offset of the first byte of write command `cmd` in the driver, or of the
+// end of the data once `cmd` is past the last one, found with
+// AESDCHAR_IOCSEEKTO on `fd`. Returns -1 with errno ENOTTY when the data file
+// is not the driver.
+static off_t record_start(int fd, uint32_t cmd) {
+    struct aesd_seekto seekto;
+    seekto.write_cmd = cmd;
+    seekto.write_cmd_offset = 0;
+    if (ioctl(fd, AESDCHAR_IOCSEEKTO, &seekto) == -1) {
+        return -1;
+    }
+    return lseek(fd, 0, SEEK_CUR);
+}
+
+// User space fallback for drivers without the filter ioctl: reads the device
+// and sends the matching records among write commands `first` to `last`,
+// counted from 0 and sent whole like the ioctl does. Where a record ends is
+// found with AESDCHAR_IOCSEEKTO, so a write command holding several lines is
+// one record. A data file that is not the driver has no write commands; as
+// aesdsocket writes one line per record, each line counts as one. Unlike the
+// ioctl the scan is not a snapshot: records written meanwhile may be missed.
+// Records inside a read chunk are searched in place; only records split
+// across chunks are copied. Returns 0 on success and -1 on error.
+int grep_stream(int in_fd, int out_fd, const struct aesd_search *search,
+                uint32_t first, uint32_t last) {
+    int index_fd = open(datafile_path, O_RDONLY);
+    if (index_fd == -1) {
+        perror("open");
+        metrics_error(METRIC_ERROR_DEVICE_OPEN);
+        return -1;
+    }
+    char *buf = malloc(BUF_LEN + GREP_BATCH_LEN);
+    if (buf == NULL) {
+        perror("malloc");
+        close(index_fd);
+        return -1;
+    }
+    char *batch = buf + BUF_LEN;
+    size_t batch_len = 0;
+    // A record split across reads, collected until its end arrives.
+    char *partial = NULL;
+    size_t partial_len = 0;
+    size_t partial_capacity = 0;
+    uint64_t index = 0;
+    int status = 0;
+
+    // Offset of buf[0] in the data, and where the current record ends, or -1
+    // to end records at every newline.
+    off_t offset = 0;
+    off_t record_end = -1;
+    off_t start = record_start(index_fd, first);
+    if (start != -1) {
+        offset = lseek(in_fd, start, SEEK_SET);
+        if (offset == -1) {
+            perror("lseek");
+            status = -1;
+            goto out;
+        }
+        index = first;
+        record_end = record_start(index_fd, first + 1);
+    }
+
+    while (index <= last) {
+        ssize_t bytes_read = read(in_fd, buf, BUF_LEN);
+        if (bytes_read == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("read");
+            metrics_error(METRIC_ERROR_DEVICE_READ);
+            status = -1;
+            break;
+        }
+        if (bytes_read == 0) {
+            break;
+        }
+        const char *pos = buf;
+        const char *end = buf + bytes_read;
+        while (pos < end && index <= last) {
+            const char *newline = memchr(pos, '\n', end - pos);
+            size_t piece = (newline != NULL ? newline + 1 : end) - pos;
+            bool rec_done =
+                newline != NULL &&
+                (record_end == -1 ||
+                 offset + (newline + 1 - buf) >= record_end);
+            if (!rec_done || partial_len > 0) {
+                if (partial_len + piece > partial_capacity) {
+                    partial_capacity = (partial_len + piece) * 2;
+                    char *larger = realloc(partial, partial_capacity);
+                    if (larger == NULL) {
+                        perror("realloc");
+                        status = -1;
+                        goto out;
+                    }
+                    partial = larger;
+                }
+                memcpy(partial + partial_len, pos, piece);
+                partial_len += piece;
+            }
+            pos += piece;
+            if (!rec_done) {
+                continue;
+            }
+
+            const char *rec = partial_len > 0 ? partial : newline + 1 - piece;
+            size_t rec_len = partial_len > 0 ? partial_len : piece;
+            if (index >= first && aesd_search_match(search, rec, rec_len) &&
+                grep_emit(out_fd, batch, &batch_len, rec, rec_len) == -1) {
+                status = -1;
+                goto out;
+            }
+            partial_len = 0;
+            index++;
+            if (record_end != -1) {
+                record_end = record_start(index_fd, index + 1);
+            }
+        }
+        offset += bytes_read;
+    }
+    // A final record without a newline.
+    if (status == 0 && partial_len > 0 && index >= first && index <= last &&
+        aesd_search_match(search, partial, partial_len) &&
+        grep_emit(out_fd, batch, &batch_len, partial, partial_len) == -1) {
+        status = -1;
     }
+    if (status == 0 && batch_len > 0) {
+        status = send_buffer(out_fd, batch, batch_len);
+    }
+
+out:
+    free(partial);
+    free(buf);
+    close(index_fd);
+    return status;
+}
+
+// Parses the optional "first,last:" prefix of the grep pattern at `*text`,
+// which ends at `end`, and advances `*text` past it. Text up to the first ':'
+// made of nothing but digits, signs, blanks and a comma is a range, and must
+// be two decimal numbers, without signs or blanks, with first <= last. Returns
+// 0 on success, with or without a range, and -1 on an invalid range.
+static int parse_grep_range(const char **text, const char *end,
+                            uint32_t *first, uint32_t *last) {
+    const char *colon = memchr(*text, ':', end - *text);
+    if (colon == NULL) {
+        return 0;
+    }
+    size_t prefix_len = strspn(*text, "0123456789,+- \t");
+    if (*text + prefix_len != colon ||
+        memchr(*text, ',', prefix_len) == NULL) {
+        return 0;
+    }
+
+    const char *comma = memchr(*text, ',', prefix_len);
+    char *num_end;
+    if (!isdigit((unsigned char)**text) || !isdigit((unsigned char)comma[1])) {
+        return -1;
+    }
+    errno = 0;
+    unsigned long range_first = strtoul(*text, &num_end, 10);
+    if (num_end != comma) {
+        return -1;
+    }
+    unsigned long range_last = strtoul(comma + 1, &num_end, 10);
+    if (num_end != colon || errno == ERANGE || range_first > UINT32_MAX ||
+        range_last > UINT32_MAX || range_first > range_last) {
+        return -1;
+    }
+    *first = range_first;
+    *last = range_last;
+    *text = colon + 1;
+    return 0;
+}
+
+// Serves a GREP_COMMAND line of `len` bytes at `command`.
+int handle_grep(int conn_fd, const char *command, size_t len) {
+    const char *pattern = command + strlen(GREP_COMMAND);
+    const char *end = command + len;
+    if (end > pattern && end[-1] == '\n') {
+        end--;
+    }
+    uint32_t first = 0;
+    uint32_t last = UINT32_MAX;
+    if (parse_grep_range(&pattern, end, &first, &last) == -1) {
+        fprintf(stderr, "invalid grep range\n");
+        return -1;
+    }
+
+    struct aesd_search search;
+    if (pattern > end ||
+        aesd_search_init(&search, pattern, end - pattern) == -1) {
+        fprintf(stderr, "invalid grep pattern\n");
+        return -1;
+    }
+    metrics_count(METRIC_GREP_COMMANDS, 1);
+
+    int data_read_fd = open(datafile_path, O_RDONLY);
+    if (data_read_fd == -1) {
+        perror("open");
+        metrics_error(METRIC_ERROR_DEVICE_OPEN);
+        return -1;
+    }
+    int status = grep_device(data_read_fd, conn_fd, pattern, end - pattern,
+                             first, last);
+    if (status == -1 && errno == ENOTTY) {
+        status = grep_stream(data_read_fd, conn_fd, &search, first, last);
+    }
+    close(data_read_fd);
+    return status;
+}
+
+// Streams recorded writes to a follower from sequence number `next_seq` on,
+// or from the oldest record if `epoch` is not this instance's, with a
+// heartbeat whenever nothing was written for a while, until the follower
+// goes away or shutdown starts. The connection holds its thread or worker for
+// as long as it lasts.
+int serve_follower(int conn_fd, uint64_t next_seq, uint64_t epoch) {
+    if (epoch != replication_epoch()) {
+        next_seq = 0;
+    }
+    char *buf = NULL;
+    size_t capacity = 0;
+    int status = 0;
+    while (!atomic_load(&draining)) {
+        replication_wait(next_seq, REPLICATION_HEARTBEAT_MS);
+        if (atomic_load(&draining)) {
+            break;
+        }
+        ssize_t len = replication_read(&next_seq, &buf, &capacity);
+        if (len == -1 || send_buffer(conn_fd, buf, len) == -1) {
+            status = -1;
+            break;
+        }
+    }
+    free(buf);
+    return status;
 }
 
 void *handle_client(void *arg) {
     struct client_thread_args *thread_args = (struct client_thread_args *)arg;
 
+    // Only the first chunk of a line is held in memory. Commands always fit
+    // in it; longer lines are streamed to the device by stream_line.
+    PROBE1(request__start, thread_args->conn_fd);
+    PROBE1(parse__start, thread_args->conn_fd);
     char *data;
-    ssize_t data_len = read_line(thread_args->conn_fd, &data);
+    struct timespec deadline;
+    ssize_t data_len =
+        read_line(thread_args->conn_fd, &data, BUF_LEN, &deadline);
+    PROBE2(parse__done, thread_args->conn_fd, data_len);
     if (data_len == -1) {
-        return arg;
+        free(data);
+        goto cleanup0;
+    }
+    bool long_line = data_len == BUF_LEN && data[data_len - 1] != '\n';
+    if (max_record_len > 0 && (size_t)data_len > max_record_len) {
+        long_line = true;
     }
 
     const char *pattern = "^AESDCHAR_IOCSEEKTO:([0-9]+),([0-9]+)";
@@ -121,18 +868,42 @@ void *handle_client(void *arg) {
     regmatch_t matches[3];
     regcomp(&regex, pattern, REG_EXTENDED);
 
-    int reg_res = regexec(&regex, data, 3, matches, 0);
-    if (reg_res != 0) {
-        ssize_t bytes_written = write(datafile_fd, data, data_len);
-        if (bytes_written == -1) {
-            perror("write");
+    int reg_res = REG_NOMATCH;
+    if (long_line) {
+        if (stream_line(thread_args->conn_fd, data, data_len, &deadline) != 0) {
+            goto cleanup1;
+        }
+    } else if (strncmp(data, GREP_COMMAND, strlen(GREP_COMMAND)) == 0) {
+        handle_grep(thread_args->conn_fd, data, data_len);
+        goto cleanup1;
+    } else if (strncmp(data, REPLICATION_COMMAND,
+                       strlen(REPLICATION_COMMAND)) == 0) {
+        if (!serve_followers) {
+            fprintf(stderr, "refusing follower, replication is not enabled\n");
             goto cleanup1;
         }
+        char *end;
+        uint64_t next_seq =
+            strtoull(data + strlen(REPLICATION_COMMAND), &end, 10);
+        uint64_t epoch = *end == ':' ? strtoull(end + 1, NULL, 10) : 0;
+        serve_follower(thread_args->conn_fd, next_seq, epoch);
+        goto cleanup1;
+    } else {
+        reg_res = regexec(&regex, data, 3, matches, 0);
+        if (reg_res != 0) {
+            pthread_mutex_lock(&device_write_lock);
+            int status = write_datafile(data, data_len);
+            pthread_mutex_unlock(&device_write_lock);
+            if (status == -1) {
+                goto cleanup1;
+            }
+        }
     }
 
-    int data_read_fd = open(DATAFILE_PATH, O_RDONLY);
+    int data_read_fd = open(datafile_path, O_RDONLY);
     if (data_read_fd == -1) {
         perror("open");
+        metrics_error(METRIC_ERROR_DEVICE_OPEN);
         goto cleanup1;
     }
 
@@ -148,102 +919,496 @@ void *handle_client(void *arg) {
         snprintf(y, len2 + 1, "%s", data + matches[2].rm_so);
         seekto.write_cmd_offset = atoi(y);
 
+        metrics_count(METRIC_SEEKTO_COMMANDS, 1);
         int status = ioctl(data_read_fd, AESDCHAR_IOCSEEKTO, &seekto);
         if (status != 0) {
             perror("ioctl");
+            metrics_error(METRIC_ERROR_IOCTL);
         }
     }
 
-    int status = stream_data(data_read_fd, thread_args->conn_fd);
-    if (status == -1) {
-        goto cleanup1;
-    }
-
-    status = close(thread_args->conn_fd);
-    if (status == -1) {
-        perror("close");
-    }
+    stream_data(data_read_fd, thread_args->conn_fd);
 
 cleanup1:
     free(data);
     regfree(&regex);
-    thread_args->entry->complete = true;
+cleanup0:
+    // Let the client see EOF now. The fd itself is closed by the main loop
+    // after joining, so it cannot be reused while shutdown may still touch it.
+    shutdown(thread_args->conn_fd, SHUT_RDWR);
+    PROBE1(request__done, thread_args->conn_fd);
+    metrics_count(METRIC_CONNECTIONS_CLOSED, 1);
+    atomic_store(&thread_args->entry->complete, true);
+    uint64_t one = 1;
+    if (write(reap_efd, &one, sizeof(one)) == -1) {
+        perror("write");
+    }
     return arg;
 }
 
-// Every 10 seconds, write a RFC 2822 timestamp to the data file.
-void *timed_writer(void *arg) {
-    sleep(10);
-    time_t now = time(NULL);
-    struct tm local_tm;
-    localtime_r(&now, &local_tm);
-
-    char t_buf[128];
-    size_t t_len =
-        strftime(t_buf, sizeof(t_buf), "%a, %d %b %Y %H:%M:%S %z", &local_tm);
-    if (!t_len) {
-        perror("strftime");
-        return NULL;
+// Opens the data file for writing the first time it is needed.
+int open_datafile() {
+    int status = 0;
+    pthread_mutex_lock(&datafile_lock);
+    if (datafile_fd != -1) {
+        goto out;
     }
-
-    ssize_t bytes_written =
-        write(datafile_fd, "timestamp:", sizeof("timestamp:"));
-    if (bytes_written == -1) {
-        perror("write");
-        goto cleanup;
+    int flags = O_WRONLY | O_CLOEXEC;
+    if (strcmp(datafile_path, DATAFILE_PATH) != 0) {
+        flags |= O_CREAT | O_APPEND;
     }
-    bytes_written = write(datafile_fd, t_buf, t_len);
-    if (bytes_written == -1) {
-        perror("write");
-        goto cleanup;
+    int fd = open(datafile_path, flags, 0644);
+    if (fd == -1) {
+        perror("open");
+        metrics_error(METRIC_ERROR_DEVICE_OPEN);
+        status = -1;
+        goto out;
     }
-    bytes_written = write(datafile_fd, "\n", 1);
-    if (bytes_written == -1) {
-        perror("write");
+
+    struct stat st;
+    status = fstat(fd, &st);
+    if (status == -1) {
+        perror("fstat");
+        close(fd);
+        goto out;
     }
 
-cleanup:
-    return NULL;
+    if (!S_ISCHR(st.st_mode) && !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "%s is not a device or regular file\n", datafile_path);
+        close(fd);
+        status = -1;
+        goto out;
+    }
+    datafile_fd = fd;
+
+out:
+    pthread_mutex_unlock(&datafile_lock);
+    return status;
 }
 
-int start_timer_thread() {
-    if (timer_started) {
+// Writes the seconds `sec` and milliseconds of `nsec` as "SS.mmm" into the
+// cached text of `rec`.
+static void patch_timestamp(struct timestamp_record *rec, int sec, long nsec) {
+    char *digits = rec->buf + rec->sec_offs;
+    int ms = nsec / 1000000;
+    digits[0] = '0' + sec / 10;
+    digits[1] = '0' + sec % 10;
+    digits[2] = '.';
+    digits[3] = '0' + ms / 100;
+    digits[4] = '0' + ms / 10 % 10;
+    digits[5] = '0' + ms % 10;
+}
+
+// Formats `now` into `rec`, reusing the cached text when `now` falls within
+// the minute that was last formatted.
+int format_timestamp(struct timestamp_record *rec, const struct timespec *now) {
+    time_t sec = now->tv_sec - rec->minute_start;
+    if (rec->len != 0 && sec >= 0 && sec < 60) {
+        patch_timestamp(rec, sec, now->tv_nsec);
         return 0;
     }
-    pthread_t tid;
-    int status = pthread_create(&tid, NULL, timed_writer, NULL);
-    if (status != 0) {
-        perror("pthread_create");
+
+    struct tm local_tm;
+    localtime_r(&now->tv_sec, &local_tm);
+    size_t prefix_len =
+        strftime(rec->buf, sizeof(rec->buf), "timestamp:%a, %d %b %Y %H:%M:",
+                 &local_tm);
+    if (!prefix_len) {
+        perror("strftime");
         return -1;
     }
-    status = pthread_detach(tid);
-    if (status != 0) {
-        perror("pthread_detach");
+    rec->sec_offs = prefix_len;
+    size_t suffix_len = strftime(rec->buf + prefix_len + 6,
+                                 sizeof(rec->buf) - prefix_len - 6, " %z\n",
+                                 &local_tm);
+    if (!suffix_len) {
+        perror("strftime");
         return -1;
     }
-    timer_started = true;
+    rec->len = prefix_len + 6 + suffix_len;
+    rec->minute_start = now->tv_sec - local_tm.tm_sec;
+    patch_timestamp(rec, local_tm.tm_sec, now->tv_nsec);
     return 0;
 }
 
-int main(int argc, char *argv[]) {
-    struct sigaction sa;
-    sa.sa_handler = signal_handler;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = 0;
-    int status = sigaction(SIGINT, &sa, NULL);
+// Creates a periodic timer firing every `period_ms` milliseconds. The kernel
+// schedules each expiration relative to the previous one, so the period does
+// not drift with the time spent handling a tick.
+int start_timer(long period_ms) {
+    int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd == -1) {
+        perror("timerfd_create");
+        return -1;
+    }
+    struct itimerspec spec;
+    spec.it_interval.tv_sec = period_ms / 1000;
+    spec.it_interval.tv_nsec = (period_ms % 1000) * 1000000;
+    spec.it_value = spec.it_interval;
+    int status = timerfd_settime(timer_fd, 0, &spec, NULL);
     if (status == -1) {
-        perror("sigaction");
+        perror("timerfd_settime");
+        close(timer_fd);
+        return -1;
+    }
+    return timer_fd;
+}
+
+// Write a timestamp record to the data file when the timer has expired, and
+// retry a tick still pending. Ticks that were missed while the loop was busy
+// are coalesced into one record, and counted as dropped.
+int handle_timer(int timer_fd, struct timestamp_record *rec) {
+    uint64_t expirations;
+    ssize_t bytes_read = read(timer_fd, &expirations, sizeof(expirations));
+    if (bytes_read == -1) {
+        if (errno != EAGAIN) {
+            perror("read");
+            return -1;
+        }
+    } else {
+        // A newer tick replaces one that is still waiting for the lock.
+        uint64_t dropped = expirations - 1 + rec->pending;
+        for (uint64_t i = 0; i < dropped; i++) {
+            metrics_error(METRIC_ERROR_TIMESTAMP_DROPPED);
+        }
+        clock_gettime(CLOCK_REALTIME, &rec->due);
+        rec->pending = true;
+    }
+    if (!rec->pending) {
+        return 0;
+    }
+
+    if (format_timestamp(rec, &rec->due) == -1 || open_datafile() == -1) {
+        rec->pending = false;
+        metrics_error(METRIC_ERROR_TIMESTAMP_DROPPED);
         return -1;
     }
 
+    // A single write keeps the record from interleaving with client writes.
+    // While a long line is being streamed the tick stays pending rather than
+    // blocking the main loop, which retries it every TIMER_RETRY_MS with the
+    // time it fired.
+    if (pthread_mutex_trylock(&device_write_lock) != 0) {
+        return 0;
+    }
+    rec->pending = false;
+    int status = write_datafile(rec->buf, rec->len);
+    pthread_mutex_unlock(&device_write_lock);
+    return status;
+}
+
+// Joins a finished client thread and releases everything it owned. Pooled
+// clients have no thread to join; the handler is done with its arguments once
+// it has marked the entry complete.
+void reap_client(struct list_entry *node) {
+    if (client_pool == NULL) {
+        int thread_status = pthread_join(node->tid, NULL);
+        if (thread_status != 0) {
+            perror("pthread_join");
+        }
+    }
+    close(node->conn_fd);
+    free(node->thread_args);
+    free(node);
+}
+
+// Joins any completed threads, taking them off the list one at a time so the
+// lock is never held across a join.
+void reap_completed() {
+    while (1) {
+        struct list_entry *node;
+        pthread_mutex_lock(&clients_lock);
+        STAILQ_FOREACH(node, &clients, entries) {
+            if (atomic_load(&node->complete)) {
+                STAILQ_REMOVE(&clients, node, list_entry, entries);
+                break;
+            }
+        }
+        pthread_mutex_unlock(&clients_lock);
+        if (node == NULL) {
+            return;
+        }
+        reap_client(node);
+    }
+}
+
+bool clients_empty() {
+    pthread_mutex_lock(&clients_lock);
+    bool empty = STAILQ_EMPTY(&clients);
+    pthread_mutex_unlock(&clients_lock);
+    return empty;
+}
+
+// Accepts a connection on `listen_fd` and starts a thread, or queues a pool
+// task, to handle it.
+void accept_client(int listen_fd) {
+    struct sockaddr_storage client_addr;
+    socklen_t client_addr_len = sizeof(client_addr);
+    int conn_fd = accept4(listen_fd, (struct sockaddr *)&client_addr,
+                          &client_addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (conn_fd == -1) {
+        // Another shard may have taken the connection first.
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            perror("accept");
+            metrics_error(METRIC_ERROR_ACCEPT);
+        }
+        return;
+    }
+    metrics_count(METRIC_CONNECTIONS_ACCEPTED, 1);
+
+    char peer[NI_MAXHOST];
+    listener_peer_name(&client_addr, client_addr_len, peer, sizeof(peer));
+    printf("Accepted connection from %s\n", peer);
+
+    struct list_entry *entry = NULL;
+    struct client_thread_args *thread_args = NULL;
+    if (open_datafile() == -1) {
+        goto fail;
+    }
+
+    entry = malloc(sizeof(struct list_entry));
+    thread_args = malloc(sizeof(struct client_thread_args));
+    if (!entry || !thread_args) {
+        perror("malloc");
+        goto fail;
+    }
+    entry->conn_fd = conn_fd;
+    entry->thread_args = thread_args;
+    atomic_init(&entry->complete, false);
+    thread_args->entry = entry;
+    thread_args->conn_fd = conn_fd;
+
+    // Insert before starting the handler so the entry is on the list by the
+    // time the handler can mark it complete.
+    pthread_mutex_lock(&clients_lock);
+    if (client_pool == NULL) {
+        int status =
+            pthread_create(&entry->tid, NULL, handle_client, thread_args);
+        if (status == 0) {
+            STAILQ_INSERT_TAIL(&clients, entry, entries);
+        }
+        pthread_mutex_unlock(&clients_lock);
+        if (status != 0) {
+            errno = status;
+            perror("pthread_create");
+            goto fail;
+        }
+        return;
+    }
+    STAILQ_INSERT_TAIL(&clients, entry, entries);
+    pthread_mutex_unlock(&clients_lock);
+
+    // Submitted without the lock, and without waiting for a free slot, so a
+    // full pool never stalls the accept loop or the drain.
+    if (!threadpool_try_submit_detached(client_pool, handle_client,
+                                        thread_args)) {
+        if (errno == EAGAIN) {
+            fprintf(stderr, "all workers busy, closing connection from %s\n",
+                    peer);
+            metrics_error(METRIC_ERROR_POOL_FULL);
+        } else {
+            perror("threadpool_submit");
+        }
+        pthread_mutex_lock(&clients_lock);
+        STAILQ_REMOVE(&clients, entry, list_entry, entries);
+        pthread_mutex_unlock(&clients_lock);
+        goto fail;
+    }
+    return;
+
+fail:
+    // Every accepted connection is counted as closed exactly once, by its
+    // handler or here, so the difference stays the number still open.
+    metrics_count(METRIC_CONNECTIONS_CLOSED, 1);
+    free(entry);
+    free(thread_args);
+    close(conn_fd);
+}
+
+// Accept loop of the extra SO_REUSEPORT shards. Runs until shutdown starts.
+void *acceptor_main(void *arg) {
+    struct acceptor *acceptor = arg;
+    struct pollfd fds[LISTENER_MAX_FDS + 1];
+    for (size_t i = 0; i < acceptor->nfds; i++) {
+        fds[i].fd = acceptor->fds[i];
+        fds[i].events = POLLIN;
+    }
+    fds[acceptor->nfds].fd = shutdown_efd;
+    fds[acceptor->nfds].events = POLLIN;
+
+    while (!atomic_load(&draining)) {
+        int ready = poll(fds, acceptor->nfds + 1, -1);
+        if (ready == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            break;
+        }
+        for (size_t i = 0; i < acceptor->nfds; i++) {
+            if (fds[i].revents & POLLIN) {
+                accept_client(fds[i].fd);
+            }
+        }
+    }
+    return NULL;
+}
+
+// Opens `acceptor`'s sockets for every spec. Unix-domain sockets cannot be
+// sharded, so only the first acceptor (`primary`) opens them.
+int acceptor_open(struct acceptor *acceptor, const char **specs,
+                  size_t nspecs, bool reuseport, bool primary) {
+    acceptor->nfds = 0;
+    for (size_t i = 0; i < nspecs; i++) {
+        if (!primary && listener_is_unix(specs[i])) {
+            continue;
+        }
+        int count =
+            listener_open(specs[i], reuseport, acceptor->fds + acceptor->nfds,
+                          LISTENER_MAX_FDS - acceptor->nfds);
+        if (count == -1) {
+            return -1;
+        }
+        acceptor->nfds += count;
+    }
+    return 0;
+}
+
+void acceptor_close(struct acceptor *acceptor) {
+    for (size_t i = 0; i < acceptor->nfds; i++) {
+        close(acceptor->fds[i]);
+    }
+    acceptor->nfds = 0;
+}
+
+// Stops accepting and lets client threads finish within `drain_ms`. Idle
+// connections and the acceptor shards are woken through `shutdown_efd`.
+void start_drain(int drain_ms) {
+    clock_gettime(CLOCK_MONOTONIC, &drain_deadline);
+    drain_deadline.tv_sec += drain_ms / 1000;
+    drain_deadline.tv_nsec += (drain_ms % 1000) * 1000000L;
+    if (drain_deadline.tv_nsec >= 1000000000L) {
+        drain_deadline.tv_sec++;
+        drain_deadline.tv_nsec -= 1000000000L;
+    }
+    atomic_store(&draining, true);
+    replication_stop();
+
+    uint64_t one = 1;
+    if (write(shutdown_efd, &one, sizeof(one)) == -1) {
+        perror("write");
+    }
+}
+
+int main(int argc, char *argv[]) {
     int opt;
     bool daemonize = false;
-    while ((opt = getopt(argc, argv, "d")) != -1) {
+    long timer_period_ms = 0;
+    int drain_ms = DEFAULT_DRAIN_TIMEOUT_MS;
+    const char *metrics_spec = NULL;
+    const char *listener_specs[MAX_LISTENER_SPECS];
+    size_t nlisteners = 0;
+    int nshards = 1;
+    int nworkers = 0;
+    const char *primary_spec = NULL;
+    while ((opt = getopt(argc, argv, "dt:i:g:s:m:l:r:p:F:RD:M:")) != -1) {
         switch (opt) {
         case 'd':
             daemonize = true;
+            break;
+        case 't':
+            // Period in milliseconds of the timestamp writer, off by default.
+            timer_period_ms = strtol(optarg, NULL, 10);
+            if (timer_period_ms <= 0) {
+                fprintf(stderr, "invalid timer period: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'i':
+            idle_timeout_ms = atoi(optarg);
+            break;
+        case 'm':
+            // Port on the loopback address, or Unix socket path, to serve
+            // metrics on.
+            metrics_spec = optarg;
+            break;
+        case 's':
+            send_timeout_ms = atoi(optarg);
+            break;
+        case 'g':
+            // Grace period in milliseconds given to in-flight requests on
+            // SIGINT/SIGTERM.
+            drain_ms = atoi(optarg);
+            break;
+        case 'l':
+            // Address to listen on, may be repeated. See listener_open.
+            if (nlisteners == MAX_LISTENER_SPECS) {
+                fprintf(stderr, "too many listeners\n");
+                return -1;
+            }
+            listener_specs[nlisteners++] = optarg;
+            break;
+        case 'r':
+            // Number of SO_REUSEPORT accept shards, each with its own thread
+            // and sockets.
+            nshards = atoi(optarg);
+            if (nshards < 1 || nshards > MAX_SHARDS) {
+                fprintf(stderr, "invalid shard count: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'p':
+            // Serve clients on a pool of this many workers rather than a
+            // thread per connection.
+            nworkers = atoi(optarg);
+            if (nworkers < 1) {
+                fprintf(stderr, "invalid worker count: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'F':
+            // Follow the primary at host:port, applying its records locally.
+            primary_spec = optarg;
+            break;
+        case 'R':
+            // Keep a log of recent records and serve followers from it.
+            serve_followers = true;
+            replication_enable();
+            break;
+        case 'D':
+            datafile_path = optarg;
+            break;
+        case 'M':
+            max_record_len = strtoull(optarg, NULL, 10);
+            if (max_record_len == 1) {
+                fprintf(stderr, "invalid maximum record size: %s\n", optarg);
+                return -1;
+            }
+            break;
+        default:
+            fprintf(stderr,
+                    "Usage: %s [-d] [-t period_ms] [-i idle_ms] [-s send_ms] "
+                    "[-g drain_ms] [-m port|path] [-l listener]... "
+                    "[-r shards] [-p workers] [-F primary] [-R] [-D path] "
+                    "[-M max_record]\n",
+                    argv[0]);
+            return -1;
         }
     }
+    if (nlisteners == 0) {
+        listener_specs[nlisteners++] = DEFAULT_LISTENER;
+    }
+
+    // Signals are consumed through a signalfd in the main loop. Blocking them
+    // here, before any thread exists, makes every thread inherit the mask.
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    int status = pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    if (status != 0) {
+        perror("pthread_sigmask");
+        return -1;
+    }
 
     if (daemonize) {
         pid_t pid = fork();
@@ -256,129 +1421,195 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    sock_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock_fd == -1) {
-        perror("socket");
+    int signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd == -1) {
+        perror("signalfd");
         return -1;
     }
-
-    int opt_val = 1;
-    if (setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, &opt_val,
-                   sizeof(opt_val)) == -1) {
-        perror("setsockopt");
+    shutdown_efd = eventfd(0, EFD_CLOEXEC);
+    reap_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (shutdown_efd == -1 || reap_efd == -1) {
+        perror("eventfd");
         return -1;
     }
-    struct addrinfo hints;
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_flags = AI_PASSIVE;
-    struct addrinfo *servinfo;
-    status = getaddrinfo(NULL, "9000", &hints, &servinfo);
-    if (status != 0) {
-        perror("getaddrinfo");
-        return -1;
+
+    // The main thread accepts on the first shard's sockets itself.
+    bool reuseport = nshards > 1;
+    struct acceptor shards[MAX_SHARDS];
+    for (int i = 0; i < nshards; i++) {
+        status = acceptor_open(&shards[i], listener_specs, nlisteners,
+                               reuseport, i == 0);
+        if (status == -1) {
+            return -1;
+        }
+        // Sockets are non-blocking so a shard that loses the race for a
+        // connection does not block in accept.
+        for (size_t j = 0; j < shards[i].nfds; j++) {
+            fcntl(shards[i].fds[j], F_SETFL, O_NONBLOCK);
+        }
     }
-    status = bind(sock_fd, servinfo->ai_addr, servinfo->ai_addrlen);
-    if (status == -1) {
-        perror("bind");
-        return -1;
+
+    int metrics_fd = -1;
+    if (metrics_spec != NULL) {
+        metrics_fd = metrics_listen(metrics_spec);
+        if (metrics_fd == -1 || metrics_start(metrics_fd) == -1) {
+            return -1;
+        }
     }
-    status = listen(sock_fd, 50);
-    if (status == -1) {
-        perror("listen");
+
+    int timer_fd = -1;
+    if (timer_period_ms > 0) {
+        timer_fd = start_timer(timer_period_ms);
+        if (timer_fd == -1) {
+            return -1;
+        }
+    }
+    struct timestamp_record timestamp = {0};
+
+    // Created after daemonizing, since the workers would not survive the fork.
+    if (nworkers > 0) {
+        client_pool = threadpool_create(nworkers, POOL_MAX_QUEUED);
+        if (client_pool == NULL) {
+            fprintf(stderr, "could not create a pool of %d workers\n",
+                    nworkers);
+            return -1;
+        }
+    }
+
+    // The follower appends to the data file opened here, which creates it.
+    if (primary_spec != NULL &&
+        (open_datafile() == -1 ||
+         replication_follow_start(primary_spec, datafile_path,
+                                  &device_write_lock) == -1)) {
         return -1;
     }
 
-    freeaddrinfo(servinfo);
+    for (int i = 1; i < nshards; i++) {
+        status = pthread_create(&shards[i].tid, NULL, acceptor_main, &shards[i]);
+        if (status != 0) {
+            perror("pthread_create");
+            return -1;
+        }
+    }
 
-    struct list_head head = STAILQ_HEAD_INITIALIZER(head);
-    STAILQ_INIT(&head);
+    enum { POLL_SIGNAL, POLL_REAP, POLL_TIMER, POLL_LISTEN };
+    struct pollfd fds[POLL_LISTEN + LISTENER_MAX_FDS];
+    nfds_t nfds = POLL_LISTEN + shards[0].nfds;
+    fds[POLL_SIGNAL].fd = signal_fd;
+    fds[POLL_SIGNAL].events = POLLIN;
+    fds[POLL_REAP].fd = reap_efd;
+    fds[POLL_REAP].events = POLLIN;
+    // Negative fds are ignored by poll, which disables the timer slot.
+    fds[POLL_TIMER].fd = timer_fd;
+    fds[POLL_TIMER].events = POLLIN;
+    for (size_t i = 0; i < shards[0].nfds; i++) {
+        fds[POLL_LISTEN + i].fd = shards[0].fds[i];
+        fds[POLL_LISTEN + i].events = POLLIN;
+    }
 
-    while (!should_exit) {
-        struct sockaddr client_addr;
-        socklen_t client_addr_len = sizeof(struct sockaddr);
-        int conn_fd = accept(sock_fd, &client_addr, &client_addr_len);
-        if (conn_fd == -1) {
-            perror("accept");
+    while (1) {
+        bool is_draining = atomic_load(&draining);
+        if (is_draining && clients_empty()) {
             break;
         }
+        int timeout = is_draining ? ms_until(&drain_deadline) : -1;
+        if (is_draining && timeout == 0) {
+            break;
+        }
+        bool timer_pending = fds[POLL_TIMER].fd != -1 && timestamp.pending;
+        if (timer_pending && (timeout == -1 || timeout > TIMER_RETRY_MS)) {
+            timeout = TIMER_RETRY_MS;
+        }
 
-        char ip_str[INET_ADDRSTRLEN];
-        inet_ntop(AF_INET, &(client_addr.sa_data), ip_str, sizeof(ip_str));
-        printf("Accepted connection from %s\n", ip_str);
-
-        if (datafile_fd == -1) {
-            datafile_fd = open(DATAFILE_PATH, O_WRONLY);
-            if (datafile_fd == -1) {
-                perror("open");
-                return -1;
+        int ready = poll(fds, nfds, timeout);
+        if (ready == -1) {
+            if (errno == EINTR) {
+                continue;
             }
+            perror("poll");
+            break;
+        }
 
-            struct stat st;
-            status = fstat(datafile_fd, &st);
-            if (status == -1) {
-                perror("fstat");
-                return -1;
+        if (fds[POLL_SIGNAL].revents & POLLIN) {
+            struct signalfd_siginfo info;
+            if (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+                if (is_draining) {
+                    // A second signal skips the rest of the drain.
+                    break;
+                }
+                printf("Caught signal %u, draining connections\n",
+                       info.ssi_signo);
+                start_drain(drain_ms);
+                fds[POLL_TIMER].fd = -1;
+                nfds = POLL_LISTEN;
+                acceptor_close(&shards[0]);
+                continue;
             }
-
-            // Assert that the datafile is a character device file.
-            assert(S_ISCHR(st.st_mode));
         }
-
-        struct list_entry *entry = malloc(sizeof(struct list_entry));
-        if (!entry) {
-            perror("malloc");
+        if (fds[POLL_REAP].revents & POLLIN) {
+            uint64_t count;
+            if (read(reap_efd, &count, sizeof(count)) == -1) {
+                perror("read");
+            }
+            reap_completed();
         }
-        entry->complete = false;
-        struct client_thread_args *thread_args =
-            malloc(sizeof(struct client_thread_args));
-        thread_args->entry = entry;
-        thread_args->conn_fd = conn_fd;
-        status = pthread_create(&entry->tid, NULL, handle_client, thread_args);
-        if (status != 0) {
-            perror("pthread_create");
+        if ((fds[POLL_TIMER].revents & POLLIN) || timer_pending) {
+            handle_timer(timer_fd, &timestamp);
         }
-        STAILQ_INSERT_TAIL(&head, entry, entries);
-
-        // This loop cleans up any completed threads. The looping is weird b/c
-        // removing an element mid-loop invalidates the iterator. So, we break
-        // the inner loop and start it over if we remove anything.
-        bool thread_joined;
-        do {
-            thread_joined = false;
-            struct list_entry *node;
-            STAILQ_FOREACH(node, &head, entries) {
-                if (node->complete) {
-                    struct client_thread_args *thread_args = NULL;
-                    int thread_status =
-                        pthread_join(node->tid, (void *)thread_args);
-                    if (thread_status != 0) {
-                        perror("pthread_join");
-                    }
-                    thread_joined = true;
-                    STAILQ_REMOVE(&head, node, list_entry, entries);
-                    free(node);
-                    free(thread_args);
-                    break;
-                }
+        for (nfds_t i = POLL_LISTEN; i < nfds; i++) {
+            if (fds[i].revents & POLLIN) {
+                accept_client(fds[i].fd);
             }
-        } while (thread_joined);
+        }
     }
 
-    // Final cleanup of any remaining threads.
+    if (!atomic_load(&draining)) {
+        start_drain(0);
+    }
+    acceptor_close(&shards[0]);
+    for (int i = 1; i < nshards; i++) {
+        pthread_join(shards[i].tid, NULL);
+        acceptor_close(&shards[i]);
+    }
+    for (size_t i = 0; i < nlisteners; i++) {
+        listener_cleanup(listener_specs[i]);
+    }
+
+    // Final cleanup of any remaining threads. Whatever is still running has
+    // missed the drain deadline, so its socket is shut down to unblock it.
     struct list_entry *node;
-    while (!STAILQ_EMPTY(&head)) {
-        node = STAILQ_FIRST(&head);
-        STAILQ_REMOVE_HEAD(&head, entries);
-        struct client_thread_args *thread_args = NULL;
-        int thread_status = pthread_join(node->tid, (void *)thread_args);
-        if (thread_status != 0) {
-            perror("pthread_join");
+    STAILQ_FOREACH(node, &clients, entries) {
+        if (!atomic_load(&node->complete)) {
+            shutdown(node->conn_fd, SHUT_RDWR);
         }
-        free(node);
-        free(thread_args);
+    }
+    // Queued pool tasks still run, but see the shut down socket and return at
+    // once. Destroying the pool waits for them before the entries are freed.
+    if (client_pool != NULL) {
+        threadpool_destroy(client_pool);
+    }
+    while (!STAILQ_EMPTY(&clients)) {
+        node = STAILQ_FIRST(&clients);
+        STAILQ_REMOVE_HEAD(&clients, entries);
+        reap_client(node);
     }
 
+    if (timer_fd != -1) {
+        close(timer_fd);
+    }
+    if (metrics_fd != -1) {
+        metrics_stop();
+        close(metrics_fd);
+        if (metrics_spec[0] == '/') {
+            unlink(metrics_spec);
+        }
+    }
+    replication_follow_stop();
+    if (datafile_fd != -1) {
+        close(datafile_fd);
+    }
+    close(signal_fd);
+    close(shutdown_efd);
+    close(reap_efd);
     return 0;
 }
@@ -0,0 +1,208 @@
+#include "listener.h"
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define UNIX_PREFIX "unix:"
+#define LISTEN_BACKLOG 50
+
+bool listener_is_unix(const char *spec) {
+    return strncmp(spec, UNIX_PREFIX, strlen(UNIX_PREFIX)) == 0;
+}
+
+void listener_cleanup(const char *spec) {
+    if (listener_is_unix(spec)) {
+        unlink(spec + strlen(UNIX_PREFIX));
+    }
+}
+
+int listener_remove_stale(const char *path) {
+    struct stat st;
+    if (lstat(path, &st) == -1) {
+        // Nothing there, or bind() reports why it cannot be reached.
+        return 0;
+    }
+    if (!S_ISSOCK(st.st_mode)) {
+        fprintf(stderr, "%s exists and is not a socket\n", path);
+        errno = EADDRINUSE;
+        return -1;
+    }
+    unlink(path);
+    return 0;
+}
+
+static int open_unix(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        perror("socket");
+        return -1;
+    }
+    if (listener_remove_stale(path) == -1) {
+        close(fd);
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        perror("bind");
+        close(fd);
+        return -1;
+    }
+    if (listen(fd, LISTEN_BACKLOG) == -1) {
+        perror("listen");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Returns the socket, or -1 with errno set by the call that failed.
+static int open_inet(const struct addrinfo *ai, bool reuseport) {
+    const char *failed_call = "socket";
+    int saved_errno;
+    int fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+                    ai->ai_protocol);
+    if (fd == -1) {
+        goto fail;
+    }
+
+    int opt_val = 1;
+    failed_call = "setsockopt";
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt_val, sizeof(opt_val)) ==
+        -1) {
+        goto fail;
+    }
+    if (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt_val,
+                                sizeof(opt_val)) == -1) {
+        goto fail;
+    }
+    // The IPv4 wildcard gets its own socket, so keep the IPv6 one from also
+    // claiming v4-mapped addresses.
+    if (ai->ai_family == AF_INET6 &&
+        setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &opt_val,
+                   sizeof(opt_val)) == -1) {
+        goto fail;
+    }
+    failed_call = "bind";
+    if (bind(fd, ai->ai_addr, ai->ai_addrlen) == -1) {
+        goto fail;
+    }
+    failed_call = "listen";
+    if (listen(fd, LISTEN_BACKLOG) == -1) {
+        goto fail;
+    }
+    return fd;
+
+fail:
+    // perror() may itself change errno.
+    saved_errno = errno;
+    perror(failed_call);
+    if (fd != -1) {
+        close(fd);
+    }
+    errno = saved_errno;
+    return -1;
+}
+
+int listener_open(const char *spec, bool reuseport, int *fds, size_t max_fds) {
+    if (listener_is_unix(spec)) {
+        if (max_fds < 1) {
+            fprintf(stderr, "too many listeners\n");
+            return -1;
+        }
+        fds[0] = open_unix(spec + strlen(UNIX_PREFIX));
+        return fds[0] == -1 ? -1 : 1;
+    }
+
+    char host[256];
+    const char *port;
+    const char *sep = strrchr(spec, ':');
+    if (sep == NULL) {
+        host[0] = '\0';
+        port = spec;
+    } else {
+        const char *start = spec;
+        const char *end = sep;
+        if (*start == '[' && end > start && end[-1] == ']') {
+            start++;
+            end--;
+        }
+        if ((size_t)(end - start) >= sizeof(host)) {
+            fprintf(stderr, "invalid listener: %s\n", spec);
+            return -1;
+        }
+        memcpy(host, start, end - start);
+        host[end - start] = '\0';
+        port = sep + 1;
+    }
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    // Only the families the host has an address for, so a host without IPv6
+    // does not get an IPv6 wildcard it cannot bind.
+    hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG;
+    struct addrinfo *servinfo;
+    int status = getaddrinfo(host[0] ? host : NULL, port, &hints, &servinfo);
+    if (status != 0) {
+        fprintf(stderr, "getaddrinfo %s: %s\n", spec, gai_strerror(status));
+        return -1;
+    }
+
+    int count = 0;
+    for (struct addrinfo *ai = servinfo; ai != NULL; ai = ai->ai_next) {
+        if ((size_t)count >= max_fds) {
+            fprintf(stderr, "too many listeners\n");
+            goto fail;
+        }
+        int fd = open_inet(ai, reuseport);
+        if (fd == -1) {
+            // A family the kernel has disabled is skipped, as long as another
+            // one works.
+            if (errno == EAFNOSUPPORT || errno == EADDRNOTAVAIL) {
+                continue;
+            }
+            goto fail;
+        }
+        fds[count++] = fd;
+    }
+    if (count == 0) {
+        fprintf(stderr, "no usable address for listener %s\n", spec);
+        goto fail;
+    }
+    freeaddrinfo(servinfo);
+    return count;
+
+fail:
+    while (count > 0) {
+        close(fds[--count]);
+    }
+    freeaddrinfo(servinfo);
+    return -1;
+}
+
+void listener_peer_name(const struct sockaddr_storage *addr, socklen_t len,
+                        char *out, size_t out_len) {
+    if (addr->ss_family == AF_UNIX) {
+        snprintf(out, out_len, "unix socket");
+        return;
+    }
+    int status = getnameinfo((const struct sockaddr *)addr, len, out, out_len,
+                             NULL, 0, NI_NUMERICHOST);
+    if (status != 0) {
+        snprintf(out, out_len, "unknown");
+    }
+}
@@ -0,0 +1,38 @@
+#ifndef AESDSOCKET_LISTENER_H
+#define AESDSOCKET_LISTENER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/socket.h>
+
+// Upper bound on the sockets opened for a single server instance.
+#define LISTENER_MAX_FDS 16
+
+// Opens listening sockets for `spec` and appends them to `fds`, which has room
+// for `max_fds` entries. `spec` is one of:
+//   port            every local address of every family, like the default
+//   host:port       a single IPv4 address or host name
+//   [addr]:port     a single IPv6 address
+//   unix:/path      a Unix-domain stream socket
+// With `reuseport` every TCP socket sets SO_REUSEPORT so several sockets can
+// share the address and the kernel spreads incoming connections over them.
+// Returns the number of sockets opened or -1 on error.
+int listener_open(const char *spec, bool reuseport, int *fds, size_t max_fds);
+
+// Returns true if `spec` names a Unix-domain socket.
+bool listener_is_unix(const char *spec);
+
+// Removes the socket file left behind by a Unix-domain `spec`.
+void listener_cleanup(const char *spec);
+
+// Removes a socket left at `path` by an earlier run so it can be bound again.
+// Anything else is left alone, so a mistyped path cannot delete a file.
+// Returns 0 if nothing is in the way of binding and -1 with errno EADDRINUSE
+// if something other than a socket is.
+int listener_remove_stale(const char *path);
+
+// Formats the address of a connected peer for logging.
+void listener_peer_name(const struct sockaddr_storage *addr, socklen_t len,
+                        char *out, size_t out_len);
+
+#endif /* AESDSOCKET_LISTENER_H */
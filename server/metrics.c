@@ -0,0 +1,461 @@
+#define _GNU_SOURCE
+#include "metrics.h"
+#include "listener.h"
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Latency buckets are powers of two in microseconds, from 1us to ~1s, plus
+// the implicit +Inf bucket.
+#define HISTOGRAM_BUCKETS 21
+// How long to wait for an HTTP request line before answering in plain text.
+#define REQUEST_WAIT_MS 100
+// Bounds on reading the rest of the request headers once they have started.
+#define REQUEST_READ_TIMEOUT_MS 1000
+#define MAX_REQUEST_LEN 8192
+// How long unread request bytes are drained after the response, so closing
+// the connection does not reset it.
+#define CLOSE_DRAIN_MS 200
+// How long a scraper may go without accepting any of the response.
+#define RESPONSE_SEND_TIMEOUT_MS 1000
+
+struct histogram {
+    _Atomic uint64_t buckets[HISTOGRAM_BUCKETS + 1];
+    _Atomic uint64_t sum_ns;
+};
+
+// One thread's metrics. Only the owning thread writes to it, so updates are a
+// relaxed load and store with no read-modify-write or lock on the hot path.
+struct metrics_shard {
+    _Atomic uint64_t counters[METRIC_COUNTER_MAX];
+    _Atomic uint64_t errors[METRIC_ERROR_MAX];
+    struct histogram histograms[METRIC_HISTOGRAM_MAX];
+    struct metrics_shard *next;
+};
+
+static const char *counter_names[METRIC_COUNTER_MAX] = {
+    [METRIC_CONNECTIONS_ACCEPTED] = "connections_accepted_total",
+    [METRIC_CONNECTIONS_CLOSED] = "connections_closed_total",
+    [METRIC_LINES_RECEIVED] = "lines_received_total",
+    [METRIC_BYTES_IN] = "bytes_in_total",
+    [METRIC_BYTES_OUT] = "bytes_out_total",
+    [METRIC_SEEKTO_COMMANDS] = "seekto_commands_total",
+    [METRIC_GREP_COMMANDS] = "grep_commands_total",
+    [METRIC_RECORDS_REPLICATED] = "records_replicated_total",
+    [METRIC_RECORDS_APPLIED] = "records_applied_total",
+};
+
+static const char *error_names[METRIC_ERROR_MAX] = {
+    [METRIC_ERROR_ACCEPT] = "accept",
+    [METRIC_ERROR_CLIENT_READ] = "client_read",
+    [METRIC_ERROR_IDLE_TIMEOUT] = "idle_timeout",
+    [METRIC_ERROR_DEVICE_OPEN] = "device_open",
+    [METRIC_ERROR_DEVICE_WRITE] = "device_write",
+    [METRIC_ERROR_DEVICE_READ] = "device_read",
+    [METRIC_ERROR_IOCTL] = "ioctl",
+    [METRIC_ERROR_SEND] = "send",
+    [METRIC_ERROR_SEND_TIMEOUT] = "send_timeout",
+    [METRIC_ERROR_RECORD_TOO_LONG] = "record_too_long",
+    [METRIC_ERROR_POOL_FULL] = "pool_full",
+    [METRIC_ERROR_TIMESTAMP_DROPPED] = "timestamp_dropped",
+};
+
+static const char *histogram_names[METRIC_HISTOGRAM_MAX] = {
+    [METRIC_DEVICE_WRITE_LATENCY] = "device_write_seconds",
+    [METRIC_DEVICE_READ_LATENCY] = "device_read_seconds",
+};
+
+// Shards of live threads. The lock is only taken when a thread registers or
+// exits and when rendering, never when a metric is updated.
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct metrics_shard *live_shards = NULL;
+// Totals of threads that have exited.
+static struct metrics_shard retired;
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t shard_key;
+static __thread struct metrics_shard *local_shard = NULL;
+
+static void add(_Atomic uint64_t *dst, uint64_t n) {
+    atomic_fetch_add_explicit(dst, n, memory_order_relaxed);
+}
+
+// Single-writer increment of a value owned by the calling thread.
+static void bump(_Atomic uint64_t *dst, uint64_t n) {
+    uint64_t v = atomic_load_explicit(dst, memory_order_relaxed);
+    atomic_store_explicit(dst, v + n, memory_order_relaxed);
+}
+
+static uint64_t load(_Atomic uint64_t *src) {
+    return atomic_load_explicit(src, memory_order_relaxed);
+}
+
+static void merge_shard(struct metrics_shard *dst, struct metrics_shard *src) {
+    for (int i = 0; i < METRIC_COUNTER_MAX; i++) {
+        add(&dst->counters[i], load(&src->counters[i]));
+    }
+    for (int i = 0; i < METRIC_ERROR_MAX; i++) {
+        add(&dst->errors[i], load(&src->errors[i]));
+    }
+    for (int h = 0; h < METRIC_HISTOGRAM_MAX; h++) {
+        for (int b = 0; b <= HISTOGRAM_BUCKETS; b++) {
+            add(&dst->histograms[h].buckets[b],
+                load(&src->histograms[h].buckets[b]));
+        }
+        add(&dst->histograms[h].sum_ns, load(&src->histograms[h].sum_ns));
+    }
+}
+
+// Folds an exiting thread's shard into the retired totals.
+static void retire_shard(void *arg) {
+    struct metrics_shard *shard = arg;
+    pthread_mutex_lock(&registry_lock);
+    struct metrics_shard **pp = &live_shards;
+    while (*pp != shard) {
+        pp = &(*pp)->next;
+    }
+    *pp = shard->next;
+    merge_shard(&retired, shard);
+    pthread_mutex_unlock(&registry_lock);
+    free(shard);
+}
+
+static void create_key(void) { pthread_key_create(&shard_key, retire_shard); }
+
+static struct metrics_shard *get_shard(void) {
+    if (local_shard != NULL) {
+        return local_shard;
+    }
+    pthread_once(&key_once, create_key);
+    struct metrics_shard *shard = calloc(1, sizeof(struct metrics_shard));
+    if (shard == NULL) {
+        // Metrics are best effort; attribute them to the retired totals.
+        return &retired;
+    }
+    pthread_mutex_lock(&registry_lock);
+    shard->next = live_shards;
+    live_shards = shard;
+    pthread_mutex_unlock(&registry_lock);
+    pthread_setspecific(shard_key, shard);
+    local_shard = shard;
+    return shard;
+}
+
+void metrics_count(enum metric_counter counter, uint64_t n) {
+    struct metrics_shard *shard = get_shard();
+    if (shard == &retired) {
+        add(&shard->counters[counter], n);
+    } else {
+        bump(&shard->counters[counter], n);
+    }
+}
+
+void metrics_error(enum metric_error error) {
+    struct metrics_shard *shard = get_shard();
+    if (shard == &retired) {
+        add(&shard->errors[error], 1);
+    } else {
+        bump(&shard->errors[error], 1);
+    }
+}
+
+void metrics_observe(enum metric_histogram histogram,
+                     const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t ns = (now.tv_sec - start->tv_sec) * 1000000000ULL +
+                  (now.tv_nsec - start->tv_nsec);
+    int bucket = 0;
+    while (bucket < HISTOGRAM_BUCKETS && ns > (1000ULL << bucket)) {
+        bucket++;
+    }
+
+    struct metrics_shard *shard = get_shard();
+    struct histogram *h = &shard->histograms[histogram];
+    if (shard == &retired) {
+        add(&h->buckets[bucket], 1);
+        add(&h->sum_ns, ns);
+    } else {
+        bump(&h->buckets[bucket], 1);
+        bump(&h->sum_ns, ns);
+    }
+}
+
+void metrics_render(FILE *out) {
+    struct metrics_shard total;
+    memset(&total, 0, sizeof(total));
+    pthread_mutex_lock(&registry_lock);
+    merge_shard(&total, &retired);
+    for (struct metrics_shard *s = live_shards; s != NULL; s = s->next) {
+        merge_shard(&total, s);
+    }
+    pthread_mutex_unlock(&registry_lock);
+
+    for (int i = 0; i < METRIC_COUNTER_MAX; i++) {
+        fprintf(out, "# TYPE aesdsocket_%s counter\n", counter_names[i]);
+        fprintf(out, "aesdsocket_%s %llu\n", counter_names[i],
+                (unsigned long long)load(&total.counters[i]));
+    }
+
+    uint64_t accepted = load(&total.counters[METRIC_CONNECTIONS_ACCEPTED]);
+    uint64_t closed = load(&total.counters[METRIC_CONNECTIONS_CLOSED]);
+    fprintf(out, "# TYPE aesdsocket_connections_active gauge\n");
+    fprintf(out, "aesdsocket_connections_active %llu\n",
+            (unsigned long long)(accepted > closed ? accepted - closed : 0));
+
+    fprintf(out, "# TYPE aesdsocket_errors_total counter\n");
+    for (int i = 0; i < METRIC_ERROR_MAX; i++) {
+        fprintf(out, "aesdsocket_errors_total{type=\"%s\"} %llu\n",
+                error_names[i], (unsigned long long)load(&total.errors[i]));
+    }
+
+    for (int h = 0; h < METRIC_HISTOGRAM_MAX; h++) {
+        const char *name = histogram_names[h];
+        struct histogram *hist = &total.histograms[h];
+        fprintf(out, "# TYPE aesdsocket_%s histogram\n", name);
+        uint64_t cumulative = 0;
+        for (int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+            cumulative += load(&hist->buckets[b]);
+            fprintf(out, "aesdsocket_%s_bucket{le=\"%g\"} %llu\n", name,
+                    (double)(1ULL << b) / 1e6, (unsigned long long)cumulative);
+        }
+        cumulative += load(&hist->buckets[HISTOGRAM_BUCKETS]);
+        fprintf(out, "aesdsocket_%s_bucket{le=\"+Inf\"} %llu\n", name,
+                (unsigned long long)cumulative);
+        fprintf(out, "aesdsocket_%s_sum %.9f\n", name,
+                load(&hist->sum_ns) / 1e9);
+        fprintf(out, "aesdsocket_%s_count %llu\n", name,
+                (unsigned long long)cumulative);
+    }
+}
+
+int metrics_listen(const char *spec) {
+    int fd;
+    int status;
+    if (spec[0] == '/') {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(spec) >= sizeof(addr.sun_path)) {
+            fprintf(stderr, "metrics socket path too long: %s\n", spec);
+            return -1;
+        }
+        strcpy(addr.sun_path, spec);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd == -1) {
+            perror("socket");
+            return -1;
+        }
+        if (listener_remove_stale(spec) == -1) {
+            close(fd);
+            return -1;
+        }
+        status = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    } else {
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(atoi(spec));
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd == -1) {
+            perror("socket");
+            return -1;
+        }
+        int opt_val = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt_val, sizeof(opt_val));
+        status = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    }
+    if (status == -1) {
+        perror("bind");
+        close(fd);
+        return -1;
+    }
+    if (listen(fd, 8) == -1) {
+        perror("listen");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Milliseconds left until `timeout_ms` after `start`, clamped at zero.
+static int ms_left(const struct timespec *start, int timeout_ms) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long elapsed = (now.tv_sec - start->tv_sec) * 1000LL +
+                        (now.tv_nsec - start->tv_nsec) / 1000000;
+    return elapsed >= timeout_ms ? 0 : timeout_ms - elapsed;
+}
+
+// Reads the request on `conn_fd` up to the empty line that ends its headers,
+// within REQUEST_READ_TIMEOUT_MS and MAX_REQUEST_LEN bytes. Scrapers speak
+// HTTP, while a plain `nc` sends nothing, so only REQUEST_WAIT_MS is given
+// for the first byte. Returns true if an HTTP request arrived.
+static bool read_request(int conn_fd) {
+    char req[MAX_REQUEST_LEN];
+    size_t len = 0;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int timeout = REQUEST_WAIT_MS;
+    while (len < sizeof(req)) {
+        struct pollfd pfd = {.fd = conn_fd, .events = POLLIN};
+        int ready = poll(&pfd, 1, timeout);
+        if (ready == -1 && errno == EINTR) {
+            continue;
+        }
+        if (ready != 1) {
+            break;
+        }
+        ssize_t n = recv(conn_fd, req + len, sizeof(req) - len, MSG_DONTWAIT);
+        if (n == -1 && (errno == EINTR || errno == EAGAIN)) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        len += n;
+        if (memmem(req, len, "\r\n\r\n", 4) != NULL ||
+            memmem(req, len, "\n\n", 2) != NULL) {
+            break;
+        }
+        timeout = ms_left(&start, REQUEST_READ_TIMEOUT_MS);
+        if (timeout == 0) {
+            break;
+        }
+    }
+    return len >= 4 && memcmp(req, "GET ", 4) == 0;
+}
+
+// Closes `conn_fd` once the response is sent. Closing with unread request
+// bytes would reset the connection and could cut the response short for the
+// scraper, so the write side is shut down first and whatever else arrives is
+// read and dropped until the scraper closes or CLOSE_DRAIN_MS passes.
+static void close_response(int conn_fd) {
+    shutdown(conn_fd, SHUT_WR);
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    char buf[512];
+    while (1) {
+        struct pollfd pfd = {.fd = conn_fd, .events = POLLIN};
+        int ready = poll(&pfd, 1, ms_left(&start, CLOSE_DRAIN_MS));
+        if (ready == -1 && errno == EINTR) {
+            continue;
+        }
+        if (ready != 1 || recv(conn_fd, buf, sizeof(buf), MSG_DONTWAIT) <= 0) {
+            break;
+        }
+    }
+    close(conn_fd);
+}
+
+void metrics_serve(int conn_fd) {
+    // Answer with a status line only when an HTTP request arrives.
+    bool http = read_request(conn_fd);
+
+    char *body = NULL;
+    size_t body_len = 0;
+    FILE *out = open_memstream(&body, &body_len);
+    if (out == NULL) {
+        perror("open_memstream");
+        close(conn_fd);
+        return;
+    }
+    if (http) {
+        fprintf(out, "HTTP/1.0 200 OK\r\n"
+                     "Content-Type: text/plain; version=0.0.4\r\n\r\n");
+    }
+    metrics_render(out);
+    fclose(out);
+
+    struct timeval timeout;
+    timeout.tv_sec = RESPONSE_SEND_TIMEOUT_MS / 1000;
+    timeout.tv_usec = RESPONSE_SEND_TIMEOUT_MS % 1000 * 1000;
+    setsockopt(conn_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    size_t sent = 0;
+    while (sent < body_len) {
+        ssize_t n = send(conn_fd, body + sent, body_len - sent, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("send");
+            break;
+        }
+        sent += n;
+    }
+    free(body);
+    close_response(conn_fd);
+}
+
+static pthread_t server_tid;
+static int server_listen_fd = -1;
+static int server_stop_efd = -1;
+
+static void *metrics_server_main(void *arg) {
+    (void)arg;
+    struct pollfd fds[2];
+    fds[0].fd = server_listen_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = server_stop_efd;
+    fds[1].events = POLLIN;
+    while (1) {
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            break;
+        }
+        if (fds[1].revents & POLLIN) {
+            break;
+        }
+        if (fds[0].revents & POLLIN) {
+            int conn_fd = accept4(server_listen_fd, NULL, NULL, SOCK_CLOEXEC);
+            if (conn_fd != -1) {
+                metrics_serve(conn_fd);
+            }
+        }
+    }
+    return NULL;
+}
+
+int metrics_start(int listen_fd) {
+    server_stop_efd = eventfd(0, EFD_CLOEXEC);
+    if (server_stop_efd == -1) {
+        perror("eventfd");
+        return -1;
+    }
+    server_listen_fd = listen_fd;
+    int status = pthread_create(&server_tid, NULL, metrics_server_main, NULL);
+    if (status != 0) {
+        errno = status;
+        perror("pthread_create");
+        close(server_stop_efd);
+        server_stop_efd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+void metrics_stop(void) {
+    if (server_stop_efd == -1) {
+        return;
+    }
+    uint64_t one = 1;
+    if (write(server_stop_efd, &one, sizeof(one)) == -1) {
+        perror("write");
+    }
+    pthread_join(server_tid, NULL);
+    close(server_stop_efd);
+    server_stop_efd = -1;
+}
@@ -0,0 +1,64 @@
+#ifndef AESDSOCKET_METRICS_H
+#define AESDSOCKET_METRICS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+// Monotonic counters. Each thread updates its own copy without locking; the
+// copies are only summed when the metrics are rendered.
+enum metric_counter {
+    METRIC_CONNECTIONS_ACCEPTED,
+    METRIC_CONNECTIONS_CLOSED,
+    METRIC_LINES_RECEIVED,
+    METRIC_BYTES_IN,
+    METRIC_BYTES_OUT,
+    METRIC_SEEKTO_COMMANDS,
+    METRIC_GREP_COMMANDS,
+    METRIC_RECORDS_REPLICATED,
+    METRIC_RECORDS_APPLIED,
+    METRIC_COUNTER_MAX,
+};
+
+enum metric_error {
+    METRIC_ERROR_ACCEPT,
+    METRIC_ERROR_CLIENT_READ,
+    METRIC_ERROR_IDLE_TIMEOUT,
+    METRIC_ERROR_DEVICE_OPEN,
+    METRIC_ERROR_DEVICE_WRITE,
+    METRIC_ERROR_DEVICE_READ,
+    METRIC_ERROR_IOCTL,
+    METRIC_ERROR_SEND,
+    METRIC_ERROR_SEND_TIMEOUT,
+    METRIC_ERROR_RECORD_TOO_LONG,
+    METRIC_ERROR_POOL_FULL,
+    METRIC_ERROR_TIMESTAMP_DROPPED,
+    METRIC_ERROR_MAX,
+};
+
+enum metric_histogram {
+    METRIC_DEVICE_WRITE_LATENCY,
+    METRIC_DEVICE_READ_LATENCY,
+    METRIC_HISTOGRAM_MAX,
+};
+
+void metrics_count(enum metric_counter counter, uint64_t n);
+void metrics_error(enum metric_error error);
+// Records the time elapsed since `start`, a CLOCK_MONOTONIC timestamp.
+void metrics_observe(enum metric_histogram histogram,
+                     const struct timespec *start);
+
+// Writes the merged metrics of all threads in the Prometheus text format.
+void metrics_render(FILE *out);
+
+// Creates the listening socket for the metrics endpoint. `spec` is either a
+// TCP port bound on the loopback address or the path of a Unix socket.
+int metrics_listen(const char *spec);
+// Serves one metrics request on `conn_fd` and closes it.
+void metrics_serve(int conn_fd);
+// Serves metrics requests on `listen_fd` from a thread of its own, so a slow
+// scraper never holds up the caller, until metrics_stop() is called.
+int metrics_start(int listen_fd);
+void metrics_stop(void);
+
+#endif /* AESDSOCKET_METRICS_H */
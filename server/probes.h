@@ -0,0 +1,36 @@
+#ifndef AESDSOCKET_PROBES_H
+#define AESDSOCKET_PROBES_H
+
+// USDT probes on the stages of a request, for perf and bpftrace, e.g.
+//
+//   bpftrace -e 'usdt:./aesdsocket:aesdsocket:device_write__start { ... }'
+//
+// An unattached probe is a single nop. Without <sys/sdt.h> (systemtap-sdt-dev)
+// they compile to nothing.
+//
+//   request__start(fd)                   connection handed to a worker
+//   parse__start(fd)                     waiting for the request line
+//   parse__done(fd, len)                 first chunk of the line received
+//   device_write__start(len)             write of a record or chunk
+//   device_write__done(len, result)
+//   device_read__start(max)              read of device contents to send back
+//   device_read__done(result)
+//   send__start(fd, len)
+//   send__done(fd, result)
+//   request__done(fd)                    connection shut down
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define AESDSOCKET_HAVE_SDT 1
+#endif
+#endif
+
+#ifdef AESDSOCKET_HAVE_SDT
+#define PROBE1(name, a) DTRACE_PROBE1(aesdsocket, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(aesdsocket, name, a, b)
+#else
+#define PROBE1(name, a) ((void)(a))
+#define PROBE2(name, a, b) ((void)(a), (void)(b))
+#endif
+
+#endif /* AESDSOCKET_PROBES_H */
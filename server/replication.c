@@ -0,0 +1,545 @@
+#define _GNU_SOURCE
+#include "replication.h"
+#include "metrics.h"
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+// Recent records kept for followers that reconnect. Whichever limit is
+// reached first evicts the oldest record.
+#define LOG_MAX_RECORDS 4096
+#define LOG_MAX_BYTES (4 * 1024 * 1024)
+// A batch is closed once it holds this many bytes, unless it is a single
+// larger record.
+#define BATCH_MAX_BYTES (256 * 1024)
+// Largest batch a follower accepts, to bound memory on a corrupt stream.
+#define MAX_PAYLOAD (64 * 1024 * 1024)
+// A primary that sends nothing, not even a heartbeat, for this long is
+// considered gone.
+#define FOLLOWER_TIMEOUT_MS (3 * REPLICATION_HEARTBEAT_MS)
+#define CONNECT_TIMEOUT_MS 5000
+#define RETRY_MS 1000
+
+struct log_record {
+    char *data;
+    size_t len;
+};
+
+// The record with sequence number `seq` is log_records[seq % LOG_MAX_RECORDS]
+// for every seq from log_first_seq up to, not including, log_next_seq.
+static struct log_record log_records[LOG_MAX_RECORDS];
+static uint64_t log_first_seq = 1;
+static uint64_t log_next_seq = 1;
+static size_t log_bytes = 0;
+static bool log_stopping = false;
+// Set once at startup, before any writer runs.
+static bool log_enabled = false;
+static uint64_t log_epoch = 0;
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_cond = PTHREAD_COND_INITIALIZER;
+
+static void log_evict_oldest(void) {
+    struct log_record *rec = &log_records[log_first_seq % LOG_MAX_RECORDS];
+    log_bytes -= rec->len;
+    free(rec->data);
+    rec->data = NULL;
+    log_first_seq++;
+}
+
+// Appends `copy`, which the log takes over, as the next record. A NULL `copy`
+// empties the log instead, so followers see a gap rather than the log losing
+// its order. Called with log_lock held.
+static void log_append(char *copy, size_t len) {
+    while (log_first_seq < log_next_seq &&
+           (copy == NULL || log_next_seq - log_first_seq == LOG_MAX_RECORDS ||
+            log_bytes + len > LOG_MAX_BYTES)) {
+        log_evict_oldest();
+    }
+    if (copy == NULL) {
+        log_next_seq++;
+        log_first_seq = log_next_seq;
+        pthread_cond_broadcast(&log_cond);
+        return;
+    }
+    struct log_record *rec = &log_records[log_next_seq % LOG_MAX_RECORDS];
+    rec->data = copy;
+    rec->len = len;
+    log_bytes += len;
+    log_next_seq++;
+    pthread_cond_broadcast(&log_cond);
+}
+
+// Maps a follower's requested position onto the log, called with log_lock
+// held. A position past the end comes from before a restart of this server,
+// so the follower starts over from the oldest record.
+static uint64_t log_position(uint64_t seq) {
+    if (seq < log_first_seq || seq > log_next_seq) {
+        return log_first_seq;
+    }
+    return seq;
+}
+
+void replication_enable(void) {
+    log_enabled = true;
+    if (getrandom(&log_epoch, sizeof(log_epoch), 0) != sizeof(log_epoch)) {
+        // Still differs between restarts, which is all a follower needs.
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        log_epoch = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+        log_epoch ^= (uint64_t)getpid() << 32;
+    }
+    if (log_epoch == 0) {
+        log_epoch = 1;
+    }
+}
+
+uint64_t replication_epoch(void) {
+    return log_epoch;
+}
+
+ssize_t replication_write(int fd, const char *data, size_t len) {
+    ssize_t bytes_written = write(fd, data, len);
+    if (bytes_written <= 0 || !log_enabled) {
+        return bytes_written;
+    }
+    // Copied before taking log_lock, which only guards the log itself.
+    char *copy = NULL;
+    if ((size_t)bytes_written > LOG_MAX_BYTES) {
+        fprintf(stderr, "record of %zd bytes too large to replicate\n",
+                bytes_written);
+    } else {
+        copy = malloc(bytes_written);
+        if (copy == NULL) {
+            perror("malloc");
+        } else {
+            memcpy(copy, data, bytes_written);
+        }
+    }
+    pthread_mutex_lock(&log_lock);
+    log_append(copy, bytes_written);
+    pthread_mutex_unlock(&log_lock);
+    return bytes_written;
+}
+
+bool replication_wait(uint64_t next_seq, int timeout_ms) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&log_lock);
+    while (!log_stopping && log_position(next_seq) == log_next_seq) {
+        if (pthread_cond_timedwait(&log_cond, &log_lock, &deadline) ==
+            ETIMEDOUT) {
+            break;
+        }
+    }
+    bool ready = !log_stopping && log_position(next_seq) < log_next_seq;
+    pthread_mutex_unlock(&log_lock);
+    return ready;
+}
+
+ssize_t replication_read(uint64_t *next_seq, char **buf, size_t *capacity) {
+    struct replication_header header;
+    size_t len = sizeof(header);
+    if (*capacity < BATCH_MAX_BYTES) {
+        char *larger = realloc(*buf, BATCH_MAX_BYTES);
+        if (larger == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        *buf = larger;
+        *capacity = BATCH_MAX_BYTES;
+    }
+
+    pthread_mutex_lock(&log_lock);
+    uint64_t first_seq = log_position(*next_seq);
+    uint64_t seq = first_seq;
+    while (seq < log_next_seq) {
+        const struct log_record *rec = &log_records[seq % LOG_MAX_RECORDS];
+        size_t needed = len + sizeof(uint32_t) + rec->len;
+        if (seq > first_seq && needed > BATCH_MAX_BYTES) {
+            break;
+        }
+        if (needed > *capacity) {
+            char *larger = realloc(*buf, needed);
+            if (larger == NULL) {
+                pthread_mutex_unlock(&log_lock);
+                perror("realloc");
+                return -1;
+            }
+            *buf = larger;
+            *capacity = needed;
+        }
+        uint32_t rec_len = htobe32(rec->len);
+        memcpy(*buf + len, &rec_len, sizeof(rec_len));
+        memcpy(*buf + len + sizeof(rec_len), rec->data, rec->len);
+        len = needed;
+        seq++;
+    }
+    pthread_mutex_unlock(&log_lock);
+
+    header.magic = htobe32(REPLICATION_MAGIC);
+    header.count = htobe32(seq - first_seq);
+    header.first_seq = htobe64(first_seq);
+    header.epoch = htobe64(log_epoch);
+    header.payload_len = htobe32(len - sizeof(header));
+    header.reserved = 0;
+    memcpy(*buf, &header, sizeof(header));
+    metrics_count(METRIC_RECORDS_REPLICATED, seq - first_seq);
+    *next_seq = seq;
+    return len;
+}
+
+void replication_stop(void) {
+    pthread_mutex_lock(&log_lock);
+    log_stopping = true;
+    pthread_cond_broadcast(&log_cond);
+    pthread_mutex_unlock(&log_lock);
+}
+
+// Follower state, only touched by the follower thread once it runs.
+static pthread_t follower_tid;
+static bool follower_started = false;
+// Readable once the follower should exit.
+static int follower_stop_efd = -1;
+static char *follower_host = NULL;
+static char *follower_port = NULL;
+static const char *follower_data_path = NULL;
+// Held around each batch, shared with every other writer of the data file.
+static pthread_mutex_t *follower_write_lock = NULL;
+
+// Waits for `fd` to become ready for `events`. Returns 1 when it is, 0 on
+// timeout or stop and -1 on error.
+static int follower_poll(int fd, short events, int timeout_ms) {
+    struct pollfd fds[2];
+    fds[0].fd = fd;
+    fds[0].events = events;
+    fds[1].fd = follower_stop_efd;
+    fds[1].events = POLLIN;
+    while (1) {
+        int ready = poll(fds, 2, timeout_ms);
+        if (ready == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            return -1;
+        }
+        if (ready == 0 || fds[1].revents) {
+            return 0;
+        }
+        return 1;
+    }
+}
+
+// Reads exactly `len` bytes from the non-blocking socket `fd`. Returns 0 on
+// success and -1 on error, EOF, timeout or stop.
+static int read_full(int fd, void *buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t bytes_read = read(fd, (char *)buf + done, len - done);
+        if (bytes_read > 0) {
+            done += bytes_read;
+            continue;
+        }
+        if (bytes_read == 0) {
+            fprintf(stderr, "primary closed the connection\n");
+            return -1;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            perror("read");
+            return -1;
+        }
+        int ready = follower_poll(fd, POLLIN, FOLLOWER_TIMEOUT_MS);
+        if (ready != 1) {
+            if (ready == 0) {
+                fprintf(stderr, "primary timed out\n");
+            }
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Connects to the primary without blocking past CONNECT_TIMEOUT_MS or a stop.
+// Returns the non-blocking socket or -1 on error.
+static int connect_primary(void) {
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *res;
+    int status = getaddrinfo(follower_host, follower_port, &hints, &res);
+    if (status != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(status));
+        return -1;
+    }
+    int fd = -1;
+    for (struct addrinfo *ai = res; ai != NULL; ai = ai->ai_next) {
+        fd = socket(ai->ai_family,
+                    ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                    ai->ai_protocol);
+        if (fd == -1) {
+            continue;
+        }
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+            break;
+        }
+        if (errno == EINPROGRESS &&
+            follower_poll(fd, POLLOUT, CONNECT_TIMEOUT_MS) == 1) {
+            int error = 0;
+            socklen_t error_len = sizeof(error);
+            getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_len);
+            if (error == 0) {
+                break;
+            }
+            errno = error;
+        }
+        close(fd);
+        fd = -1;
+    }
+    if (fd == -1) {
+        fprintf(stderr, "could not connect to primary %s:%s: %s\n",
+                follower_host, follower_port, strerror(errno));
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+// Writes the `count` records of a batch payload to `data_fd` with as few
+// writev() calls as IOV_MAX allows. Every record is its own iovec, so a
+// device sees the same sequence of writes as the primary's. The follower's
+// write lock is held throughout so local writes land between batches, never
+// inside one. Returns 0 on success and -1 on error.
+static int apply_batch(int data_fd, const char *payload, size_t len,
+                       uint32_t count) {
+    struct iovec *iov = malloc(count * sizeof(struct iovec));
+    if (iov == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    size_t offset = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t rec_len;
+        if (len - offset < sizeof(rec_len)) {
+            goto corrupt;
+        }
+        memcpy(&rec_len, payload + offset, sizeof(rec_len));
+        rec_len = be32toh(rec_len);
+        offset += sizeof(rec_len);
+        if (len - offset < rec_len) {
+            goto corrupt;
+        }
+        iov[i].iov_base = (char *)payload + offset;
+        iov[i].iov_len = rec_len;
+        offset += rec_len;
+    }
+    if (offset != len) {
+        goto corrupt;
+    }
+
+    struct iovec *next = iov;
+    size_t remaining = count;
+    pthread_mutex_lock(follower_write_lock);
+    while (remaining > 0) {
+        int batch = remaining < IOV_MAX ? remaining : IOV_MAX;
+        ssize_t bytes_written = writev(data_fd, next, batch);
+        if (bytes_written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("writev");
+            metrics_error(METRIC_ERROR_DEVICE_WRITE);
+            pthread_mutex_unlock(follower_write_lock);
+            free(iov);
+            return -1;
+        }
+        // Skip what was written, resuming mid-record after a short write.
+        while (remaining > 0 && (size_t)bytes_written >= next->iov_len) {
+            bytes_written -= next->iov_len;
+            next++;
+            remaining--;
+        }
+        if (remaining > 0) {
+            next->iov_base = (char *)next->iov_base + bytes_written;
+            next->iov_len -= bytes_written;
+        }
+    }
+    pthread_mutex_unlock(follower_write_lock);
+    free(iov);
+    metrics_count(METRIC_RECORDS_APPLIED, count);
+    return 0;
+
+corrupt:
+    fprintf(stderr, "corrupt replication batch\n");
+    free(iov);
+    return -1;
+}
+
+// Receives batches from the connected primary until an error. `*next_seq` is
+// advanced past every record applied and `*epoch` set to the primary's.
+static void follow(int sock, int data_fd, uint64_t *next_seq,
+                   uint64_t *epoch) {
+    char *payload = NULL;
+    size_t capacity = 0;
+    while (1) {
+        struct replication_header header;
+        if (read_full(sock, &header, sizeof(header)) == -1) {
+            break;
+        }
+        uint32_t count = be32toh(header.count);
+        uint64_t first_seq = be64toh(header.first_seq);
+        uint32_t payload_len = be32toh(header.payload_len);
+        if (be32toh(header.magic) != REPLICATION_MAGIC ||
+            payload_len > MAX_PAYLOAD) {
+            fprintf(stderr, "corrupt replication header\n");
+            break;
+        }
+        if (payload_len > capacity) {
+            char *larger = realloc(payload, payload_len);
+            if (larger == NULL) {
+                perror("realloc");
+                break;
+            }
+            payload = larger;
+            capacity = payload_len;
+        }
+        if (read_full(sock, payload, payload_len) == -1) {
+            break;
+        }
+        uint64_t header_epoch = be64toh(header.epoch);
+        if (header_epoch != *epoch) {
+            // Positions from before count another history, so whatever comes
+            // next, even after a reconnect, starts from the oldest record.
+            if (*epoch != 0) {
+                fprintf(stderr, "primary restarted, following it from record "
+                                "%" PRIu64 "\n",
+                        first_seq);
+            }
+            *epoch = header_epoch;
+            *next_seq = 0;
+        }
+        if (count == 0) {
+            continue;
+        }
+        if (*next_seq != 0 && first_seq != *next_seq) {
+            fprintf(stderr,
+                    "expected record %" PRIu64 ", primary resumed at %" PRIu64
+                    "\n",
+                    *next_seq, first_seq);
+        }
+        if (apply_batch(data_fd, payload, payload_len, count) == -1) {
+            break;
+        }
+        *next_seq = first_seq + count;
+    }
+    free(payload);
+}
+
+static void *follower_main(void *arg) {
+    (void)arg;
+    int data_fd = open(follower_data_path, O_WRONLY | O_APPEND | O_CLOEXEC);
+    if (data_fd == -1) {
+        perror("open");
+        metrics_error(METRIC_ERROR_DEVICE_OPEN);
+        return NULL;
+    }
+    // 0 until the first batch: start from the oldest record the primary has.
+    uint64_t next_seq = 0;
+    uint64_t epoch = 0;
+    struct pollfd stop;
+    stop.fd = follower_stop_efd;
+    stop.events = POLLIN;
+    while (1) {
+        int sock = connect_primary();
+        if (sock != -1) {
+            char request[64];
+            int len = snprintf(request, sizeof(request),
+                               REPLICATION_COMMAND "%" PRIu64 ":%" PRIu64 "\n",
+                               next_seq, epoch);
+            if (send(sock, request, len, MSG_NOSIGNAL) == len) {
+                printf("Following %s:%s from record %" PRIu64 "\n",
+                       follower_host, follower_port, next_seq);
+                follow(sock, data_fd, &next_seq, &epoch);
+            } else {
+                perror("send");
+            }
+            close(sock);
+        }
+        if (poll(&stop, 1, RETRY_MS) != 0) {
+            break;
+        }
+    }
+    close(data_fd);
+    return NULL;
+}
+
+int replication_follow_start(const char *spec, const char *data_path,
+                             pthread_mutex_t *write_lock) {
+    const char *colon = strrchr(spec, ':');
+    if (colon == NULL || colon == spec || colon[1] == '\0') {
+        fprintf(stderr, "invalid primary, expected host:port: %s\n", spec);
+        return -1;
+    }
+    const char *host = spec;
+    size_t host_len = colon - spec;
+    if (host[0] == '[' && host[host_len - 1] == ']') {
+        host++;
+        host_len -= 2;
+    }
+    follower_host = strndup(host, host_len);
+    follower_port = strdup(colon + 1);
+    follower_data_path = data_path;
+    follower_write_lock = write_lock;
+    follower_stop_efd = eventfd(0, EFD_CLOEXEC);
+    if (follower_host == NULL || follower_port == NULL ||
+        follower_stop_efd == -1) {
+        perror("replication_follow_start");
+        return -1;
+    }
+    int status = pthread_create(&follower_tid, NULL, follower_main, NULL);
+    if (status != 0) {
+        errno = status;
+        perror("pthread_create");
+        return -1;
+    }
+    follower_started = true;
+    return 0;
+}
+
+void replication_follow_stop(void) {
+    if (!follower_started) {
+        return;
+    }
+    uint64_t one = 1;
+    if (write(follower_stop_efd, &one, sizeof(one)) == -1) {
+        perror("write");
+    }
+    pthread_join(follower_tid, NULL);
+    follower_started = false;
+    close(follower_stop_efd);
+    free(follower_host);
+    free(follower_port);
+}
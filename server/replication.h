@@ -0,0 +1,79 @@
+#ifndef AESDSOCKET_REPLICATION_H
+#define AESDSOCKET_REPLICATION_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// A follower sends "AESDCHAR_FOLLOW:<seq>:<epoch>\n" and then receives every
+// record written from sequence number <seq> on, and every record written
+// after that as it is committed, until either side disconnects. Sequence
+// numbers start at 1; 0 asks for the oldest record the primary still holds.
+// <epoch> is the one of the primary that <seq> was counted by, 0 if none yet.
+// The primary picks a new epoch at every start, and a follower whose epoch
+// differs from it also gets the oldest record, since its <seq> counts records
+// of a history that ended with the restart.
+#define REPLICATION_COMMAND "AESDCHAR_FOLLOW:"
+
+// Records travel in batches: a header, then for each record its length as a
+// big-endian uint32 followed by its bytes. A batch without records is a
+// heartbeat, sent when nothing was written for REPLICATION_HEARTBEAT_MS.
+#define REPLICATION_MAGIC 0x41455352 // "AESR"
+#define REPLICATION_HEARTBEAT_MS 1000
+
+// All fields are big-endian.
+struct replication_header {
+    uint32_t magic;
+    uint32_t count;
+    // Sequence number of the first record in the batch.
+    uint64_t first_seq;
+    // Epoch of the primary, which sequence numbers are only valid within.
+    uint64_t epoch;
+    // Bytes of length prefixes and records following the header.
+    uint32_t payload_len;
+    uint32_t reserved;
+};
+
+// Starts keeping the log of recent records that followers are served from.
+// Until it is called replication_write() does nothing but write. Also picks
+// the random, non-zero epoch of this instance.
+void replication_enable(void);
+
+// Returns the epoch picked by replication_enable().
+uint64_t replication_epoch(void);
+
+// Writes `len` bytes at `data` to `fd` as one write and, if that succeeds and
+// replication is enabled, appends them to the log of recent records. Callers
+// serialize their writes, which keeps the log in the same order as the
+// device. A record larger than the whole log is left out and followers see a
+// gap instead. Returns the result of write().
+ssize_t replication_write(int fd, const char *data, size_t len);
+
+// Waits up to `timeout_ms` for a record with sequence number `next_seq` or
+// later to be logged. Returns true if one is, false on timeout or once
+// replication_stop() was called.
+bool replication_wait(uint64_t next_seq, int timeout_ms);
+
+// Encodes the logged records from `*next_seq` on into a batch at `*buf`,
+// growing it as needed, and advances `*next_seq` past them. Records that have
+// already left the log are skipped. Returns the size of the batch, which holds
+// no records if there are none yet, or -1 if out of memory.
+ssize_t replication_read(uint64_t *next_seq, char **buf, size_t *capacity);
+
+// Wakes every replication_wait() for shutdown.
+void replication_stop(void);
+
+// Starts a thread that follows the primary at `spec`, host:port or
+// [addr]:port, and applies its records to the file at `data_path` in order,
+// holding `write_lock`, the lock of every local writer, around each batch.
+// It reconnects after errors, resuming after the last record applied.
+// Returns 0 on success and -1 on error.
+int replication_follow_start(const char *spec, const char *data_path,
+                             pthread_mutex_t *write_lock);
+
+// Stops and joins the follower thread, if one was started.
+void replication_follow_stop(void);
+
+#endif /* AESDSOCKET_REPLICATION_H */
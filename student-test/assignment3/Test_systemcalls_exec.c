@@ -0,0 +1,214 @@
+#include "unity.h"
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "../../examples/systemcalls/systemcalls.h"
+
+/**
+ * Checks do_exec_batch, exec_capture and do_exec_to_fd: the status of every command in a
+ * batch, the bound on concurrent children with and without pidfds, a capture callback that
+ * stops at a fixed buffer size, and output sent straight to a descriptor.
+ */
+
+#define CAPTURE_LIMIT 10000
+#define BATCH_COMMANDS 6
+#define MAX_CONCURRENT 2
+#define SLEEP_SECONDS "0.2"
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void test_exec_batch_statuses()
+{
+    char *const ok[] = { "/bin/true", NULL };
+    char *const fails[] = { "/bin/false", NULL };
+    char *const exits_3[] = { "/bin/sh", "-c", "exit 3", NULL };
+    char *const missing[] = { "/nonexistent/command", NULL };
+    char *const killed[] = { "/bin/sh", "-c", "kill -TERM $$", NULL };
+    char *const *const commands[] = { ok, fails, exits_3, missing, killed };
+    struct exec_result results[5];
+
+    TEST_ASSERT_TRUE_MESSAGE(!do_exec_batch(commands, 5, 3, results),
+            "a batch with failing commands should fail");
+    TEST_ASSERT_TRUE_MESSAGE(results[0].success, "/bin/true should succeed");
+    TEST_ASSERT_TRUE_MESSAGE(WIFEXITED(results[0].status) && WEXITSTATUS(results[0].status) == 0,
+            "/bin/true should exit with 0");
+    TEST_ASSERT_TRUE_MESSAGE(!results[1].success, "/bin/false should fail");
+    TEST_ASSERT_TRUE_MESSAGE(WIFEXITED(results[1].status) && WEXITSTATUS(results[1].status) == 1,
+            "/bin/false should exit with 1");
+    TEST_ASSERT_TRUE_MESSAGE(WIFEXITED(results[2].status) && WEXITSTATUS(results[2].status) == 3,
+            "the status of each command should be kept in order");
+    TEST_ASSERT_EQUAL_INT(-1, results[3].status);
+    TEST_ASSERT_TRUE_MESSAGE(!results[3].success, "a command that cannot start should fail");
+    TEST_ASSERT_TRUE_MESSAGE(WIFSIGNALED(results[4].status) && WTERMSIG(results[4].status) == SIGTERM,
+            "a killed command should report its signal");
+
+    char *const *const all_ok[] = { ok, ok, ok };
+    TEST_ASSERT_TRUE_MESSAGE(do_exec_batch(all_ok, 3, 2, results), "a batch of successes should succeed");
+}
+
+/**
+ * Runs BATCH_COMMANDS commands that each record how many of them are running, then sleep.
+ * @return the largest number any of them saw
+ */
+static int run_concurrency_batch(void)
+{
+    char dir[] = "/tmp/exec-batch-XXXXXX";
+    TEST_ASSERT_NOT_NULL_MESSAGE(mkdtemp(dir), "mkdtemp failed");
+    char script[512];
+    snprintf(script, sizeof(script),
+             "touch %1$s/running.$$; ls %1$s | grep -c running >> %1$s/counts; "
+             "sleep " SLEEP_SECONDS "; rm %1$s/running.$$", dir);
+    char *const command[] = { "/bin/sh", "-c", script, NULL };
+    char *const *commands[BATCH_COMMANDS];
+    for (int i = 0; i < BATCH_COMMANDS; i++) {
+        commands[i] = command;
+    }
+    struct exec_result results[BATCH_COMMANDS];
+
+    uint64_t start = now_ns();
+    TEST_ASSERT_TRUE_MESSAGE(do_exec_batch((char *const *const *)commands, BATCH_COMMANDS, MAX_CONCURRENT,
+                                           results), "every command should succeed");
+    uint64_t elapsed_ns = now_ns() - start;
+    // With at most MAX_CONCURRENT at a time, the sleeps take at least this many rounds.
+    TEST_ASSERT_TRUE_MESSAGE(elapsed_ns >= (BATCH_COMMANDS / MAX_CONCURRENT) * 190000000ULL,
+            "the batch finished too fast to have respected max_concurrent");
+
+    char path[64];
+    snprintf(path, sizeof(path), "%s/counts", dir);
+    FILE *counts = fopen(path, "r");
+    TEST_ASSERT_NOT_NULL_MESSAGE(counts, "no command recorded its count");
+    int max_seen = 0;
+    int seen;
+    int lines = 0;
+    while (fscanf(counts, "%d", &seen) == 1) {
+        max_seen = seen > max_seen ? seen : max_seen;
+        lines++;
+    }
+    fclose(counts);
+    unlink(path);
+    rmdir(dir);
+    TEST_ASSERT_EQUAL_INT(BATCH_COMMANDS, lines);
+    return max_seen;
+}
+
+void test_exec_batch_max_concurrent()
+{
+    int max_seen = run_concurrency_batch();
+    TEST_ASSERT_TRUE_MESSAGE(max_seen >= 1 && max_seen <= MAX_CONCURRENT,
+            "more commands ran at once than max_concurrent allows");
+}
+
+void test_exec_batch_without_pidfds()
+{
+    // With the descriptor table full pidfd_open fails, as on kernels without it, and the batch
+    // falls back to waiting for one child at a time. posix_spawn needs no descriptor, and the
+    // fillers are close-on-exec, so the children start with a table of their own.
+    struct rlimit saved;
+    TEST_ASSERT_EQUAL_INT(0, getrlimit(RLIMIT_NOFILE, &saved));
+    struct rlimit limited = saved;
+    limited.rlim_cur = 64;
+    TEST_ASSERT_EQUAL_INT(0, setrlimit(RLIMIT_NOFILE, &limited));
+    int fillers[64];
+    int nfillers = 0;
+    int fd;
+    while (nfillers < 64 && (fd = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 0)) != -1) {
+        fillers[nfillers++] = fd;
+    }
+    char *const ok[] = { "/bin/true", NULL };
+    char *const fails[] = { "/bin/false", NULL };
+    char *const *const commands[] = { ok, fails, ok, ok };
+    struct exec_result results[4];
+    int extra = dup(STDIN_FILENO);
+    bool table_full = extra == -1;
+    if (!table_full) {
+        close(extra);
+    }
+    bool success = do_exec_batch(commands, 4, 2, results);
+    while (nfillers > 0) {
+        close(fillers[--nfillers]);
+    }
+    TEST_ASSERT_EQUAL_INT(0, setrlimit(RLIMIT_NOFILE, &saved));
+
+    TEST_ASSERT_TRUE_MESSAGE(table_full, "could not fill the descriptor table");
+    TEST_ASSERT_TRUE_MESSAGE(!success, "the batch should report the failing command");
+    TEST_ASSERT_TRUE_MESSAGE(results[0].success && results[2].success && results[3].success,
+            "every /bin/true should succeed without pidfds");
+    TEST_ASSERT_TRUE_MESSAGE(!results[1].success, "/bin/false should fail without pidfds");
+}
+
+struct capped_capture {
+    char data[CAPTURE_LIMIT];
+    size_t len;
+};
+
+/**
+ * Keeps the first CAPTURE_LIMIT bytes of stdout, then stops capturing.
+ */
+static bool capture_capped(int stream, const char *data, size_t len, void *ctx)
+{
+    struct capped_capture *capture = ctx;
+    if (stream != STDOUT_FILENO) {
+        return true;
+    }
+    size_t room = CAPTURE_LIMIT - capture->len;
+    size_t n = len < room ? len : room;
+    memcpy(capture->data + capture->len, data, n);
+    capture->len += n;
+    return capture->len < CAPTURE_LIMIT;
+}
+
+void test_exec_capture_truncates_at_buffer_size()
+{
+    static struct capped_capture capture;
+    capture.len = 0;
+    // yes writes forever, so it only stops once capturing does.
+    char *const command[] = { "/usr/bin/yes", "line", NULL };
+    TEST_ASSERT_TRUE_MESSAGE(!exec_capture(command, capture_capped, &capture),
+            "a command killed by SIGPIPE should not report success");
+    TEST_ASSERT_EQUAL_UINT64(CAPTURE_LIMIT, capture.len);
+    for (size_t i = 0; i < CAPTURE_LIMIT; i++) {
+        TEST_ASSERT_EQUAL_MESSAGE("line\n"[i % 5], capture.data[i], "captured output was corrupted");
+    }
+}
+
+void test_exec_capture_collects_both_streams()
+{
+    struct exec_output output = { { NULL, 0, 0 }, { NULL, 0, 0 } };
+    TEST_ASSERT_TRUE_MESSAGE(do_exec_capture(&output, 3, "/bin/sh", "-c", "echo out; echo err >&2"),
+            "the command should succeed");
+    TEST_ASSERT_EQUAL_UINT64(4, output.out.len);
+    TEST_ASSERT_EQUAL_MEMORY_MESSAGE("out\n", output.out.data, 4, "wrong stdout");
+    TEST_ASSERT_EQUAL_UINT64(4, output.err.len);
+    TEST_ASSERT_EQUAL_MEMORY_MESSAGE("err\n", output.err.data, 4, "wrong stderr");
+    exec_buffer_free(&output.out);
+    exec_buffer_free(&output.err);
+}
+
+void test_exec_to_fd()
+{
+    int pipe_fds[2];
+    TEST_ASSERT_EQUAL_INT(0, pipe(pipe_fds));
+    TEST_ASSERT_TRUE_MESSAGE(do_exec_to_fd(pipe_fds[1], 3, "/bin/echo", "to", "fd"),
+            "echo should succeed");
+    TEST_ASSERT_TRUE_MESSAGE(fcntl(pipe_fds[1], F_GETFD) != -1, "the descriptor should be left open");
+    TEST_ASSERT_TRUE_MESSAGE(!do_exec_to_fd(pipe_fds[1], 1, "/bin/false"),
+            "a failing command should return false");
+    close(pipe_fds[1]);
+    char buf[64];
+    ssize_t n = read(pipe_fds[0], buf, sizeof(buf));
+    close(pipe_fds[0]);
+    TEST_ASSERT_EQUAL_INT(6, n);
+    TEST_ASSERT_EQUAL_MEMORY_MESSAGE("to fd\n", buf, 6, "the output should arrive on the descriptor");
+}
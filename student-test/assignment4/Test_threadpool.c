@@ -0,0 +1,222 @@
+#include "unity.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include "../../examples/threading/threading-pool.h"
+
+/**
+ * Checks the work-stealing thread pool: results of waited tasks, detached tasks, tasks that
+ * submit and wait for subtasks from a worker, a full pool refusing try submissions and
+ * blocking submissions from its own workers, and shutdown running every queued task.
+ * Also runs start_task_obtaining_mutex the way the threading tests run
+ * start_thread_obtaining_mutex.
+ */
+
+#define WORKERS 4
+#define MAX_TASKS 1024
+#define TASKS 500
+// A tree of depth NESTED_DEPTH has 2^(NESTED_DEPTH + 1) - 1 tasks, which must fit MAX_TASKS.
+#define NESTED_DEPTH 8
+
+static atomic_size_t completed;
+
+static void *add_one(void *arg)
+{
+    return (void *)((uintptr_t)arg + 1);
+}
+
+static void *count_task(void *arg)
+{
+    (void)arg;
+    atomic_fetch_add(&completed, 1);
+    return NULL;
+}
+
+struct nested_args {
+    struct threadpool *pool;
+    unsigned depth;
+};
+
+/**
+ * Returns the number of leaves below it, found by submitting a task for each child and
+ * waiting for both from the worker it runs on.
+ */
+static void *nested_task(void *arg)
+{
+    struct nested_args *self = arg;
+    if (self->depth == 0) {
+        return (void *)1;
+    }
+    struct nested_args children[2];
+    struct tp_task *tasks[2];
+    for (int i = 0; i < 2; i++) {
+        children[i].pool = self->pool;
+        children[i].depth = self->depth - 1;
+        tasks[i] = threadpool_submit(self->pool, nested_task, &children[i]);
+        if (tasks[i] == NULL) {
+            return NULL;
+        }
+    }
+    uintptr_t leaves = 0;
+    for (int i = 0; i < 2; i++) {
+        leaves += (uintptr_t)tp_task_wait(tasks[i]);
+    }
+    return (void *)leaves;
+}
+
+struct full_pool_submits {
+    struct threadpool *pool;
+    struct tp_task *task;
+    int task_errno;
+    bool detached;
+    size_t completed_after_detached;
+};
+
+/**
+ * Submits from a worker of a pool whose only descriptor it holds itself.
+ */
+static void *submit_when_full(void *arg)
+{
+    struct full_pool_submits *self = arg;
+    errno = 0;
+    self->task = threadpool_submit(self->pool, add_one, NULL);
+    self->task_errno = errno;
+    self->detached = threadpool_submit_detached(self->pool, count_task, NULL);
+    self->completed_after_detached = atomic_load(&completed);
+    return NULL;
+}
+
+static void *locked_task(void *arg)
+{
+    pthread_mutex_t *mutex = arg;
+    pthread_mutex_lock(mutex);
+    pthread_mutex_unlock(mutex);
+    atomic_fetch_add(&completed, 1);
+    return NULL;
+}
+
+void test_threadpool_submit_wait()
+{
+    struct threadpool *pool = threadpool_create(WORKERS, MAX_TASKS);
+    TEST_ASSERT_NOT_NULL_MESSAGE(pool, "could not create the pool");
+    struct tp_task *tasks[TASKS];
+    for (uintptr_t i = 0; i < TASKS; i++) {
+        tasks[i] = threadpool_submit(pool, add_one, (void *)i);
+        TEST_ASSERT_NOT_NULL_MESSAGE(tasks[i], "submit failed");
+    }
+    // Waited in reverse, so most tasks are done and some still queued when waited for.
+    for (uintptr_t i = TASKS; i-- > 0;) {
+        TEST_ASSERT_EQUAL_PTR_MESSAGE((void *)(i + 1), tp_task_wait(tasks[i]),
+                "tp_task_wait should return the task's result");
+    }
+    threadpool_destroy(pool);
+}
+
+void test_threadpool_detached()
+{
+    struct threadpool *pool = threadpool_create(WORKERS, MAX_TASKS);
+    TEST_ASSERT_NOT_NULL_MESSAGE(pool, "could not create the pool");
+    atomic_store(&completed, 0);
+    // More than MAX_TASKS, so submitting must wait for descriptors to be released.
+    for (size_t i = 0; i < 4 * MAX_TASKS; i++) {
+        TEST_ASSERT_TRUE_MESSAGE(threadpool_submit_detached(pool, count_task, NULL),
+                "detached submit failed");
+    }
+    while (atomic_load(&completed) < 4 * MAX_TASKS) {
+        usleep(1000);
+    }
+    threadpool_destroy(pool);
+    TEST_ASSERT_EQUAL_UINT64_MESSAGE(4 * MAX_TASKS, atomic_load(&completed),
+            "every detached task should run exactly once");
+}
+
+void test_threadpool_nested_wait()
+{
+    // Fewer workers than levels, so waiting workers must run queued subtasks themselves.
+    struct threadpool *pool = threadpool_create(2, MAX_TASKS);
+    TEST_ASSERT_NOT_NULL_MESSAGE(pool, "could not create the pool");
+    struct nested_args root = { .pool = pool, .depth = NESTED_DEPTH };
+    struct tp_task *task = threadpool_submit(pool, nested_task, &root);
+    TEST_ASSERT_NOT_NULL_MESSAGE(task, "submit failed");
+    TEST_ASSERT_EQUAL_UINT64_MESSAGE(1u << NESTED_DEPTH, (uintptr_t)tp_task_wait(task),
+            "nested tasks should count every leaf");
+    threadpool_destroy(pool);
+}
+
+void test_threadpool_try_submit_full()
+{
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    struct threadpool *pool = threadpool_create(1, 2);
+    TEST_ASSERT_NOT_NULL_MESSAGE(pool, "could not create the pool");
+    atomic_store(&completed, 0);
+    pthread_mutex_lock(&mutex);
+    TEST_ASSERT_TRUE_MESSAGE(threadpool_try_submit_detached(pool, locked_task, &mutex),
+            "first task should fit");
+    TEST_ASSERT_TRUE_MESSAGE(threadpool_try_submit_detached(pool, locked_task, &mutex),
+            "second task should fit");
+    errno = 0;
+    TEST_ASSERT_TRUE_MESSAGE(!threadpool_try_submit_detached(pool, locked_task, &mutex),
+            "a full pool should refuse the task");
+    TEST_ASSERT_EQUAL_INT(EAGAIN, errno);
+    pthread_mutex_unlock(&mutex);
+    threadpool_destroy(pool);
+    TEST_ASSERT_EQUAL_UINT64_MESSAGE(2, atomic_load(&completed), "both queued tasks should run");
+}
+
+void test_threadpool_submit_from_worker_when_full()
+{
+    // With one descriptor, held by the submitting task, nothing could ever free another.
+    struct threadpool *pool = threadpool_create(1, 1);
+    TEST_ASSERT_NOT_NULL_MESSAGE(pool, "could not create the pool");
+    atomic_store(&completed, 0);
+    struct full_pool_submits submits = { .pool = pool };
+    struct tp_task *task = threadpool_submit(pool, submit_when_full, &submits);
+    TEST_ASSERT_NOT_NULL_MESSAGE(task, "submit failed");
+    tp_task_wait(task);
+    TEST_ASSERT_NULL_MESSAGE(submits.task, "a worker's submit to a full pool should fail");
+    TEST_ASSERT_EQUAL_INT(EAGAIN, submits.task_errno);
+    TEST_ASSERT_TRUE_MESSAGE(submits.detached, "a worker's detached submit should succeed");
+    TEST_ASSERT_EQUAL_UINT64_MESSAGE(1, submits.completed_after_detached,
+            "a detached task submitted to a full pool should run inline");
+    threadpool_destroy(pool);
+}
+
+void test_threadpool_shutdown_runs_queued()
+{
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    struct threadpool *pool = threadpool_create(WORKERS, MAX_TASKS);
+    TEST_ASSERT_NOT_NULL_MESSAGE(pool, "could not create the pool");
+    atomic_store(&completed, 0);
+    // Every worker blocks on the mutex, so the tasks are still queued when destroy starts.
+    pthread_mutex_lock(&mutex);
+    for (size_t i = 0; i < TASKS; i++) {
+        TEST_ASSERT_TRUE_MESSAGE(threadpool_submit_detached(pool, locked_task, &mutex),
+                "detached submit failed");
+    }
+    pthread_mutex_unlock(&mutex);
+    threadpool_destroy(pool);
+    TEST_ASSERT_EQUAL_UINT64_MESSAGE(TASKS, atomic_load(&completed),
+            "destroy should run every queued task first");
+}
+
+void test_start_task_obtaining_mutex()
+{
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    struct threadpool *pool = threadpool_create(WORKERS, MAX_TASKS);
+    TEST_ASSERT_NOT_NULL_MESSAGE(pool, "could not create the pool");
+    struct thread_data data;
+    struct tp_task *task;
+    pthread_mutex_lock(&mutex);
+    TEST_ASSERT_TRUE_MESSAGE(start_task_obtaining_mutex(pool, &task, &data, &mutex, 0, 10),
+            "start_task_obtaining_mutex failed");
+    usleep(50000);
+    TEST_ASSERT_TRUE_MESSAGE(!data.thread_complete_success,
+            "the task should not complete while the mutex is held");
+    pthread_mutex_unlock(&mutex);
+    TEST_ASSERT_EQUAL_PTR_MESSAGE(&data, tp_task_wait(task), "the task should return its thread_data");
+    TEST_ASSERT_TRUE_MESSAGE(data.thread_complete_success, "the task should complete once the mutex is free");
+    threadpool_destroy(pool);
+}
@@ -0,0 +1,101 @@
+#!/bin/bash
+# Restarts a replication primary under a follower and checks that the
+# follower ends up with every record of both primary instances, in order.
+# The restarted primary writes more records than the follower had seen, so
+# a follower that resumed by sequence number alone would skip some of them.
+# Usage: replication-restart-test.sh [path to aesdsocket]
+
+set -e
+set -u
+
+AESDSOCKET=${1:-$(dirname "$0")/../../server/aesdsocket}
+PRIMARY_PORT=9471
+FOLLOWER_PORT=9472
+WORKDIR=$(mktemp -d /tmp/replication-restart-XXXXXX)
+primary_pid=
+follower_pid=
+
+cleanup() {
+	for pid in $primary_pid $follower_pid
+	do
+		kill -CONT "$pid" 2>/dev/null || true
+		kill "$pid" 2>/dev/null || true
+	done
+	wait 2>/dev/null || true
+	rm -rf "$WORKDIR"
+}
+trap cleanup EXIT
+
+# Sends one line and reads the reply, which ends when the server closes.
+send_line() {
+	exec 3<>/dev/tcp/127.0.0.1/$1
+	printf '%s\n' "$2" >&3
+	cat <&3 >/dev/null
+	exec 3<&-
+}
+
+# Waits up to 10 seconds for something to listen on port $1.
+wait_listening() {
+	for i in $(seq 1 100)
+	do
+		if (exec 3<>/dev/tcp/127.0.0.1/$1) 2>/dev/null
+		then
+			return 0
+		fi
+		sleep 0.1
+	done
+	echo "nothing listening on port $1"
+	exit 1
+}
+
+# Waits up to 10 seconds for file $1 to have the contents of file $2.
+wait_same() {
+	for i in $(seq 1 100)
+	do
+		if cmp -s "$1" "$2"
+		then
+			return 0
+		fi
+		sleep 0.1
+	done
+	echo "expected:"
+	cat "$2"
+	echo "follower has:"
+	cat "$1"
+	exit 1
+}
+
+start_primary() {
+	"$AESDSOCKET" -R -l $PRIMARY_PORT -D "$WORKDIR/primary" >>"$WORKDIR/primary.log" 2>&1 &
+	primary_pid=$!
+	wait_listening $PRIMARY_PORT
+}
+
+start_primary
+"$AESDSOCKET" -F 127.0.0.1:$PRIMARY_PORT -l $FOLLOWER_PORT -D "$WORKDIR/follower" >"$WORKDIR/follower.log" 2>&1 &
+follower_pid=$!
+wait_listening $FOLLOWER_PORT
+
+for i in 1 2 3
+do
+	send_line $PRIMARY_PORT "first primary record $i"
+	echo "first primary record $i" >>"$WORKDIR/expected"
+done
+wait_same "$WORKDIR/follower" "$WORKDIR/expected"
+
+# The follower is stopped while the primary restarts with an empty log and
+# writes its records, so it only reconnects once they are all there.
+kill -STOP $follower_pid
+kill $primary_pid
+wait $primary_pid || true
+rm "$WORKDIR/primary"
+start_primary
+for i in 1 2 3 4 5
+do
+	send_line $PRIMARY_PORT "second primary record $i"
+	echo "second primary record $i" >>"$WORKDIR/expected"
+done
+kill -CONT $follower_pid
+
+wait_same "$WORKDIR/follower" "$WORKDIR/expected"
+echo "follower has every record of both primaries"
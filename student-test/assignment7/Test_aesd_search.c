@@ -0,0 +1,75 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "../../aesd-char-driver/aesd-search.h"
+
+/**
+ * Checks aesd_search_match against a naive search over seeded random texts
+ * from a small alphabet, so that partial matches and skips are common.
+ */
+
+#define SEARCH_ROUNDS 200000
+#define MAX_TEXT_LEN 300
+
+static uint64_t rng_state = 0x5ea4c4;
+
+static uint64_t rng(void)
+{
+    uint64_t x = rng_state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return rng_state = x;
+}
+
+static void fill_random(char *buf, size_t len, unsigned alphabet)
+{
+    for (size_t i = 0; i < len; i++) {
+        // Include bytes above 0x7f, which index the skip table unsigned.
+        buf[i] = (rng() % 8 == 0) ? (char)(0x80 + rng() % alphabet) : (char)('a' + rng() % alphabet);
+    }
+}
+
+static bool naive_match(const char *text, size_t len, const char *pattern, size_t pattern_len)
+{
+    for (size_t pos = 0; pos + pattern_len <= len; pos++) {
+        if (memcmp(text + pos, pattern, pattern_len) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void test_aesd_search_matches_naive_search()
+{
+    char text[MAX_TEXT_LEN];
+    char pattern[AESD_SEARCH_MAX_PATTERN];
+    for (size_t round = 0; round < SEARCH_ROUNDS; round++) {
+        unsigned alphabet = 1 + rng() % 4;
+        size_t len = rng() % MAX_TEXT_LEN;
+        size_t pattern_len = 1 + rng() % (round % 4 == 0 ? AESD_SEARCH_MAX_PATTERN : 6);
+        fill_random(text, len, alphabet);
+        if (len >= pattern_len && rng() % 2 == 0) {
+            // Plant the pattern somewhere in the text.
+            size_t at = rng() % (len - pattern_len + 1);
+            memcpy(pattern, text + at, pattern_len);
+        } else {
+            fill_random(pattern, pattern_len, alphabet);
+        }
+
+        struct aesd_search search;
+        TEST_ASSERT_EQUAL_INT(0, aesd_search_init(&search, pattern, pattern_len));
+        TEST_ASSERT_EQUAL_MESSAGE(naive_match(text, len, pattern, pattern_len),
+                aesd_search_match(&search, text, len), "search disagrees with naive search");
+    }
+}
+
+void test_aesd_search_rejects_bad_patterns()
+{
+    struct aesd_search search;
+    char pattern[AESD_SEARCH_MAX_PATTERN + 1] = { 0 };
+    TEST_ASSERT_EQUAL_INT(-1, aesd_search_init(&search, pattern, 0));
+    TEST_ASSERT_EQUAL_INT(-1, aesd_search_init(&search, pattern, AESD_SEARCH_MAX_PATTERN + 1));
+    TEST_ASSERT_EQUAL_INT(0, aesd_search_init(&search, pattern, AESD_SEARCH_MAX_PATTERN));
+}
@@ -0,0 +1,301 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "../../aesd-char-driver/aesd-circular-buffer.h"
+
+/**
+ * Randomized model check of the aesd_circular_buffer functions.
+ *
+ * Every operation is applied both to the circular buffer and to a reference
+ * model, a plain array of the live entries from oldest to newest, and the
+ * results are compared. Sequences are generated from fixed seeds, so a
+ * failure reproduces on every run.
+ */
+
+#define CAPACITY AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
+#define RANDOM_OPERATIONS 1000000
+#define RANDOM_SEEDS 4
+#define ROUND_TRIP_FILLS 20000
+#define COPY_OUT_FILLS 20000
+#define MAX_ENTRY_SIZE 4096
+#define POOL_ENTRIES (1 << 16)
+
+struct model {
+    struct aesd_buffer_entry entries[CAPACITY];
+    size_t count;
+};
+
+/**
+ * Entries point into a pool of random bytes, at a different start for each
+ * live entry, so entries can be told apart by address and by contents.
+ */
+static char pool[POOL_ENTRIES + MAX_ENTRY_SIZE];
+static uint64_t rng_state;
+static size_t next_entry;
+
+static uint64_t rng(void)
+{
+    uint64_t x = rng_state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return rng_state = x;
+}
+
+static size_t rng_below(size_t n)
+{
+    return n == 0 ? 0 : rng() % n;
+}
+
+static size_t random_size(unsigned zero_percent)
+{
+    if (rng_below(100) < zero_percent) {
+        return 0;
+    }
+    // Mostly short lines, with the odd long one.
+    return rng_below(8) == 0 ? 1 + rng_below(MAX_ENTRY_SIZE) : 1 + rng_below(40);
+}
+
+static const char *model_add(struct model *model, const struct aesd_buffer_entry *entry)
+{
+    const char *evicted = NULL;
+    if (model->count == CAPACITY) {
+        evicted = model->entries[0].buffptr;
+        memmove(&model->entries[0], &model->entries[1], (CAPACITY - 1) * sizeof(*entry));
+        model->count--;
+    }
+    model->entries[model->count++] = *entry;
+    return evicted;
+}
+
+static size_t model_len(const struct model *model)
+{
+    size_t len = 0;
+    for (size_t i = 0; i < model->count; i++) {
+        len += model->entries[i].size;
+    }
+    return len;
+}
+
+/**
+ * @return the index of the model entry holding @param fpos, or -1 if it is past the end,
+ * setting @param offset to the byte within it.
+ */
+static long model_find(const struct model *model, size_t fpos, size_t *offset)
+{
+    for (size_t i = 0; i < model->count; i++) {
+        if (fpos < model->entries[i].size) {
+            *offset = fpos;
+            return i;
+        }
+        fpos -= model->entries[i].size;
+    }
+    return -1;
+}
+
+/**
+ * Copies the model contents from @param fpos into @param dest, up to @param count bytes
+ */
+static size_t model_copy_out(const struct model *model, size_t fpos, char *dest, size_t count)
+{
+    size_t copied = 0;
+    for (size_t i = 0; i < model->count && copied < count; i++) {
+        const struct aesd_buffer_entry *entry = &model->entries[i];
+        if (fpos >= entry->size) {
+            fpos -= entry->size;
+            continue;
+        }
+        size_t len = entry->size - fpos;
+        if (len > count - copied) {
+            len = count - copied;
+        }
+        memcpy(dest + copied, entry->buffptr + fpos, len);
+        copied += len;
+        fpos = 0;
+    }
+    return copied;
+}
+
+static long long model_fpos(const struct model *model, size_t index, size_t offset)
+{
+    long long fpos = 0;
+    for (size_t i = 0; i < model->count; i++) {
+        if (i == index) {
+            return fpos + (offset < model->entries[i].size ? offset : model->entries[i].size);
+        }
+        fpos += model->entries[i].size;
+    }
+    return fpos;
+}
+
+/**
+ * @return the position of @param entry relative to the oldest entry of @param buffer
+ */
+static size_t buffer_index(const struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *entry)
+{
+    return (entry - buffer->entry + CAPACITY - buffer->out_offs) % CAPACITY;
+}
+
+static void check_add(struct aesd_circular_buffer *buffer, struct model *model, unsigned zero_percent)
+{
+    struct aesd_buffer_entry entry;
+    entry.buffptr = &pool[next_entry++ % POOL_ENTRIES];
+    entry.size = random_size(zero_percent);
+    entry.compressed_size = 0;
+    const char *expected = model_add(model, &entry);
+    const char *evicted = aesd_circular_buffer_add_entry(buffer, &entry);
+    TEST_ASSERT_EQUAL_PTR_MESSAGE(expected, evicted, "add should return the evicted entry");
+}
+
+static void check_find(struct aesd_circular_buffer *buffer, const struct model *model, size_t fpos)
+{
+    size_t expected_offset = 0;
+    long expected = model_find(model, fpos, &expected_offset);
+    size_t offset = 0;
+    struct aesd_buffer_entry *entry = aesd_circular_buffer_find_entry_offset_for_fpos(buffer, fpos, &offset);
+    if (expected == -1) {
+        TEST_ASSERT_NULL_MESSAGE(entry, "no entry past the end of the buffer");
+        return;
+    }
+    TEST_ASSERT_NOT_NULL_MESSAGE(entry, "fpos inside the buffer should be found");
+    TEST_ASSERT_EQUAL_PTR_MESSAGE(model->entries[expected].buffptr, entry->buffptr, "wrong entry for fpos");
+    TEST_ASSERT_EQUAL_UINT64_MESSAGE(expected_offset, offset, "wrong offset within entry");
+    TEST_ASSERT_EQUAL_UINT64_MESSAGE(expected, buffer_index(buffer, entry), "wrong entry index");
+}
+
+static void check_round_trip(struct aesd_circular_buffer *buffer, size_t fpos)
+{
+    size_t offset;
+    struct aesd_buffer_entry *entry = aesd_circular_buffer_find_entry_offset_for_fpos(buffer, fpos, &offset);
+    TEST_ASSERT_NOT_NULL(entry);
+    long long back = aesd_circular_buffer_find_fpos_for_entry_offset(buffer, buffer_index(buffer, entry), offset);
+    TEST_ASSERT_EQUAL_INT64_MESSAGE(fpos, back, "fpos -> entry/offset -> fpos should round trip");
+}
+
+static void run_random_operations(uint64_t seed, unsigned zero_percent)
+{
+    struct aesd_circular_buffer buffer;
+    struct model model;
+    aesd_circular_buffer_init(&buffer);
+    memset(&model, 0, sizeof(model));
+    rng_state = seed;
+
+    for (size_t op = 0; op < RANDOM_OPERATIONS; op++) {
+        size_t len = model_len(&model);
+        unsigned choice = rng_below(100);
+        if (choice < 40) {
+            check_add(&buffer, &model, zero_percent);
+        } else if (choice < 70) {
+            check_find(&buffer, &model, rng_below(len + 8));
+        } else if (choice < 85) {
+            size_t index = rng_below(model.count + 2);
+            size_t offset = rng_below(64);
+            TEST_ASSERT_EQUAL_INT64_MESSAGE(model_fpos(&model, index, offset),
+                    aesd_circular_buffer_find_fpos_for_entry_offset(&buffer, index, offset),
+                    "wrong fpos for entry offset");
+            struct aesd_buffer_entry *entry = aesd_circular_buffer_entry_at(&buffer, index);
+            if (index < model.count) {
+                TEST_ASSERT_NOT_NULL_MESSAGE(entry, "entry_at should find every live entry");
+                TEST_ASSERT_EQUAL_PTR_MESSAGE(model.entries[index].buffptr, entry->buffptr, "wrong entry_at");
+            } else {
+                TEST_ASSERT_NULL_MESSAGE(entry, "no entry past the newest");
+            }
+        } else if (choice < 95) {
+            TEST_ASSERT_EQUAL_UINT64_MESSAGE(len, aesd_circular_buffer_len(&buffer), "wrong length");
+        } else if (choice < 99) {
+            if (len > 0) {
+                check_round_trip(&buffer, rng_below(len));
+            }
+        } else {
+            // Start over, so runs also cover a fresh buffer at every offset.
+            aesd_circular_buffer_init(&buffer);
+            memset(&model, 0, sizeof(model));
+        }
+    }
+}
+
+void test_circular_buffer_model_random_operations()
+{
+    for (uint64_t seed = 1; seed <= RANDOM_SEEDS; seed++) {
+        run_random_operations(seed * 0x9e3779b97f4a7c15ULL, 5);
+    }
+}
+
+void test_circular_buffer_model_empty_entries()
+{
+    // Zero length writes must be skipped by every fpos calculation.
+    run_random_operations(0x5eed, 60);
+}
+
+void test_circular_buffer_model_fpos_round_trip()
+{
+    struct aesd_circular_buffer buffer;
+    struct model model;
+    aesd_circular_buffer_init(&buffer);
+    memset(&model, 0, sizeof(model));
+    rng_state = 0xfeedbeef;
+
+    for (size_t fill = 0; fill < ROUND_TRIP_FILLS; fill++) {
+        // A varying number of adds moves the start of the ring around.
+        size_t adds = 1 + rng_below(CAPACITY + 2);
+        for (size_t i = 0; i < adds; i++) {
+            check_add(&buffer, &model, 10);
+        }
+        size_t len = model_len(&model);
+        TEST_ASSERT_EQUAL_UINT64(len, aesd_circular_buffer_len(&buffer));
+        for (size_t fpos = 0; fpos < len; fpos += 1 + rng_below(16)) {
+            check_find(&buffer, &model, fpos);
+            check_round_trip(&buffer, fpos);
+        }
+        check_find(&buffer, &model, len);
+    }
+}
+
+void test_circular_buffer_model_copy_out()
+{
+    static char expected[MAX_ENTRY_SIZE * CAPACITY];
+    static char copied[MAX_ENTRY_SIZE * CAPACITY];
+    struct aesd_circular_buffer buffer;
+    struct model model;
+    aesd_circular_buffer_init(&buffer);
+    memset(&model, 0, sizeof(model));
+    rng_state = 0xc0ffee;
+    for (size_t i = 0; i < sizeof(pool); i++) {
+        pool[i] = rng();
+    }
+
+    for (size_t fill = 0; fill < COPY_OUT_FILLS; fill++) {
+        size_t adds = 1 + rng_below(CAPACITY + 2);
+        for (size_t i = 0; i < adds; i++) {
+            check_add(&buffer, &model, 10);
+        }
+        size_t len = model_len(&model);
+        size_t fpos = rng_below(len + 8);
+        size_t count = rng_below(len + 8);
+        size_t expected_len = model_copy_out(&model, fpos, expected, count);
+
+        TEST_ASSERT_EQUAL_UINT64_MESSAGE(expected_len, aesd_circular_buffer_copy_out(&buffer, fpos, copied, count),
+                "wrong number of bytes copied");
+        if (expected_len > 0) {
+            TEST_ASSERT_EQUAL_MEMORY_MESSAGE(expected, copied, expected_len, "wrong bytes copied");
+        }
+
+        // With a short vector the copy stops early, but must match as far as it goes.
+        struct aesd_iovec vec[CAPACITY];
+        size_t vec_count = 1 + rng_below(CAPACITY);
+        size_t max_vecs = vec_count;
+        size_t described = aesd_circular_buffer_fill_iovec(&buffer, fpos, vec, &vec_count, count);
+        TEST_ASSERT_TRUE_MESSAGE(vec_count <= max_vecs, "too many iovec entries");
+        if (vec_count < max_vecs) {
+            TEST_ASSERT_EQUAL_UINT64_MESSAGE(expected_len, described, "iovec should describe every byte");
+        }
+        size_t total = 0;
+        for (size_t i = 0; i < vec_count; i++) {
+            TEST_ASSERT_TRUE_MESSAGE(vec[i].iov_len > 0, "empty iovec entry");
+            TEST_ASSERT_EQUAL_MEMORY_MESSAGE(expected + total, vec[i].iov_base, vec[i].iov_len, "wrong iovec contents");
+            total += vec[i].iov_len;
+        }
+        TEST_ASSERT_EQUAL_UINT64_MESSAGE(described, total, "iovec lengths should add up");
+    }
+}
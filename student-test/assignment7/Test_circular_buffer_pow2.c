@@ -0,0 +1,173 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "../../aesd-char-driver/aesd-circular-buffer-pow2.h"
+
+/**
+ * Randomized check of the power of two circular buffer against a reference
+ * model, a plain array of the live entries from oldest to newest, including
+ * runs where the free-running head and tail counters overflow.
+ */
+
+#define CAPACITY 16
+#define RANDOM_OPERATIONS 500000
+#define MAX_ENTRY_SIZE 64
+#define POOL_SIZE 4096
+
+AESD_CIRCULAR_BUFFER_POW2_DEFINE(ring16, CAPACITY)
+AESD_CIRCULAR_BUFFER_POW2_DEFINE(ring1, 1)
+
+struct model {
+    struct aesd_buffer_entry entries[CAPACITY];
+    size_t count;
+};
+
+static char pool[POOL_SIZE + MAX_ENTRY_SIZE];
+static uint64_t rng_state;
+
+static uint64_t rng(void)
+{
+    uint64_t x = rng_state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return rng_state = x;
+}
+
+static size_t rng_below(size_t n)
+{
+    return n == 0 ? 0 : rng() % n;
+}
+
+static const char *model_add(struct model *model, const struct aesd_buffer_entry *entry)
+{
+    const char *evicted = NULL;
+    if (model->count == CAPACITY) {
+        evicted = model->entries[0].buffptr;
+        memmove(&model->entries[0], &model->entries[1], (CAPACITY - 1) * sizeof(*entry));
+        model->count--;
+    }
+    model->entries[model->count++] = *entry;
+    return evicted;
+}
+
+static size_t model_len(const struct model *model)
+{
+    size_t len = 0;
+    for (size_t i = 0; i < model->count; i++) {
+        len += model->entries[i].size;
+    }
+    return len;
+}
+
+static long model_find(const struct model *model, size_t fpos, size_t *offset)
+{
+    for (size_t i = 0; i < model->count; i++) {
+        if (fpos < model->entries[i].size) {
+            *offset = fpos;
+            return i;
+        }
+        fpos -= model->entries[i].size;
+    }
+    return -1;
+}
+
+static void run_random_operations(uint64_t seed, uint32_t start_count)
+{
+    static char expected[CAPACITY * MAX_ENTRY_SIZE];
+    static char copied[CAPACITY * MAX_ENTRY_SIZE];
+    struct ring16 buffer;
+    struct model model;
+    ring16_init(&buffer);
+    // An empty buffer may start at any count; near UINT32_MAX the counters overflow mid run.
+    buffer.head = buffer.tail = start_count;
+    memset(&model, 0, sizeof(model));
+    rng_state = seed;
+    for (size_t i = 0; i < sizeof(pool); i++) {
+        pool[i] = rng();
+    }
+
+    for (size_t op = 0; op < RANDOM_OPERATIONS; op++) {
+        size_t len = model_len(&model);
+        unsigned choice = rng_below(100);
+        if (choice < 40) {
+            struct aesd_buffer_entry entry;
+            entry.buffptr = &pool[rng_below(POOL_SIZE)];
+            entry.size = rng_below(10) == 0 ? 0 : 1 + rng_below(MAX_ENTRY_SIZE);
+            entry.compressed_size = 0;
+            const char *expected_evicted = model_add(&model, &entry);
+            TEST_ASSERT_EQUAL_PTR_MESSAGE(expected_evicted, ring16_add_entry(&buffer, &entry),
+                    "add should return the evicted entry");
+        } else if (choice < 65) {
+            size_t fpos = rng_below(len + 8);
+            size_t expected_offset = 0;
+            size_t offset = 0;
+            long expected_index = model_find(&model, fpos, &expected_offset);
+            TEST_ASSERT_EQUAL_INT64_MESSAGE(expected_index, ring16_find_entry_offset_for_fpos(&buffer, fpos, &offset),
+                    "wrong entry for fpos");
+            if (expected_index != -1) {
+                TEST_ASSERT_EQUAL_UINT64_MESSAGE(expected_offset, offset, "wrong offset within entry");
+            }
+        } else if (choice < 80) {
+            size_t index = rng_below(model.count + 2);
+            struct aesd_buffer_entry entry;
+            bool found = ring16_entry_at(&buffer, index, &entry);
+            TEST_ASSERT_EQUAL_MESSAGE(index < model.count, found, "entry_at should find every live entry");
+            if (found) {
+                TEST_ASSERT_EQUAL_PTR_MESSAGE(model.entries[index].buffptr, entry.buffptr, "wrong entry_at");
+                TEST_ASSERT_EQUAL_UINT64_MESSAGE(model.entries[index].size, entry.size, "wrong entry_at size");
+            }
+        } else if (choice < 90) {
+            TEST_ASSERT_EQUAL_UINT64_MESSAGE(model.count, ring16_count(&buffer), "wrong count");
+            TEST_ASSERT_EQUAL_UINT64_MESSAGE(len, ring16_len(&buffer), "wrong length");
+        } else {
+            size_t fpos = rng_below(len + 8);
+            size_t count = rng_below(len + 8);
+            size_t expected_len = 0;
+            for (size_t i = 0, skip = fpos; i < model.count && expected_len < count; i++) {
+                const struct aesd_buffer_entry *entry = &model.entries[i];
+                if (skip >= entry->size) {
+                    skip -= entry->size;
+                    continue;
+                }
+                size_t n = entry->size - skip < count - expected_len ? entry->size - skip : count - expected_len;
+                memcpy(expected + expected_len, entry->buffptr + skip, n);
+                expected_len += n;
+                skip = 0;
+            }
+            TEST_ASSERT_EQUAL_UINT64_MESSAGE(expected_len, ring16_copy_out(&buffer, fpos, copied, count),
+                    "wrong number of bytes copied");
+            if (expected_len > 0) {
+                TEST_ASSERT_EQUAL_MEMORY_MESSAGE(expected, copied, expected_len, "wrong bytes copied");
+            }
+        }
+    }
+}
+
+void test_circular_buffer_pow2_random_operations()
+{
+    run_random_operations(0x9e3779b97f4a7c15ULL, 0);
+}
+
+void test_circular_buffer_pow2_counter_overflow()
+{
+    run_random_operations(0xfeedbeef, UINT32_MAX - 1000);
+}
+
+void test_circular_buffer_pow2_capacity_one()
+{
+    struct ring1 buffer;
+    ring1_init(&buffer);
+    struct aesd_buffer_entry first = { .buffptr = "one\n", .size = 4 };
+    struct aesd_buffer_entry second = { .buffptr = "three\n", .size = 6 };
+    TEST_ASSERT_NULL(ring1_add_entry(&buffer, &first));
+    TEST_ASSERT_EQUAL_UINT64(4, ring1_len(&buffer));
+    TEST_ASSERT_EQUAL_PTR(first.buffptr, ring1_add_entry(&buffer, &second));
+    TEST_ASSERT_EQUAL_UINT64(1, ring1_count(&buffer));
+    TEST_ASSERT_EQUAL_UINT64(6, ring1_len(&buffer));
+    size_t offset;
+    TEST_ASSERT_EQUAL_INT64(0, ring1_find_entry_offset_for_fpos(&buffer, 5, &offset));
+    TEST_ASSERT_EQUAL_UINT64(5, offset);
+    TEST_ASSERT_EQUAL_INT64(-1, ring1_find_entry_offset_for_fpos(&buffer, 6, &offset));
+}
@@ -0,0 +1,181 @@
+/**
+ * @file circular-buffer-bench.c
+ * @brief Microbenchmark for aesd-circular-buffer.
+ *
+ * Reports ns/op for add, find-by-fpos and len on a full buffer, and for
+ * reading the whole buffer entry by entry with find-by-fpos ("walk") or in
+ * one pass with aesd_circular_buffer_copy_out() ("copy"), with the
+ * capacity fixed at build time by AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED.
+ * When the capacity is a power of two, the same operations are also timed on the
+ * specialization from aesd-circular-buffer-pow2.h ("pow2-..."), for comparison.
+ * The CMake build produces one binary per capacity.
+ *
+ * Usage: circular-buffer-bench [-n ops] [-s entry_size]
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "../../aesd-char-driver/aesd-circular-buffer.h"
+#include "../../aesd-char-driver/aesd-circular-buffer-pow2.h"
+
+#define CAPACITY AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
+#define CAPACITY_IS_POW2 ((CAPACITY & (CAPACITY - 1)) == 0)
+
+#if CAPACITY_IS_POW2
+AESD_CIRCULAR_BUFFER_POW2_DEFINE(pow2_buffer, CAPACITY)
+#endif
+
+#define DEFAULT_OPS 2000000
+#define DEFAULT_ENTRY_SIZE 32
+
+static char line[4096];
+/** Keeps results alive so the calls are not optimized away */
+static volatile size_t sink;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t next_random(uint64_t *state)
+{
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+static void report(const char *op, size_t ops, uint64_t elapsed_ns)
+{
+    printf("capacity %3d %-10s %10zu ops %9.1f ns/op\n",
+           CAPACITY, op, ops, (double)elapsed_ns / ops);
+}
+
+int main(int argc, char *argv[])
+{
+    size_t ops = DEFAULT_OPS;
+    size_t entry_size = DEFAULT_ENTRY_SIZE;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+        switch (opt) {
+        case 'n':
+            ops = strtoull(optarg, NULL, 10);
+            break;
+        case 's':
+            entry_size = strtoull(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n ops] [-s entry_size]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (ops == 0 || entry_size == 0 || entry_size > sizeof(line)) {
+        fprintf(stderr, "ops must be positive and entry_size between 1 and %zu\n", sizeof(line));
+        return 1;
+    }
+
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry entry = { .buffptr = line, .size = entry_size };
+    aesd_circular_buffer_init(&buffer);
+
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < ops; i++) {
+        sink = (size_t)aesd_circular_buffer_add_entry(&buffer, &entry);
+    }
+    report("add", ops, now_ns() - start);
+
+    // The buffer is full now; look up positions spread across all entries.
+    size_t len = aesd_circular_buffer_len(&buffer);
+    uint64_t rng = 0x9e3779b97f4a7c15ULL;
+    size_t *positions = malloc(ops * sizeof(size_t));
+    if (positions == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    for (size_t i = 0; i < ops; i++) {
+        positions[i] = next_random(&rng) % len;
+    }
+    size_t offset;
+    start = now_ns();
+    for (size_t i = 0; i < ops; i++) {
+        sink = (size_t)aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, positions[i], &offset);
+    }
+    report("find", ops, now_ns() - start);
+    free(positions);
+
+    start = now_ns();
+    for (size_t i = 0; i < ops; i++) {
+        sink = aesd_circular_buffer_len(&buffer);
+    }
+    report("len", ops, now_ns() - start);
+
+    char *contents = malloc(len);
+    if (contents == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    size_t copies = ops / AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED + 1;
+    start = now_ns();
+    for (size_t i = 0; i < copies; i++) {
+        struct aesd_buffer_entry *found;
+        size_t fpos = 0;
+        while ((found = aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, fpos, &offset)) != NULL) {
+            memcpy(contents + fpos, found->buffptr + offset, found->size - offset);
+            fpos += found->size - offset;
+        }
+        sink = fpos;
+    }
+    report("walk", copies, now_ns() - start);
+
+    start = now_ns();
+    for (size_t i = 0; i < copies; i++) {
+        sink = aesd_circular_buffer_copy_out(&buffer, 0, contents, len);
+    }
+    report("copy", copies, now_ns() - start);
+
+#if CAPACITY_IS_POW2
+    struct pow2_buffer pow2;
+    pow2_buffer_init(&pow2);
+    start = now_ns();
+    for (size_t i = 0; i < ops; i++) {
+        sink = (size_t)pow2_buffer_add_entry(&pow2, &entry);
+    }
+    report("pow2-add", ops, now_ns() - start);
+
+    positions = malloc(ops * sizeof(size_t));
+    if (positions == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    rng = 0x9e3779b97f4a7c15ULL;
+    for (size_t i = 0; i < ops; i++) {
+        positions[i] = next_random(&rng) % len;
+    }
+    start = now_ns();
+    for (size_t i = 0; i < ops; i++) {
+        sink = pow2_buffer_find_entry_offset_for_fpos(&pow2, positions[i], &offset);
+    }
+    report("pow2-find", ops, now_ns() - start);
+    free(positions);
+
+    start = now_ns();
+    for (size_t i = 0; i < ops; i++) {
+        sink = pow2_buffer_len(&pow2);
+    }
+    report("pow2-len", ops, now_ns() - start);
+
+    start = now_ns();
+    for (size_t i = 0; i < copies; i++) {
+        sink = pow2_buffer_copy_out(&pow2, 0, contents, len);
+    }
+    report("pow2-copy", copies, now_ns() - start);
+#endif
+    free(contents);
+    return 0;
+}
@@ -0,0 +1,231 @@
+/**
+ * @file circular-buffer-queue-bench.c
+ * @brief Producer/consumer benchmark of the lock-free circular buffer against the mutex-guarded one.
+ *
+ * Producer threads hand entries to one consumer thread through:
+ *   mutex  aesd_circular_buffer under a pthread mutex, as the driver and aesdsocket use it
+ *   spsc   aesd_lockfree_buffer in AESD_LOCKFREE_SPSC mode, always with one producer
+ *   mpsc   aesd_lockfree_buffer in AESD_LOCKFREE_MPSC mode
+ * Threads yield when the buffer is full or empty. The consumer checks that it receives every
+ * entry of each producer exactly once and in order, so the benchmark doubles as a stress test:
+ * build it with -fsanitize=thread to check the memory ordering as well.
+ *
+ * Usage: circular-buffer-queue-bench [-m mode[,mode...]] [-p producers] [-n entries_per_producer]
+ */
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "../../aesd-char-driver/aesd-circular-buffer.h"
+#include "../../aesd-char-driver/aesd-circular-buffer-lockfree.h"
+
+#define MAX_PRODUCERS 64
+#define DEFAULT_PRODUCERS 4
+#define DEFAULT_ENTRIES 1000000
+
+enum queue_mode {
+    QUEUE_MUTEX,
+    QUEUE_SPSC,
+    QUEUE_MPSC,
+};
+
+static const char *const mode_names[] = {
+    [QUEUE_MUTEX] = "mutex",
+    [QUEUE_SPSC] = "spsc",
+    [QUEUE_MPSC] = "mpsc",
+};
+
+struct queue {
+    enum queue_mode mode;
+    pthread_mutex_t lock;
+    struct aesd_circular_buffer locked;
+    struct aesd_lockfree_buffer lockfree;
+};
+
+struct producer {
+    pthread_t thread;
+    struct queue *queue;
+    unsigned id;
+    size_t entries;
+};
+
+/** An entry's buffptr points at its producer's element, its size is its sequence number */
+static char producer_ids[MAX_PRODUCERS];
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static bool queue_push(struct queue *queue, const struct aesd_buffer_entry *entry)
+{
+    if (queue->mode != QUEUE_MUTEX) {
+        return aesd_lockfree_buffer_push(&queue->lockfree, entry);
+    }
+    pthread_mutex_lock(&queue->lock);
+    bool added = !queue->locked.full;
+    if (added) {
+        aesd_circular_buffer_add_entry(&queue->locked, entry);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return added;
+}
+
+static bool queue_pop(struct queue *queue, struct aesd_buffer_entry *entry)
+{
+    if (queue->mode != QUEUE_MUTEX) {
+        return aesd_lockfree_buffer_pop(&queue->lockfree, entry);
+    }
+    pthread_mutex_lock(&queue->lock);
+    struct aesd_buffer_entry *oldest = aesd_circular_buffer_entry_at(&queue->locked, 0);
+    if (oldest != NULL) {
+        // aesd_circular_buffer only drops entries by overwriting them, so pop by hand.
+        *entry = *oldest;
+        queue->locked.out_offs = (queue->locked.out_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+        queue->locked.full = false;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return oldest != NULL;
+}
+
+static void *producer_thread(void *arg)
+{
+    struct producer *self = arg;
+    struct aesd_buffer_entry entry;
+    entry.buffptr = &producer_ids[self->id];
+    entry.compressed_size = 0;
+    for (size_t seq = 0; seq < self->entries; seq++) {
+        entry.size = seq;
+        while (!queue_push(self->queue, &entry)) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Receives every entry of @param producers producers, checking each producer's are in order.
+ * @return the number of entries out of order or from an unknown producer
+ */
+static size_t consume(struct queue *queue, unsigned producers, size_t entries)
+{
+    size_t next_seq[MAX_PRODUCERS] = { 0 };
+    size_t errors = 0;
+    for (size_t received = 0; received < producers * entries; received++) {
+        struct aesd_buffer_entry entry;
+        while (!queue_pop(queue, &entry)) {
+            sched_yield();
+        }
+        size_t id = entry.buffptr - producer_ids;
+        if (id >= producers || entry.size != next_seq[id]) {
+            if (errors++ < 10) {
+                fprintf(stderr, "%s: got entry %zu of producer %zu, expected %zu\n", mode_names[queue->mode],
+                        entry.size, id, id < producers ? next_seq[id] : 0);
+            }
+            continue;
+        }
+        next_seq[id]++;
+    }
+    return errors;
+}
+
+/**
+ * Runs @param mode with @param producers producer threads and prints the time per entry.
+ * @return the number of errors found
+ */
+static size_t run_bench(enum queue_mode mode, unsigned producers, size_t entries)
+{
+    static struct queue queue;
+    queue.mode = mode;
+    pthread_mutex_init(&queue.lock, NULL);
+    aesd_circular_buffer_init(&queue.locked);
+    aesd_lockfree_buffer_init(&queue.lockfree, mode == QUEUE_SPSC ? AESD_LOCKFREE_SPSC : AESD_LOCKFREE_MPSC);
+
+    struct producer threads[MAX_PRODUCERS];
+    uint64_t start = now_ns();
+    for (unsigned i = 0; i < producers; i++) {
+        threads[i].queue = &queue;
+        threads[i].id = i;
+        threads[i].entries = entries;
+        if (pthread_create(&threads[i].thread, NULL, producer_thread, &threads[i]) != 0) {
+            fprintf(stderr, "pthread_create failed\n");
+            exit(1);
+        }
+    }
+    size_t errors = consume(&queue, producers, entries);
+    for (unsigned i = 0; i < producers; i++) {
+        pthread_join(threads[i].thread, NULL);
+    }
+    uint64_t elapsed_ns = now_ns() - start;
+    pthread_mutex_destroy(&queue.lock);
+
+    size_t total = producers * entries;
+    printf("capacity %3d %-5s producers %2u %10zu entries %9.1f ns/entry %zu errors\n",
+           AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, mode_names[mode], producers, total,
+           (double)elapsed_ns / total, errors);
+    return errors;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *modes = "mutex,spsc,mpsc";
+    unsigned producers = DEFAULT_PRODUCERS;
+    size_t entries = DEFAULT_ENTRIES;
+    int opt;
+    while ((opt = getopt(argc, argv, "m:p:n:")) != -1) {
+        switch (opt) {
+        case 'm':
+            modes = optarg;
+            break;
+        case 'p':
+            producers = strtoul(optarg, NULL, 10);
+            break;
+        case 'n':
+            entries = strtoull(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-m mode[,mode...]] [-p producers] [-n entries_per_producer]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (producers < 1 || producers > MAX_PRODUCERS || entries == 0) {
+        fprintf(stderr, "producers must be between 1 and %d and entries positive\n", MAX_PRODUCERS);
+        return 1;
+    }
+
+    char *mode_list = strdup(modes);
+    if (mode_list == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    size_t errors = 0;
+    char *save;
+    for (char *name = strtok_r(mode_list, ",", &save); name != NULL; name = strtok_r(NULL, ",", &save)) {
+        enum queue_mode mode;
+        if (strcmp(name, "mutex") == 0) {
+            mode = QUEUE_MUTEX;
+        } else if (strcmp(name, "spsc") == 0) {
+            mode = QUEUE_SPSC;
+        } else if (strcmp(name, "mpsc") == 0) {
+            mode = QUEUE_MPSC;
+        } else {
+            fprintf(stderr, "unknown mode %s\n", name);
+            errors++;
+            continue;
+        }
+        // Single producer mode allows no more than one.
+        errors += run_bench(mode, mode == QUEUE_SPSC ? 1 : producers, entries);
+        if (mode != QUEUE_SPSC && producers > 1) {
+            // Also the single producer case, for comparison with spsc.
+            errors += run_bench(mode, 1, entries);
+        }
+    }
+    free(mode_list);
+    return errors == 0 ? 0 : 1;
+}
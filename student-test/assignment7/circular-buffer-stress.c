@@ -0,0 +1,195 @@
+/**
+ * @file circular-buffer-stress.c
+ * @brief Concurrent stress test for aesd-circular-buffer.
+ *
+ * Mirrors the locking done by the driver: writer threads add entries and free
+ * the evicted ones, reader threads look up random positions, all under one
+ * mutex. Every entry holds "<writer> <seq>\n", so readers can check that the
+ * entry found for an fpos is intact and that each writer's entries appear in
+ * order. Build with -fsanitize=thread to catch unlocked accesses.
+ *
+ * Usage: circular-buffer-stress [-w writers] [-r readers] [-n ops_per_thread]
+ */
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../../aesd-char-driver/aesd-circular-buffer.h"
+
+#define MAX_WRITERS 64
+#define DEFAULT_WRITERS 4
+#define DEFAULT_READERS 4
+#define DEFAULT_OPS 200000
+
+struct stress_thread {
+    pthread_t thread;
+    unsigned id;
+    unsigned writers;
+    size_t ops;
+    uint64_t rng;
+    size_t errors;
+};
+
+static struct aesd_circular_buffer buffer;
+static pthread_mutex_t buffer_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t next_random(uint64_t *state)
+{
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+/**
+ * @return true if @param entry holds a well formed record, setting @param writer and @param seq
+ */
+static bool parse_entry(const struct aesd_buffer_entry *entry, unsigned *writer, unsigned long *seq)
+{
+    char text[64];
+    if (entry->size == 0 || entry->size >= sizeof(text) || entry->buffptr[entry->size - 1] != '\n') {
+        return false;
+    }
+    memcpy(text, entry->buffptr, entry->size);
+    text[entry->size] = '\0';
+    int consumed = 0;
+    return sscanf(text, "%u %lu\n%n", writer, seq, &consumed) == 2 && (size_t)consumed == entry->size;
+}
+
+static void *writer_thread(void *arg)
+{
+    struct stress_thread *self = arg;
+    for (size_t seq = 0; seq < self->ops; seq++) {
+        char *line = malloc(64);
+        if (line == NULL) {
+            self->errors++;
+            break;
+        }
+        struct aesd_buffer_entry entry;
+        entry.buffptr = line;
+        entry.size = snprintf(line, 64, "%u %zu\n", self->id, seq);
+        entry.compressed_size = 0;
+
+        pthread_mutex_lock(&buffer_lock);
+        const char *evicted = aesd_circular_buffer_add_entry(&buffer, &entry);
+        pthread_mutex_unlock(&buffer_lock);
+        free((char *)evicted);
+    }
+    return NULL;
+}
+
+static void *reader_thread(void *arg)
+{
+    struct stress_thread *self = arg;
+    for (size_t op = 0; op < self->ops; op++) {
+        pthread_mutex_lock(&buffer_lock);
+        size_t len = aesd_circular_buffer_len(&buffer);
+        if (len == 0) {
+            pthread_mutex_unlock(&buffer_lock);
+            continue;
+        }
+
+        size_t offset;
+        size_t fpos = next_random(&self->rng) % len;
+        struct aesd_buffer_entry *found = aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, fpos, &offset);
+        unsigned writer;
+        unsigned long seq;
+        if (found == NULL || offset >= found->size || !parse_entry(found, &writer, &seq)) {
+            fprintf(stderr, "reader %u: bad entry for fpos %zu of %zu\n", self->id, fpos, len);
+            self->errors++;
+        }
+
+        // Walk the whole buffer: lengths must add up and each writer's
+        // entries must be in the order they were added.
+        unsigned long last_seq[MAX_WRITERS];
+        bool seen[MAX_WRITERS] = { false };
+        size_t total = 0;
+        struct aesd_buffer_entry *entry;
+        while ((entry = aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, total, &offset)) != NULL) {
+            if (!parse_entry(entry, &writer, &seq) || writer >= self->writers) {
+                fprintf(stderr, "reader %u: corrupt entry at fpos %zu\n", self->id, total);
+                self->errors++;
+                break;
+            }
+            if (seen[writer] && seq <= last_seq[writer]) {
+                fprintf(stderr, "reader %u: writer %u entry %lu after %lu\n", self->id, writer, seq, last_seq[writer]);
+                self->errors++;
+            }
+            seen[writer] = true;
+            last_seq[writer] = seq;
+            total += entry->size;
+        }
+        if (total != len) {
+            fprintf(stderr, "reader %u: entries add up to %zu, length is %zu\n", self->id, total, len);
+            self->errors++;
+        }
+        pthread_mutex_unlock(&buffer_lock);
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned writers = DEFAULT_WRITERS;
+    unsigned readers = DEFAULT_READERS;
+    size_t ops = DEFAULT_OPS;
+    int opt;
+    while ((opt = getopt(argc, argv, "w:r:n:")) != -1) {
+        switch (opt) {
+        case 'w':
+            writers = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            readers = strtoul(optarg, NULL, 10);
+            break;
+        case 'n':
+            ops = strtoull(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-w writers] [-r readers] [-n ops_per_thread]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (writers < 1 || writers > MAX_WRITERS) {
+        fprintf(stderr, "writers must be between 1 and %d\n", MAX_WRITERS);
+        return 1;
+    }
+
+    unsigned nthreads = writers + readers;
+    struct stress_thread *threads = calloc(nthreads, sizeof(struct stress_thread));
+    if (threads == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    aesd_circular_buffer_init(&buffer);
+    for (unsigned i = 0; i < nthreads; i++) {
+        threads[i].id = i < writers ? i : i - writers;
+        threads[i].writers = writers;
+        threads[i].ops = ops;
+        threads[i].rng = 0x9e3779b97f4a7c15ULL * (i + 1);
+        if (pthread_create(&threads[i].thread, NULL, i < writers ? writer_thread : reader_thread, &threads[i]) != 0) {
+            fprintf(stderr, "pthread_create failed\n");
+            return 1;
+        }
+    }
+
+    size_t errors = 0;
+    for (unsigned i = 0; i < nthreads; i++) {
+        pthread_join(threads[i].thread, NULL);
+        errors += threads[i].errors;
+    }
+
+    uint8_t index;
+    struct aesd_buffer_entry *entry;
+    AESD_CIRCULAR_BUFFER_FOREACH(entry, &buffer, index) {
+        free((char *)entry->buffptr);
+    }
+    free(threads);
+
+    printf("%u writers, %u readers, %zu ops each, capacity %d: %zu errors\n",
+           writers, readers, ops, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, errors);
+    return errors == 0 ? 0 : 1;
+}